@@ -0,0 +1,34 @@
+#!/bin/sh
+# bench_dist.sh — DPU compute time of the DIST modes across D and K
+#
+#   ./bench_dist.sh [points] [make options...]   e.g. ./bench_dist.sh 1048576 FEATURE=int8
+#
+# Each mode is built into _bench/<mode>/bin and run from _bench/<mode> (the
+# host loads ./bin/kmeans_dpu). Prints the DPU compute time in ms per launch
+# set, i.e. the "compute" column of the host's Timing line, for a fixed
+# number of iterations.
+set -e
+N=${1:-262144}
+[ $# -gt 0 ] && shift
+MODES="direct lut expand"
+ITERS=10
+
+for m in $MODES; do
+    make -s BUILDDIR=_bench/$m/bin DIST=$m "$@" \
+        _bench/$m/bin/kmeans_host _bench/$m/bin/kmeans_dpu
+done
+
+printf "%4s %4s" D K
+for m in $MODES; do printf " %10s" "$m"; done
+printf "\n"
+for D in 2 4 8 16; do
+    for K in 5 10 20; do
+        printf "%4s %4s" $D $K
+        for m in $MODES; do
+            t=$(cd _bench/$m && ./bin/kmeans_host -p $N -f $D -c $K -i $ITERS -t -1 -s -1 |
+                sed -n 's/.*compute *\([0-9.]*\).*/\1/p')
+            printf " %10s" "$t"
+        done
+        printf "\n"
+    done
+done
@@ -0,0 +1,135 @@
+/* bench_merge.c — host merge time vs. number of DPUs (no DPU hardware needed)
+ *
+ * Builds NR synthetic partial records (layout in common.h) and times
+ *   serial    one thread folds all NR records (the old gc[k]+=lc[k] loop)
+ *   per-rank  one thread per rank folds its DPUs and merges into the
+ *             running global accumulator (what gather_rank() does); the
+ *             threads persist across repetitions like the SDK rank threads
+ * for NR = 64 … 2560 in steps of one rank. Each NR starts its own rank
+ * threads and barriers, so only the ranks in use take part in the
+ * hand-off; both paths reset the accumulator every repetition.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "reduce.h"
+
+#define DPUS_PER_RANK 64
+#define MAX_DPUS      2560
+
+typedef struct {
+    const uint8_t *recs;
+    size_t         rb;
+    uint32_t       first, n;
+    uint64_t      *cnt;
+    acc_sum_t     *sum;
+    global_acc_t  *acc;
+} rank_job_t;
+
+static pthread_barrier_t go, done;
+static volatile int quit;
+
+static void *rank_worker(void *arg)
+{
+    rank_job_t *j = arg;
+    for (;;) {
+        pthread_barrier_wait(&go);
+        if (quit) break;
+        rec_fold(j->cnt, j->sum, j->recs, j->rb, j->first, j->n,
+                 j->acc->K, j->acc->D);
+        acc_merge(j->acc, j->cnt, j->sum);
+        pthread_barrier_wait(&done);
+    }
+    return NULL;
+}
+
+static double now_ms(void)
+{
+    struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned K = MAX_CLUSTERS, D = MAX_FEATURES, reps = 50;
+    if (argc == 4) { K = atoi(argv[1]); D = atoi(argv[2]); reps = atoi(argv[3]); }
+    else if (argc != 1) {
+        fprintf(stderr, "Usage: %s <clusters> <features> <reps>\n", argv[0]);
+        return 1;
+    }
+    if (K == 0 || D == 0 || K > MAX_CLUSTERS || D > MAX_FEATURES || reps == 0) {
+        fprintf(stderr, "need 1<=K<=%d, 1<=D<=%d, reps>=1\n", MAX_CLUSTERS, MAX_FEATURES);
+        return 1;
+    }
+
+    const size_t rb = rec_bytes(K, D, 1);
+    const uint32_t max_ranks = MAX_DPUS / DPUS_PER_RANK;
+    uint8_t  *recs = malloc(MAX_DPUS * rb);
+    uint64_t *cnt  = malloc((size_t)max_ranks * K * sizeof *cnt);
+    acc_sum_t *sum = malloc((size_t)max_ranks * K * D * sizeof *sum);
+    global_acc_t acc = { PTHREAD_MUTEX_INITIALIZER,
+                         malloc(K * sizeof(uint64_t)),
+                         malloc((size_t)K * D * sizeof(acc_sum_t)), K, D };
+    rank_job_t *jobs = malloc(max_ranks * sizeof *jobs);
+    pthread_t  *th   = malloc(max_ranks * sizeof *th);
+    if (!recs || !cnt || !sum || !acc.cnt || !acc.sum || !jobs || !th) {
+        perror("malloc"); return 1;
+    }
+    for (size_t i = 0; i < MAX_DPUS * rb; ++i) recs[i] = (uint8_t)(rand() & 0x7);
+#if SPARSE
+    /* every cluster listed: the fold's worst case */
+    for (uint32_t i = 0; i < MAX_DPUS; ++i) {
+        uint8_t *rec = recs + (size_t)i * rb;
+        ((rec_hdr_t *)rec)->entries = K;
+        for (uint32_t k = 0; k < K; ++k)
+            ((rec_entry_t *)(rec + rec_ent_off() + k * rec_ent_bytes(D)))->k = k;
+    }
+#endif
+
+    for (uint32_t q = 0; q < max_ranks; ++q)
+        jobs[q] = (rank_job_t){ recs, rb, q * DPUS_PER_RANK, DPUS_PER_RANK,
+                                &cnt[(size_t)q * K], &sum[(size_t)q * K * D], &acc };
+
+    printf("K=%u D=%u record=%zu B reps=%u\n", K, D, rb, reps);
+    printf("%6s %6s %12s %12s %8s\n", "DPUs", "ranks", "serial_ms", "per_rank_ms", "speedup");
+
+    for (uint32_t nr = DPUS_PER_RANK; nr <= MAX_DPUS; nr += DPUS_PER_RANK) {
+        const uint32_t ranks = nr / DPUS_PER_RANK;
+
+        double t0 = now_ms();
+        for (unsigned r = 0; r < reps; ++r) {
+            acc_reset(&acc);
+            rec_fold(acc.cnt, acc.sum, recs, rb, 0, nr, K, D);
+        }
+        double serial = (now_ms() - t0) / reps;
+
+        quit = 0;
+        pthread_barrier_init(&go, NULL, ranks + 1);
+        pthread_barrier_init(&done, NULL, ranks + 1);
+        for (uint32_t q = 0; q < ranks; ++q)
+            pthread_create(&th[q], NULL, rank_worker, &jobs[q]);
+        t0 = now_ms();
+        for (unsigned r = 0; r < reps; ++r) {
+            acc_reset(&acc);
+            pthread_barrier_wait(&go);
+            pthread_barrier_wait(&done);
+        }
+        double per_rank = (now_ms() - t0) / reps;
+        quit = 1;
+        pthread_barrier_wait(&go);
+        for (uint32_t q = 0; q < ranks; ++q) pthread_join(th[q], NULL);
+        pthread_barrier_destroy(&go);
+        pthread_barrier_destroy(&done);
+
+        printf("%6u %6u %12.4f %12.4f %8.2f\n", nr, ranks, serial, per_rank, serial / per_rank);
+    }
+
+    free(recs); free(cnt); free(sum); free(acc.cnt); free(acc.sum);
+    free(jobs); free(th);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+# bench_mpi.sh — kmeans_mpi from 1 to N nodes: compute versus communication
+#
+#   make mpi && ./bench_mpi.sh > mpi.csv
+#
+# Two sweeps over NODES_LIST: strong scaling keeps N points in total, weak
+# scaling gives every node PTS_NODE points. Each point runs ITERS iterations
+# (-i ITERS -t -1 -s -1, REPS times, medians kept) through
+#   $MPIRUN -np <nodes> $MPIFLAGS ./bin/kmeans_mpi
+# so MPIFLAGS places one process per node, e.g. with Open MPI
+#   MPIFLAGS="--hostfile hosts --map-by ppr:1:node" ./bench_mpi.sh
+# compute_ms is the slowest node's launches and local gathers, comm_ms that
+# same node's Allreduce and broadcast time (the network's share; faster
+# nodes also wait for it there), comm_pct comm_ms over the loop, and
+# comm_max_ms the largest comm of any node (mostly that waiting). Settings
+# from the environment:
+#
+#   NODES_LIST N PTS_NODE D K ITERS REPS MPIRUN MPIFLAGS
+#
+# One CSV row per run on stdout; failures are reported on stderr.
+set -e
+NODES_LIST=${NODES_LIST:-"1 2 4 8"}
+N=${N:-4194304}; PTS_NODE=${PTS_NODE:-1048576}
+D=${D:-8}; K=${K:-16}; ITERS=${ITERS:-10}; REPS=${REPS:-3}
+MPIRUN=${MPIRUN:-mpirun}; MPIFLAGS=${MPIFLAGS:-}
+
+median() { sort -n | awk '{ v[NR] = $1 } END { if (NR) print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'; }
+
+# run <sweep> <nodes> <points>: one CSV row
+run() {
+    sw=$1; np=$2; n=$3; out=_bench/mpi_run.txt
+    mkdir -p _bench; : > $out
+    i=0
+    while [ $i -lt $REPS ]; do
+        $MPIRUN -np $np $MPIFLAGS ./bin/kmeans_mpi -p $n -f $D -c $K -i $ITERS -t -1 -s -1 \
+            >> $out || return 1
+        i=$((i + 1))
+    done
+    it=$(sed -n 's/^DPU final after \([0-9]*\).*/\1/p' $out | tail -1)
+    setup=$(sed -n 's/^Timing (ms):  setup \([0-9.]*\).*/\1/p' $out | median)
+    loop=$(sed -n 's/^Timing (ms):.* loop \([0-9.]*\).*/\1/p' $out | median)
+    comp=$(sed -n 's/^Nodes (ms):   compute max \([0-9.]*\).*/\1/p' $out | median)
+    comm=$(sed -n 's/^Nodes (ms):.* comm of that node \([0-9.]*\).*/\1/p' $out | median)
+    cmax=$(sed -n 's/^Nodes (ms):.* comm of that node [0-9.]* max \([0-9.]*\).*/\1/p' $out | median)
+    awk -v sw=$sw -v np=$np -v n=$n -v d=$D -v k=$K -v it=$it -v s=$setup -v l=$loop \
+        -v c=$comp -v m=$comm -v x=$cmax 'BEGIN {
+        printf "%s,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.1f,%.3f,%.4g\n", sw, np, n, d, k, it,
+            s, l, c, m, (l > 0 ? 100 * m / l : 0), x, (l > 0 ? n * it / l * 1e3 : 0) }'
+}
+
+try() { run "$@" || echo "failed: $*" >&2; }
+
+echo "sweep,nodes,points,features,clusters,iters,setup_ms,loop_ms,compute_ms,comm_ms,comm_pct,comm_max_ms,points_per_s"
+for np in $NODES_LIST; do try strong $np $N; done
+for np in $NODES_LIST; do try weak $np $((np * PTS_NODE)); done
@@ -0,0 +1,130 @@
+#!/bin/sh
+# bench_suite.sh — kernel variants across N, D, K, NR_DPUS and NR_TASKLETS
+#
+#   ./bench_suite.sh [make options...] > suite.csv      e.g. ./bench_suite.sh STATS=0
+#
+# Every variant is built per NR_DPUS / NR_TASKLETS pair into
+# _bench/suite/<variant>_<dpus>_<tasklets>/bin and run from there (the hosts
+# load ./bin/kmeans_dpu). Each sweep moves one parameter away from the base
+# point; the NR_DPUS sweep keeps PTS_DPU points per DPU (weak scaling), so
+# its gather_pct column shows where the host gather and merge take over the
+# iteration. Variants of this tree run a fixed ITERS iterations with -w WARMUP
+# -r REPS in one process and are built with STATS=1 for the DMA column (pass
+# STATS=0 for counter-free timings); the legacy trees v1, v2 and version1
+# stop on their own and are run WARMUP + REPS times. Times are medians of the
+# timed runs. The sweeps and variants can be set from the environment:
+#
+#   VARIANTS  int16 async local dynamic prune lut expand int8 v1 v2 version1
+#   N_LIST D_LIST K_LIST DPU_LIST TASKLET_LIST, base N D K DPUS TASKLETS
+#
+# One CSV row per run on stdout; builds and failures are reported on stderr.
+set -e
+VARIANTS=${VARIANTS:-"int16 async local dynamic prune lut expand int8 v1 v2 version1"}
+N=${N:-1048576}; D=${D:-8}; K=${K:-16}; DPUS=${DPUS:-512}; TASKLETS=${TASKLETS:-12}
+N_LIST=${N_LIST:-"65536 262144 1048576 4194304"}
+D_LIST=${D_LIST:-"2 4 8 16"}
+K_LIST=${K_LIST:-"4 8 16 20"}
+DPU_LIST=${DPU_LIST:-"64 128 256 512 1024 2048 2560"}
+TASKLET_LIST=${TASKLET_LIST:-"1 2 4 8 12 16"}
+PTS_DPU=${PTS_DPU:-4096}
+ITERS=${ITERS:-10}; WARMUP=${WARMUP:-1}; REPS=${REPS:-3}
+TOP=$(pwd)
+
+src_of() {
+    case $1 in v1|v2|version1) echo "$TOP/$1" ;; *) echo "$TOP" ;; esac
+}
+opts_of() {
+    case $1 in
+        async)      echo ASYNC=1 ;;
+        local)      echo LOCAL_STEPS=4 ;;
+        dynamic)    echo DYNAMIC=1 ;;
+        prune)      echo PRUNE=1 ;;
+        lut)        echo DIST=lut ;;
+        expand)     echo DIST=expand ;;
+        int8)       echo FEATURE=int8 ;;
+    esac
+}
+
+# build <variant> <dpus> <tasklets> [make options]: prints the run directory
+build() {
+    v=$1; nd=$2; nt=$3; shift 3
+    dir=$TOP/_bench/suite/${v}_${nd}_${nt}
+    echo "building $v NR_DPUS=$nd NR_TASKLETS=$nt" >&2
+    make -s -C "$(src_of $v)" BUILDDIR="$dir/bin" NR_DPUS=$nd NR_TASKLETS=$nt \
+        STATS=1 $(opts_of $v) "$@" "$dir/bin/kmeans_host" "$dir/bin/kmeans_dpu" >&2 ||
+        return 1
+    echo "$dir"
+}
+
+median() { sort -n | awk '{ v[NR] = $1 } END { if (NR) print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'; }
+
+# run <variant> <dir> <sweep> <n> <d> <k> <dpus> <tasklets>: one CSV row
+run() {
+    v=$1; dir=$2; sw=$3; n=$4; d=$5; k=$6; nd=$7; nt=$8
+    case $v in
+    v1|v2|version1)
+        out=$dir/out.txt; : > "$out"
+        i=0
+        while [ $i -lt $((WARMUP + REPS)) ]; do
+            (cd "$dir" && ./bin/kmeans_host $n $d $k) > "$dir/run.txt" || return 1
+            [ $i -ge $WARMUP ] && cat "$dir/run.txt" >> "$out"
+            i=$((i + 1))
+        done
+        it=$(sed -n 's/^DPU final after \([0-9]*\).*/\1/p' "$dir/run.txt")
+        setup=$(sed -n 's/^DPU Set Up Time: \([0-9.]*\).*/\1/p' "$out" | median)
+        loop=$(sed -n 's/^DPU Implementation elapsed time (without set up): \([0-9.]*\).*/\1/p' "$out" | median)
+        rd=$(sed -n 's/^Read from DPU to Host time: \([0-9.]*\).*/\1/p' "$out" | median)
+        awk -v v=$v -v sw=$sw -v n=$n -v d=$d -v k=$k -v nd=$nd -v nt=$nt -v it=$it \
+            -v s=$setup -v l=$loop -v r=$rd 'BEGIN {
+            printf "%s,%s,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%.4g,,%.1f\n",
+                v, sw, n, d, k, nd, nt, it, s, l, (l > 0 ? n * it / l * 1e3 : 0),
+                (l > 0 ? 100 * r / l : 0) }'
+        ;;
+    *)
+        (cd "$dir" && ./bin/kmeans_host -p $n -f $d -c $k -i $ITERS -t -1 -s -1 \
+            -w $WARMUP -r $REPS) > "$dir/run.txt" || return 1
+        awk -v v=$v -v sw=$sw -v n=$n -v d=$d -v k=$k -v nd=$nd -v nt=$nt -v it=$ITERS '
+            /^Timing/     { for (i = 1; i < NF; ++i) if ($i == "setup") s = $(i + 1) }
+            /^Phases/     { for (i = 1; i < NF; ++i) {
+                                if ($i == "broadcast") b = $(i + 1)
+                                if ($i == "scatter")   c = $(i + 1)
+                                if ($i == "launch")    l = $(i + 1)
+                                if ($i == "gather")    g = $(i + 1)
+                                if ($i == "merge")     m = $(i + 1) } }
+            /^Runs/       { for (i = 1; i < NF; ++i) {
+                                if ($i == "median") t = $(i + 1)
+                                if ($i == "points/s,") p = $(i - 1) } }
+            /^DPU phases/ { for (i = 1; i < NF; ++i) if ($i == "DMA" && $(i + 1) == "bytes/point") y = $(i - 1) }
+            END { tot = b + c + l + g + m
+                  printf "%s,%s,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%s,%s,%.1f\n", v, sw, n, d, k,
+                      nd, nt, it, s, t, p, y, (tot > 0 ? 100 * (g + m) / tot : 0) }' "$dir/run.txt"
+        ;;
+    esac
+}
+
+try() { run "$@" || echo "failed: $*" >&2; }
+
+echo "variant,sweep,points,features,clusters,dpus,tasklets,iters,setup_ms,loop_ms,points_per_s,dma_bytes_per_point,gather_pct"
+for v in $VARIANTS; do
+    if dir=$(build $v $DPUS $TASKLETS "$@"); then
+        for n in $N_LIST; do try $v "$dir" N $n $D $K $DPUS $TASKLETS; done
+        for d in $D_LIST; do try $v "$dir" D $N $d $K $DPUS $TASKLETS; done
+        for k in $K_LIST; do try $v "$dir" K $N $D $k $DPUS $TASKLETS; done
+    else
+        echo "failed: build $v $DPUS $TASKLETS" >&2
+    fi
+    for nd in $DPU_LIST; do
+        if dir=$(build $v $nd $TASKLETS "$@"); then
+            try $v "$dir" NR_DPUS $((nd * PTS_DPU)) $D $K $nd $TASKLETS
+        else
+            echo "failed: build $v $nd $TASKLETS" >&2
+        fi
+    done
+    for nt in $TASKLET_LIST; do
+        if dir=$(build $v $DPUS $nt "$@"); then
+            try $v "$dir" NR_TASKLETS $N $D $K $DPUS $nt
+        else
+            echo "failed: build $v $DPUS $nt" >&2
+        fi
+    done
+done
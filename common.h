@@ -1,50 +1,393 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+/* definitions shared by host_kmeans.c and dpu_kmeans.c */
+
 #include <stdint.h>
+#include <stddef.h>
 
-/* define feature_t, sum_t, count_t differently for host vs DPU: */
-#ifdef __UPMEM__
-  /* DPU side => short for features, long for sums, etc. */
-  typedef int16_t  feature_t;
-  typedef int64_t  sum_t;
-  typedef uint32_t count_t;
-#else
-  /* host side => double for features, sums, etc. */
-  typedef double   feature_t;
-  typedef double   sum_t;
-  typedef unsigned int count_t;
+#ifndef FEATURE_BITS
+#define FEATURE_BITS 16
 #endif
 
-// /* basic DPU defaults */
-// #ifndef NR_DPUS
-// #define NR_DPUS 8
-// #endif
-// #ifndef NR_TASKLETS
-// #define NR_TASKLETS 16
-// #endif
+/*
+ * Tiled mode (TILED=1): the centroids live in MRAM and are streamed through
+ * WRAM one tile at a time, and each tasklet's per-cluster counts and sums
+ * are MRAM rows, so K and D are bounded by MRAM rather than WRAM. Its
+ * default limits are K <= 1024 and D <= 128 (64 for int32, 32 for double:
+ * a DMA batch must still hold a few points).
+ */
+#ifndef TILED
+#define TILED 0
+#endif
+
+/* limits of the DPU kernel's MRAM/WRAM arrays */
+#ifndef MAX_POINTS_DPU
+#define MAX_POINTS_DPU 65536
+#endif
+#ifndef MAX_FEATURES
+# if !TILED
+#  define MAX_FEATURES 16
+# elif FEATURE_BITS == 64
+#  define MAX_FEATURES 32
+# elif FEATURE_BITS == 32
+#  define MAX_FEATURES 64
+# else
+#  define MAX_FEATURES 128
+# endif
+#endif
+#ifndef MAX_CLUSTERS
+# if TILED
+#  define MAX_CLUSTERS 1024
+# else
+#  define MAX_CLUSTERS 20
+# endif
+#endif
+
+/*
+ * Restarts (NINIT > 1): up to NINIT sets of K centroids stacked in
+ * c_clusters, set r as clusters r*K .. r*K+K-1 everywhere (centroids,
+ * records). Every point is read once and assigned in each set; t_labels and
+ * the changed count follow set 0.
+ */
+#ifndef NINIT
+#define NINIT 1
+#endif
 
-/* structure broadcast from host to DPU each iteration */
+/* per-DPU arguments pushed by the host ("DPU_INPUT_ARGUMENTS") */
 typedef struct {
     uint32_t dpu_points;
     uint32_t nfeatures;
     uint32_t nclusters;
-    uint32_t max_points_per_dpu;
+    uint32_t mb_offset;      /* mini-batch: first group of SLICE_ALIGN points */
+    uint32_t mb_stride;      /* ... and every mb_stride-th group after it;
+                                0 or 1 = every point                        */
+    uint32_t nsets;          /* centroid sets of nclusters each (0 = 1)     */
+    uint32_t steps;          /* LOCAL_STEPS builds: Lloyd steps (0 = 1)     */
 } dpu_arguments_t;
 
-/* default to "t_features" in the DPU kernel. */
-#ifndef DPU_MRAM_HEAP_POINTER_NAME
-#define DPU_MRAM_HEAP_POINTER_NAME "t_features"
+/*
+ * Feature type of the kernel family, FEATURE in the Makefile (FEATURE_BITS):
+ *    8  int8   features, |q| <= 127
+ *   16  int16  features, |q| <= 32767 (default)
+ *   32  int32  features, |q| <= 2^19 - 1 so weighted squared distances fit
+ *       int64 and their square roots (the Hamerly bounds) fit uint32
+ *   64  double features, used as they are (no quantisation)
+ * The host quantises to the same type (quant.h).
+ */
+#if FEATURE_BITS == 8
+typedef int8_t   feat_t;
+# define FEAT_QMAX  127
+# define FEAT_NAME  "int8"
+#elif FEATURE_BITS == 16
+typedef int16_t  feat_t;
+# define FEAT_QMAX  32767
+# define FEAT_NAME  "int16"
+#elif FEATURE_BITS == 32
+typedef int32_t  feat_t;
+# define FEAT_QMAX  ((1 << 19) - 1)
+# define FEAT_NAME  "int32"
+#elif FEATURE_BITS == 64
+typedef double   feat_t;
+# define FEATURE_FLOAT 1
+# define FEAT_NAME  "double"
+#else
+# error "FEATURE_BITS must be 8, 16, 32 or 64"
+#endif
+#ifndef FEATURE_FLOAT
+#define FEATURE_FLOAT 0
+#endif
+#define FEAT_BYTES (FEATURE_BITS / 8)
+
+/*
+ * Per-DPU feature sums (rec_sum_t), host-wide sums (acc_sum_t) and squared
+ * distances (dist_t). Integer sums stay 32-bit while FEAT_QMAX times the
+ * per-DPU capacity fits.
+ */
+#if FEATURE_FLOAT
+typedef double   rec_sum_t;
+# define REC_SUM_BYTES 8
+typedef double   acc_sum_t;
+typedef double   dist_t;
+# define DIST_MAX __DBL_MAX__
+#else
+# if FEAT_QMAX * MAX_POINTS_DPU <= 2147483647
+typedef int32_t  rec_sum_t;
+#  define REC_SUM_BYTES 4
+# else
+typedef int64_t  rec_sum_t;
+#  define REC_SUM_BYTES 8
+# endif
+typedef int64_t  acc_sum_t;
+typedef int64_t  dist_t;
+# define DIST_MAX INT64_MAX
+#endif
+
+/*
+ * Distance evaluation in the kernel (DIST in the Makefile, DIST_MODE):
+ *   DIST_DIRECT  sum of squared differences (default)
+ *   DIST_LUT     squared |difference| read from a WRAM table of squares for
+ *                |difference| < LUT_SIZE, multiplied above (int8/int16)
+ *   DIST_EXPAND  ||c||^2 - 2 x.c with ||c||^2 from the host ("c_norms");
+ *                ||x||^2 is the same for every centroid and only added
+ *                where the true distance is needed (PRUNE bounds)
+ * All three give the same assignments.
+ */
+#define DIST_DIRECT 0
+#define DIST_LUT    1
+#define DIST_EXPAND 2
+#ifndef DIST_MODE
+#define DIST_MODE DIST_DIRECT
+#endif
+#if DIST_MODE == DIST_LUT && (FEATURE_FLOAT || FEATURE_BITS == 32)
+# error "DIST=lut needs int8 or int16 features"
 #endif
 
-/* 8-byte alignment helper */
+/* per-feature distance weights ("c_wshift"): the kernel shifts the squared
+   difference of feature f left by c_wshift[f] (see quant.h) */
+#define WSHIFT_BYTES ((MAX_FEATURES + 7) & ~7)
+
+/* 8-byte alignment helper (MRAM DMA and host transfers are 8-byte granular) */
 static inline size_t align8(size_t x) {
     return (x + 7UL) & ~7UL;
 }
 
-/* block size for the DPU DMA buffer */
-#ifndef BLOCK_SIZE
-#define BLOCK_SIZE 256
+/*
+ * Per-DPU partial result record ("centers_mram"), one contiguous block so the
+ * host fetches header, counts and sums with a single transfer:
+ *
+ *   rec_hdr_t hdr          done flag, steps run, pruned and changed points
+ *   uint64_t  count[K]     points assigned to each cluster
+ *   rec_sum_t sum[K*D]     per-cluster feature sums
+ *   far_point_t far[R][FAR_SLOTS]  per centroid set, the DPU's farthest
+ *                          points from their centroids, farthest first
+ *                          (re-seeds empty clusters)
+ *   dist_t    sse[R]       per set, the summed squared distances of the
+ *                          scanned points to their centroids (saturating;
+ *                          pruned points are left out)
+ *
+ * K counts the clusters of all R sets. The sums and the record are padded
+ * to 8 bytes.
+ *
+ * Sparse records (SPARSE=1) list only the clusters the DPU's points fell
+ * in, so the host fetches the used prefix instead of K*D sums:
+ *
+ *   rec_hdr_t hdr          as above; entries = clusters listed
+ *   far_point_t far[NINIT][FAR_SLOTS], dist_t sse[NINIT]   as above
+ *   entry[entries]         rec_entry_t, then rec_sum_t sum[D] padded to
+ *                          8 bytes, in cluster order
+ */
+#ifndef SPARSE
+#define SPARSE 0
+#endif
+
+typedef struct {
+    uint32_t done;                   /* set once counts and sums are written  */
+    uint32_t pruned;                 /* points whose distance scan was skipped */
+    uint32_t changed;                /* points whose label changed            */
+    uint32_t entries;                /* SPARSE: cluster entries that follow   */
+    uint32_t steps;                  /* Lloyd steps of the launch (LOCAL_STEPS) */
+    uint32_t reserved;               /* pads the header to 8 bytes            */
+} rec_hdr_t;
+
+typedef struct {
+    uint32_t k;                      /* cluster                               */
+    uint32_t count;                  /* its points on the DPU (> 0)           */
+} rec_entry_t;
+
+/*
+ * Phase statistics (STATS=1): every tasklet adds the cycles of each phase of
+ * a launch to its entry of "phase_stats", summed over launches like
+ * busy_cycles, and counts the bytes its point batches move:
+ *
+ *   dma     MRAM reads and writes of the point batches (features, labels,
+ *           bounds)
+ *   dist    distance scans, pruning tests and label updates (TILED: with
+ *           the centroid tiles streamed from MRAM)
+ *   acc     adding the points into the counts and sums
+ *   reduce  the end-of-launch reduction of the copies and the record writes
+ *
+ * Off by default: the counter reads sit inside the point loop.
+ */
+#ifndef STATS
+#define STATS 0
+#endif
+
+typedef struct {
+    uint64_t dma, dist, acc, reduce; /* cycles                              */
+    uint64_t dma_bytes;              /* bytes of the point batches' DMA     */
+} phase_stats_t;
+
+#define FAR_SLOTS 4
+#define FAR_NONE  0xFFFFFFFFu
+typedef struct {
+    dist_t   d;                      /* squared distance to its centroid     */
+    uint32_t idx;                    /* point on the DPU, FAR_NONE if unused */
+    uint32_t reserved;
+} far_point_t;
+
+/* label of a point in t_labels before its first assignment */
+#define LABEL_NONE 0xFFFFu
+#if MAX_CLUSTERS >= LABEL_NONE
+# error "labels are 16-bit: MAX_CLUSTERS must stay below LABEL_NONE"
+#endif
+
+#if SPARSE
+static inline size_t rec_far_off(uint32_t K, uint32_t D) {
+    (void)K; (void)D;
+    return sizeof(rec_hdr_t);
+}
+static inline size_t rec_sse_off(uint32_t K, uint32_t D, uint32_t R) {
+    (void)R;
+    return rec_far_off(K, D) + (size_t)NINIT * FAR_SLOTS * sizeof(far_point_t);
+}
+static inline size_t rec_ent_off(void) {
+    return rec_sse_off(0, 0, 0) + (size_t)NINIT * sizeof(dist_t);
+}
+static inline size_t rec_ent_bytes(uint32_t D) {
+    return sizeof(rec_entry_t) + align8((size_t)D * sizeof(rec_sum_t));
+}
+/* room for every cluster: the fetch stops after the used entries */
+static inline size_t rec_bytes(uint32_t K, uint32_t D, uint32_t R) {
+    (void)R;
+    return rec_ent_off() + (size_t)K * rec_ent_bytes(D);
+}
+#define REC_BYTES_MAX (sizeof(rec_hdr_t) + NINIT * (FAR_SLOTS * sizeof(far_point_t) + \
+                       sizeof(dist_t)) + MAX_CLUSTERS * (sizeof(rec_entry_t) + \
+                       ((MAX_FEATURES * sizeof(rec_sum_t) + 7) & ~7UL)))
+#else
+static inline size_t rec_cnt_off(void) {
+    return sizeof(rec_hdr_t);
+}
+static inline size_t rec_sum_off(uint32_t K) {
+    return rec_cnt_off() + (size_t)K * sizeof(uint64_t);
+}
+static inline size_t rec_far_off(uint32_t K, uint32_t D) {
+    return align8(rec_sum_off(K) + (size_t)K * D * sizeof(rec_sum_t));
+}
+static inline size_t rec_sse_off(uint32_t K, uint32_t D, uint32_t R) {
+    return rec_far_off(K, D) + (size_t)R * FAR_SLOTS * sizeof(far_point_t);
+}
+static inline size_t rec_bytes(uint32_t K, uint32_t D, uint32_t R) {
+    return rec_sse_off(K, D, R) + (size_t)R * sizeof(dist_t);
+}
+#define REC_BYTES_MAX (((sizeof(rec_hdr_t) + MAX_CLUSTERS * sizeof(uint64_t) + \
+                         MAX_CLUSTERS * MAX_FEATURES * sizeof(rec_sum_t) + 7) & ~7UL) + \
+                       NINIT * (FAR_SLOTS * sizeof(far_point_t) + sizeof(dist_t)))
+#endif
+
+/*
+ * k-means|| seeding launches (c_seed.mode != SEED_OFF; see the host's
+ * kmeans_par_seed). Every point keeps the squared distance to its nearest
+ * seed candidate so far and that candidate's id (t_seed):
+ *   SEED_UPDATE  fold in the n candidates in c_clusters, ids base..base+n-1
+ *                (base 0 starts over), and sum the distances ("seed_psi")
+ *   SEED_SAMPLE  take each point with probability d / span, listing its
+ *                index in "seed_idx" and the count in seed_out
+ *   SEED_WEIGH   count the points nearest to each of the n candidates
+ *                ("seed_w")
+ * A round takes about SEED_OVERSAMPLE*K points over all DPUs; seed_idx holds
+ * four times that at MAX_CLUSTERS on one DPU, and a DPU that takes more
+ * reports its full count so the host refuses the round rather than keep
+ * an arbitrary subset.
+ */
+enum { SEED_OFF = 0, SEED_UPDATE = 1, SEED_SAMPLE = 2, SEED_WEIGH = 3 };
+
+#define SEED_OVERSAMPLE 2      /* about 2K candidates per round */
+#define SEED_OUT_MAX  (4 * SEED_OVERSAMPLE * MAX_CLUSTERS)
+#define SEED_CAND_MAX (16 * MAX_CLUSTERS)
+
+typedef struct {
+    uint32_t mode;
+    uint32_t base;                   /* SEED_UPDATE: id of c_clusters[0]     */
+    uint32_t n;                      /* candidates in c_clusters / counted   */
+    uint32_t reserved;
+    uint64_t rng;                    /* SEED_SAMPLE: per-DPU random seed     */
+    dist_t   span;                   /* SEED_SAMPLE: total distance / oversampling */
+} seed_args_t;
+
+typedef struct {
+    uint32_t n;                      /* points taken (may exceed SEED_OUT_MAX) */
+    uint32_t reserved;
+} seed_out_t;
+
+typedef struct {
+    dist_t   d;                      /* to the nearest candidate so far      */
+    uint32_t owner;                  /* its id                               */
+    uint32_t reserved;
+} seed_state_t;
+
+/*
+ * Hamerly pruning (PRUNE=1). Every point keeps, next to t_features and its
+ * label in t_labels, an upper bound on the distance to its assigned centroid
+ * and a lower bound on the distance to every other centroid (t_bounds).
+ * The host broadcasts how far each centroid moved and half the distance to
+ * its nearest other centroid ("c_prune"). Distances are Euclidean, rounded
+ * outward to integers so the bounds stay conservative.
+ */
+#ifndef PRUNE
+#define PRUNE 0
+#endif
+#if PRUNE && FEATURE_FLOAT
+# error "PRUNE needs an integer FEATURE"
+#endif
+#if PRUNE && NINIT > 1
+# error "PRUNE keeps the bounds of one centroid set: NINIT must be 1"
+#endif
+#if TILED && (PRUNE || DIST_MODE == DIST_EXPAND)
+# error "TILED does not combine with PRUNE or DIST=expand"
+#endif
+
+/*
+ * Local steps (LOCAL_STEPS=<S>, S > 1): a launch asked for S steps
+ * (dpu_arguments_t.steps) runs S Lloyd steps. Between steps every DPU moves
+ * its copy of the centroids in c_clusters to the means of its own points
+ * (a cluster none of them fell in stays put) and assigns them again; the
+ * record holds the last step's partials, which the host merges as usual.
+ * The launch and boot cost is paid once per S steps, for updates that stay
+ * DPU-local between merges: the result is not the reference Lloyd's one
+ * (except on a single DPU).
+ */
+#ifndef LOCAL_STEPS
+#define LOCAL_STEPS 1
 #endif
+#if LOCAL_STEPS > 1 && (PRUNE || TILED)
+# error "LOCAL_STEPS moves the centroids within a launch: no PRUNE or TILED"
+#endif
+
+typedef struct {
+    uint32_t upper;                  /* >= d(x, c[label])                   */
+    uint32_t lower;                  /* <= d(x, c[j]) for every j != label  */
+} point_bound_t;
+
+typedef struct {
+    uint32_t drift[MAX_CLUSTERS];    /* ceil |c_k(now) - c_k(before)|       */
+    uint32_t half[MAX_CLUSTERS];     /* floor min_{j!=k} |c_k - c_j| / 2    */
+    uint32_t max_drift;              /* largest drift ...                   */
+    uint32_t max_drift_k;            /* ... its centroid                    */
+    uint32_t max_drift2;             /* largest drift of all other centroids */
+    uint32_t valid;                  /* 0: bounds not initialised, full scan */
+} prune_info_t;
+
+/*
+ * floor(sqrt(x)) by the digit-by-digit method: shifts and adds only, so it
+ * is cheap on the DPU, which has no 32-bit multiplier. *exact is cleared
+ * when x is not a perfect square (the ceiling is then one more).
+ */
+static inline uint32_t isqrt64(uint64_t x, int *exact) {
+    uint64_t r = 0, bit = 1ULL << 62;
+    while (bit > x) bit >>= 2;
+    while (bit) {
+        if (x >= r + bit) { x -= r + bit; r = (r >> 1) + bit; }
+        else r >>= 1;
+        bit >>= 2;
+    }
+    if (exact) *exact = (x == 0);
+    return (uint32_t)r;
+}
+static inline uint32_t isqrt64_ceil(uint64_t x) {
+    int exact; uint32_t r = isqrt64(x, &exact);
+    return exact ? r : r + 1;
+}
 
-#endif /* COMMON_H */
\ No newline at end of file
+#endif /* COMMON_H */
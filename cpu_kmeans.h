@@ -0,0 +1,196 @@
+#ifndef CPU_KMEANS_H
+#define CPU_KMEANS_H
+
+/*
+ * Host-side assignment pass in the kernel's types, shared by the CPU
+ * reference and the hybrid mode: every thread assigns a contiguous chunk of
+ * points against all centroids, accumulates counts and sums into its own
+ * partial and merges it into a global_acc_t (reduce.h).
+ *
+ * The centroids are transposed to [D][K] (cpu_transpose), so the innermost
+ * loop runs over contiguous centroids with one feature value of the point
+ * and one weight shift: plain loops that -ftree-vectorize (HOST_CFLAGS; GCC
+ * leaves them scalar at plain -O2) turns into SSE2 vectors, AVX2 ones with
+ * HOST_ARCH=-march=x86-64-v3 or -march=native. Distances are summed feature
+ * by feature like quant_dist2 and ties keep the lower cluster, so the
+ * assignments are exactly the kernel's.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "reduce.h"
+
+#define CPU_THREADS_MAX 256
+
+typedef struct {
+    /* in */
+    const feat_t  *pts;         /* n points, point 0 at dataset index first */
+    size_t         n, first;
+    const feat_t  *ct;          /* R*K centroids, transposed: [D][R*K]      */
+    const uint8_t *wshift;
+    uint32_t       D, K, R;     /* R centroid sets of K                     */
+    uint16_t      *labels;      /* set 0 label per point, NULL: not kept    */
+    dist_t        *dmin;        /* set 0 distance per point, NULL: not kept */
+    global_acc_t  *acc;         /* R*K counts and sums merge here           */
+    uint64_t      *cnt;         /* the thread's partial: [R*K], [R*K*D]     */
+    acc_sum_t     *sum;
+    /* out, as in the kernel's record; far[].idx counts from point 0 */
+    far_point_t    far[NINIT][FAR_SLOTS];
+    dist_t         sse[NINIT];
+    uint64_t       changed;
+    double         end_ms;      /* CLOCK_MONOTONIC when the chunk was done  */
+} cpu_part_t;
+
+/* c[K][D] -> ct[D][K] */
+static inline void cpu_transpose(const feat_t *c, feat_t *ct, uint32_t K, uint32_t D)
+{
+    for (uint32_t k = 0; k < K; ++k)
+        for (uint32_t f = 0; f < D; ++f)
+            ct[(size_t)f * K + k] = c[(size_t)k * D + f];
+}
+
+static inline void cpu_far_note(far_point_t *f, dist_t d, uint32_t i)
+{
+    if (d <= f[FAR_SLOTS - 1].d) return;
+    uint32_t s = FAR_SLOTS - 1;
+    for (; s > 0 && d > f[s - 1].d; --s) f[s] = f[s - 1];
+    f[s] = (far_point_t){ d, i, 0 };
+}
+
+static void *cpu_assign(void *arg)
+{
+    cpu_part_t *w = arg;
+    const uint32_t D = w->D, K = w->K, R = w->R, KT = K * R;
+    memset(w->cnt, 0, KT * sizeof *w->cnt);
+    memset(w->sum, 0, (size_t)KT * D * sizeof *w->sum);
+    for (uint32_t r = 0; r < R; ++r) {
+        for (uint32_t s = 0; s < FAR_SLOTS; ++s) w->far[r][s] = (far_point_t){ -1, FAR_NONE, 0 };
+        w->sse[r] = 0;
+    }
+    w->changed = 0;
+
+    dist_t d[MAX_CLUSTERS];
+    for (size_t i = 0; i < w->n; ++i) {
+        const feat_t *x = &w->pts[i * D];
+        for (uint32_t k = 0; k < KT; ++k) d[k] = 0;
+        for (uint32_t f = 0; f < D; ++f) {
+            const feat_t *cf = &w->ct[(size_t)f * KT];
+#if FEATURE_FLOAT
+            const double xf = x[f];
+            for (uint32_t k = 0; k < KT; ++k) {
+                const double t = xf - cf[k];
+                d[k] += t * t;
+            }
+#elif FEATURE_BITS <= 16
+            /* |difference| < 2^16: its square fits 32 bits unsigned */
+            const int32_t xf = x[f];
+            const uint32_t sh = w->wshift[f];
+            for (uint32_t k = 0; k < KT; ++k) {
+                const int32_t t = xf - cf[k];
+                const uint32_t a = (uint32_t)(t < 0 ? -t : t);
+                d[k] += (dist_t)((uint64_t)(a * a) << sh);
+            }
+#else
+            const int64_t xf = x[f];
+            const uint32_t sh = w->wshift[f];
+            for (uint32_t k = 0; k < KT; ++k) {
+                const int64_t t = xf - cf[k];
+                d[k] += (t * t) << sh;
+            }
+#endif
+        }
+        for (uint32_t r = 0; r < R; ++r) {
+            dist_t best = DIST_MAX; uint32_t bk = r * K;
+            for (uint32_t k = r * K; k < r * K + K; ++k)
+                if (d[k] < best) { best = d[k]; bk = k; }
+            w->cnt[bk]++;
+            acc_sum_t *sv = &w->sum[(size_t)bk * D];
+            for (uint32_t f = 0; f < D; ++f) sv[f] += x[f];
+            cpu_far_note(w->far[r], best, (uint32_t)i);
+            w->sse[r] = w->sse[r] > DIST_MAX - best ? DIST_MAX : w->sse[r] + best;
+            if (r) continue;
+            if (w->dmin) w->dmin[i] = best;
+            if (w->labels && w->labels[i] != bk) { w->labels[i] = (uint16_t)bk; w->changed++; }
+        }
+    }
+    acc_merge(w->acc, w->cnt, w->sum);
+    struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t);
+    w->end_ms = t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+    return NULL;
+}
+
+/*
+ * Pool of nt parts over the points [0, n) of pts, chunked evenly; the
+ * per-part partials are allocated once. cpu_start runs every part on a
+ * thread of its own (inline when a thread cannot be created), cpu_wait
+ * joins them.
+ */
+typedef struct {
+    uint32_t    nt;
+    cpu_part_t *part;
+    pthread_t  *th;
+    int        *started;
+} cpu_pool_t;
+
+/* returns 0 on success, -1 if the partials cannot be allocated */
+static inline int cpu_pool_init(cpu_pool_t *p, uint32_t nt, uint32_t KT, uint32_t D)
+{
+    if (nt < 1) nt = 1;
+    if (nt > CPU_THREADS_MAX) nt = CPU_THREADS_MAX;
+    p->nt = nt;
+    p->part = calloc(nt, sizeof *p->part);
+    p->th = malloc(nt * sizeof *p->th);
+    p->started = calloc(nt, sizeof *p->started);
+    if (!p->part || !p->th || !p->started) return -1;
+    for (uint32_t t = 0; t < nt; ++t) {
+        p->part[t].cnt = malloc(KT * sizeof *p->part[t].cnt);
+        p->part[t].sum = malloc((size_t)KT * D * sizeof *p->part[t].sum);
+        if (!p->part[t].cnt || !p->part[t].sum) return -1;
+    }
+    return 0;
+}
+
+/* split the n points (dataset index first..) over the parts; labels and
+   dmin, if given, are indexed like pts */
+static inline void cpu_pool_bind(cpu_pool_t *p, const feat_t *pts, size_t n, size_t first,
+                                 const feat_t *ct, const uint8_t *wshift,
+                                 uint32_t D, uint32_t K, uint32_t R,
+                                 uint16_t *labels, dist_t *dmin, global_acc_t *acc)
+{
+    for (uint32_t t = 0; t < p->nt; ++t) {
+        const size_t lo = n * t / p->nt, hi = n * (t + 1) / p->nt;
+        cpu_part_t *w = &p->part[t];
+        w->pts = pts + lo * D; w->n = hi - lo; w->first = first + lo;
+        w->ct = ct; w->wshift = wshift; w->D = D; w->K = K; w->R = R;
+        w->labels = labels ? labels + lo : NULL;
+        w->dmin = dmin ? dmin + lo : NULL;
+        w->acc = acc;
+    }
+}
+
+static inline void cpu_start(cpu_pool_t *p)
+{
+    for (uint32_t t = 0; t < p->nt; ++t) {
+        p->started[t] = pthread_create(&p->th[t], NULL, cpu_assign, &p->part[t]) == 0;
+        if (!p->started[t]) cpu_assign(&p->part[t]);
+    }
+}
+
+static inline void cpu_wait(cpu_pool_t *p)
+{
+    for (uint32_t t = 0; t < p->nt; ++t)
+        if (p->started[t]) { pthread_join(p->th[t], NULL); p->started[t] = 0; }
+}
+
+static inline void cpu_pool_free(cpu_pool_t *p)
+{
+    for (uint32_t t = 0; t < p->nt; ++t) { free(p->part[t].cnt); free(p->part[t].sum); }
+    free(p->part); free(p->th); free(p->started);
+}
+
+#endif /* CPU_KMEANS_H */
@@ -0,0 +1,135 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+/*
+ * Binary dataset file ("*.kmb"), written by kmeans_convert and memory-mapped
+ * by kmeans_host:
+ *
+ *   kmb_header_t                       (see below)
+ *   padding up to data_offset          (page aligned)
+ *   n_points rows of n_features values of type dtype, row-major
+ *
+ * A feature's real value is offset + stored * scale. Files with dtype int16
+ * are already in the DPU's format and are transferred straight from the
+ * mapping; other dtypes are quantised on load.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define KMB_MAGIC   "KMPIMBIN"
+#define KMB_VERSION 1
+#define KMB_ALIGN   4096
+
+enum { KMB_INT16 = 1, KMB_FLOAT32 = 2 };
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t dtype;          /* KMB_INT16 or KMB_FLOAT32                     */
+    uint64_t n_points;
+    uint32_t n_features;
+    uint32_t n_clusters;     /* suggested K (0 = none)                       */
+    double   scale;          /* real value = offset + stored * scale         */
+    double   offset;
+    uint64_t data_offset;    /* byte offset of the first row                 */
+} kmb_header_t;
+
+typedef struct {
+    kmb_header_t hdr;
+    void        *map;        /* whole file                                   */
+    size_t       map_bytes;
+    const void  *data;       /* first row                                    */
+} kmb_file_t;
+
+static inline size_t kmb_dtype_bytes(uint32_t dtype)
+{
+    return dtype == KMB_INT16 ? 2 : dtype == KMB_FLOAT32 ? 4 : 0;
+}
+
+/* real value of the i-th stored feature (row-major index) */
+static inline double kmb_value(const kmb_file_t *f, size_t i)
+{
+    double v = f->hdr.dtype == KMB_INT16 ? ((const int16_t *)f->data)[i]
+                                         : ((const float *)f->data)[i];
+    return f->hdr.offset + v * f->hdr.scale;
+}
+
+/* map path read-only; returns 0 on success, -1 after printing the error */
+static inline int kmb_open(const char *path, kmb_file_t *f)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { perror(path); return -1; }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror(path); close(fd); return -1; }
+    if ((size_t)st.st_size < sizeof(kmb_header_t)) {
+        fprintf(stderr, "%s: not a kmeans binary dataset (convert text files with kmeans_convert)\n", path);
+        close(fd); return -1;
+    }
+    f->map_bytes = (size_t)st.st_size;
+    f->map = mmap(NULL, f->map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (f->map == MAP_FAILED) { perror("mmap"); return -1; }
+
+    memcpy(&f->hdr, f->map, sizeof f->hdr);
+    const kmb_header_t *h = &f->hdr;
+    const size_t vb = kmb_dtype_bytes(h->dtype);
+    if (memcmp(h->magic, KMB_MAGIC, 8) != 0 || h->version != KMB_VERSION || !vb) {
+        fprintf(stderr, "%s: not a kmeans binary dataset (convert text files with kmeans_convert)\n", path);
+        munmap(f->map, f->map_bytes); return -1;
+    }
+    /* divide rather than multiply: the header's sizes are untrusted */
+    const uint64_t row = (uint64_t)h->n_features * vb;
+    if (h->data_offset > f->map_bytes ||
+        (row && h->n_points > (f->map_bytes - h->data_offset) / row)) {
+        fprintf(stderr, "%s: truncated (%llu points x %u features expected)\n", path,
+                (unsigned long long)h->n_points, h->n_features);
+        munmap(f->map, f->map_bytes); return -1;
+    }
+    f->data = (const char *)f->map + h->data_offset;
+    /* the rows are read front to back every iteration */
+    posix_madvise(f->map, f->map_bytes, POSIX_MADV_SEQUENTIAL);
+    return 0;
+}
+
+static inline void kmb_close(kmb_file_t *f)
+{
+    munmap(f->map, f->map_bytes);
+}
+
+/*
+ * Label file (kmeans_host -o): one label per point of the last assignment,
+ * uint8 when K <= 256 and uint16 otherwise, in host byte order with no
+ * header. It is created at full size and mapped, so the readback writes the
+ * labels straight into the page cache.
+ */
+typedef struct {
+    void  *map;
+    size_t bytes;
+} label_file_t;
+
+/* create path for n labels of w bytes; returns 0 on success, -1 after
+   printing the error */
+static inline int label_create(const char *path, uint64_t n, size_t w, label_file_t *f)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(path); return -1; }
+    f->bytes = (size_t)n * w;
+    if (ftruncate(fd, (off_t)f->bytes) < 0) { perror(path); close(fd); return -1; }
+    f->map = f->bytes ? mmap(NULL, f->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
+    close(fd);
+    if (f->map == MAP_FAILED) { perror("mmap"); return -1; }
+    return 0;
+}
+
+static inline void label_close(label_file_t *f)
+{
+    if (f->map) munmap(f->map, f->bytes);
+}
+
+#endif /* DATASET_H */
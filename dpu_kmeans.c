@@ -1,112 +1,1070 @@
 /**
- * dpu_kmeans.c  –  INT16 version with batching
+ * dpu_kmeans.c  –  batched kernel over FEATURE_BITS features (int8, int16,
+ * int32 or double, see common.h; FEATURE in the Makefile)
+ *
+ * Every point's label is kept in t_labels (the host fills it with LABEL_NONE
+ * before the first launch) and the record reports how many labels changed,
+ * which is what the host's convergence test looks at. After the last
+ * launch the host can read t_labels back as the points' assignments.
+ *
+ * Each tasklet also remembers its FAR_SLOTS points farthest from their
+ * centroids; the record lists the DPU's FAR_SLOTS farthest, from which the
+ * host restarts empty clusters. A pruned point is measured for this only
+ * when its upper bound could put it among them.
+ *
+ * A mini-batch launch (mb_stride > 1 in the arguments) only visits every
+ * mb_stride-th group of SLICE_ALIGN points from group mb_offset, one group
+ * per batch; counts, sums and label changes cover those points only.
+ *
+ * Distances weight each feature by the host's per-feature shift c_wshift,
+ * which undoes the per-feature quantisation scales (see quant.h).
+ *
+ * Tasklets split the points statically into equal slices, or with
+ * DYNAMIC=1 take DMA-sized batches off a shared counter until none are left,
+ * which evens out uneven per-point costs (pruning). Each tasklet's busy
+ * cycles, from the start of the launch to the end of its last batch, are
+ * summed over launches in busy_cycles for the host's imbalance report.
+ * STATS=1 splits them by phase in phase_stats (see common.h).
+ *
+ * DIST_MODE picks how distances are evaluated (see common.h).
+ *
+ * FIXED_D (and optionally FIXED_K) build a kernel specialised for that
+ * shape: D and K become compile-time constants, so the per-feature distance
+ * and accumulate loops are fully unrolled. The host only loads such a
+ * kernel for matching datasets.
+ *
+ * PRUNE=1 adds Hamerly bounds (see common.h): a point whose bounds prove
+ * its label cannot change skips the K×D distance scan.
+ *
+ * Seeding launches (c_seed, see common.h) run the k-means|| stages over
+ * the resident points instead and return without touching the record.
+ *
+ * TILED=1 keeps the centroids in MRAM (c_clusters) for K and D beyond WRAM:
+ * each batch of points is compared against one tile of centroids at a time,
+ * keeping every point's running best, and each tasklet accumulates into its
+ * own MRAM rows (t_acc, count and sums per cluster), caching the row last
+ * used so runs of points with one label cost one row transfer.
+ *
+ * With nsets > 1 (NINIT builds) each DMA batch is assigned once per
+ * centroid set from the same buffer, set r into clusters r*K onwards, with
+ * its own farthest points and summed distances in the record.
+ *
+ * LOCAL_STEPS builds run the steps a launch asks for back to back: after
+ * each but the last, local_update moves c_clusters to the means of the
+ * DPU's own counts and sums and the points are assigned again.
  */
 #include <defs.h>
 #include <mram.h>
 #include <barrier.h>
+#include <mutex.h>
+#include <mutex_pool.h>
+#include <perfcounter.h>
 #include <alloc.h>
 #include <string.h>
 #include <stdint.h>
 
+#include "common.h"
+
 /* data types */
-typedef int16_t   dpu_feature_t;
-typedef int32_t   dpu_sum_t;
+typedef feat_t    dpu_feature_t;
+typedef rec_sum_t dpu_sum_t;
 typedef uint64_t  dpu_count_t;
 
 /* limits */
 #ifndef NR_TASKLETS
 # define NR_TASKLETS 8
 #endif
-#ifndef MAX_POINTS_DPU
-# define MAX_POINTS_DPU 65536
-#endif
-#ifndef MAX_FEATURES
-# define MAX_FEATURES 16
-#endif
-#ifndef MAX_CLUSTERS
-# define MAX_CLUSTERS 20
-#endif
 #define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
 
 /* MRAM symbols */
 __mram_noinit dpu_feature_t t_features[MAX_POINTS_DPU * MAX_FEATURES];
+__mram_noinit uint16_t      t_labels[MAX_POINTS_DPU];
+#if PRUNE
+__mram_noinit point_bound_t t_bounds[MAX_POINTS_DPU];
+__host        prune_info_t  c_prune;
+#endif
+#if TILED
+/* padded by 8 bytes: the last tile is read rounded up to 8 bytes */
+__mram_noinit dpu_feature_t c_clusters[MAX_CLUSTERS * MAX_FEATURES + 8];
+#else
 __host        dpu_feature_t c_clusters[MAX_CLUSTERS   * MAX_FEATURES];
-__mram_noinit dpu_sum_t     centers_sum_mram [MAX_CLUSTERS * MAX_FEATURES];
-__mram_noinit dpu_count_t   centers_count_mram[MAX_CLUSTERS];
+#endif
+__host        uint8_t       c_wshift[WSHIFT_BYTES];       /* see quant.h */
+#if DIST_MODE == DIST_EXPAND
+__host        dist_t        c_norms[MAX_CLUSTERS];        /* ||c_k||^2   */
+#endif
+__mram_noinit uint64_t      centers_mram[REC_BYTES_MAX / sizeof(uint64_t)];
+__host        seed_args_t   c_seed;
+__host        seed_out_t    seed_out;
+__host        dist_t        seed_psi;
+__mram_noinit seed_state_t  t_seed[MAX_POINTS_DPU];
+__mram_noinit uint32_t      seed_w[SEED_CAND_MAX];
+__mram_noinit uint32_t      seed_idx[SEED_OUT_MAX];
 
 /* host arguments */
-typedef struct { uint32_t dpu_points,nfeatures,nclusters; } dpu_arguments_t;
 __host dpu_arguments_t DPU_INPUT_ARGUMENTS;
 
-/* WRAM scratch */
-#define DMA_BYTES      2048
-#define BUF_ELEMS      (DMA_BYTES / sizeof(dpu_feature_t))          /* 1024 */
-#define BUF_POINTS_MAX (DMA_BYTES / (MAX_FEATURES * sizeof(dpu_feature_t)))/*128*/
+/* WRAM scratch: the per-tasklet DMA buffer halves above 16 tasklets and in
+   TILED mode, which also needs a centroid tile and an accumulator row */
+#if NR_TASKLETS > 16 || TILED
+# define DMA_BYTES     1024
+#else
+# define DMA_BYTES     2048
+#endif
+#define BUF_ELEMS      (DMA_BYTES / sizeof(dpu_feature_t))     /* 1024 int16 */
+#define BUF_POINTS_MAX (DMA_BYTES / (MAX_FEATURES * sizeof(dpu_feature_t)))
+
+/* tasklet slices and DMA batches start on multiples of SLICE_ALIGN points so
+   every MRAM access (features, 2-byte labels) is 8-byte aligned and no two
+   tasklets share an MRAM word; int8 rows of odd D need 8 */
+#if FEATURE_BITS == 8
+# define SLICE_ALIGN   8
+#else
+# define SLICE_ALIGN   4
+#endif
+#if SLICE_ALIGN * MAX_FEATURES * FEAT_BYTES > DMA_BYTES
+# error "a DMA batch must hold SLICE_ALIGN points: lower MAX_FEATURES"
+#endif
+#if PRUNE || TILED
+# define STATE_BATCH   64          /* max points per batch (labels, bounds)  */
+#else
+# define STATE_BATCH   256         /* max points per batch (labels)          */
+#endif
 
-__dma_aligned dpu_sum_t   task_sum [NR_TASKLETS][MAX_CLUSTERS * MAX_FEATURES];
-__dma_aligned dpu_count_t task_cnt [NR_TASKLETS][MAX_CLUSTERS];
+#if DIST_MODE == DIST_LUT
+# ifndef LUT_SIZE
+#  define LUT_SIZE     (FEATURE_BITS == 8 ? 256 : 2048)
+# endif
+uint32_t sq_lut[LUT_SIZE];          /* sq_lut[a] = a*a                      */
+uint32_t lut_ready;                 /* WRAM keeps it across launches        */
+# define LUT_BYTES     (LUT_SIZE * 4)
+#else
+# define LUT_BYTES     0
+#endif
+
+#define WRAM_BYTES     (64 * 1024)
+#define STACK_BYTES    512         /* per tasklet (keep >= STACK_SIZE_DEFAULT) */
+/* per tasklet for NINIT > 1: a batch of set labels, far points and sums */
+#if NINIT > 1
+# define SETS_BYTES    (STATE_BATCH * 2 + NINIT * (FAR_SLOTS * 16 + 8))
+#else
+# define SETS_BYTES    0
+#endif
+
+#if TILED
+/*
+ * Tiled scratch per tasklet: a centroid tile, the running best of each
+ * batch point and one accumulator row. Rows of t_acc are
+ * [count, sums padded to 8 bytes]; a tasklet's rows start from zero in
+ * every launch, marked in its touched bitmap when first used.
+ */
+# define TILE_BYTES    1024
+# define ACC_ROW_BYTES (8 + (MAX_FEATURES * REC_SUM_BYTES + 7) / 8 * 8)
+# define ACC_ROW_WORDS (ACC_ROW_BYTES / 8)
+# define TOUCH_WORDS   ((MAX_CLUSTERS + 31) / 32)
+# define TASKLET_BYTES (DMA_BYTES + TILE_BYTES + ACC_ROW_BYTES + STATE_BATCH * (2 + 2 + 8) \
+                        + TOUCH_WORDS * 4 + STACK_BYTES + SETS_BYTES)
+# if MAX_FEATURES * 8 > TILE_BYTES
+#  error "TILED reduces two int32 or one int64 sum rows in a tile: lower MAX_FEATURES"
+# endif
+# if 4096 + LUT_BYTES + NR_TASKLETS * TASKLET_BYTES > WRAM_BYTES
+#  error "TILED scratch exceeds WRAM: lower NR_TASKLETS"
+# endif
+# define ACC_SHARED    0
+
+__mram_noinit uint64_t        t_acc[NR_TASKLETS * MAX_CLUSTERS * ACC_ROW_WORDS];
+__dma_aligned dpu_feature_t   tile[NR_TASKLETS][TILE_BYTES / sizeof(dpu_feature_t)];
+__dma_aligned uint64_t        row_buf[NR_TASKLETS][ACC_ROW_WORDS];
+uint32_t row_k[NR_TASKLETS];                 /* cluster cached in row_buf */
+uint32_t touched[NR_TASKLETS][TOUCH_WORDS];
+dist_t   best_d[NR_TASKLETS][STATE_BATCH];
+uint16_t best_k[NR_TASKLETS][STATE_BATCH];
+#else
+/*
+ * Accumulator copies (per-cluster counts and sums). Every tasklet owns one
+ * while NR_TASKLETS copies fit in the WRAM left by the per-tasklet buffers;
+ * beyond that tasklet t shares copy t % ACC_COPIES and folds each assigned
+ * batch into it under that copy's mutex, so the tasklet count is not capped
+ * by the accumulators. The estimate is conservative; ACC_COPIES overrides it.
+ */
+#define TASKLET_BYTES  (DMA_BYTES + STATE_BATCH * (2 + 8 * PRUNE) + STACK_BYTES + SETS_BYTES)
+#define FIXED_BYTES    (4096 + MAX_CLUSTERS * MAX_FEATURES * FEAT_BYTES + LUT_BYTES)
+#define ACC_BYTES      (MAX_CLUSTERS * (MAX_FEATURES * REC_SUM_BYTES + 8))
+#ifndef ACC_COPIES
+# define ACC_FIT       ((WRAM_BYTES - FIXED_BYTES - NR_TASKLETS * TASKLET_BYTES) / ACC_BYTES)
+# define ACC_COPIES    (ACC_FIT >= NR_TASKLETS ? NR_TASKLETS : ACC_FIT)
+#endif
+#if ACC_COPIES < 1
+# error "no WRAM left for the accumulators: lower NR_TASKLETS or the MAX_* limits"
+#endif
+#define ACC_SHARED     (ACC_COPIES < NR_TASKLETS)
+/* sums padded to whole 8-byte words for the striped write-out */
+#define SUM_ELEMS      ((MAX_CLUSTERS * MAX_FEATURES * REC_SUM_BYTES + 7) / 8 * 8 / REC_SUM_BYTES)
+
+__dma_aligned dpu_sum_t   acc_sum[ACC_COPIES][SUM_ELEMS];
+__dma_aligned dpu_count_t acc_cnt[ACC_COPIES][MAX_CLUSTERS];
+#if ACC_SHARED
+MUTEX_POOL_INIT(acc_mutex, ACC_COPIES);
+#endif
+#endif /* TILED */
 __dma_aligned dpu_feature_t buf[NR_TASKLETS][BUF_ELEMS];
+__dma_aligned uint16_t      lbl_buf[NR_TASKLETS][STATE_BATCH];
+dist_t   task_psi[NR_TASKLETS];
+/* SEED_SAMPLE: each tasklet lists its samples in its DMA buffer, spilling
+   full buffers to its own row of seed_part; tasklet 0 concatenates the rows
+   into seed_idx in tasklet order. SEED_WEIGH counts SEED_WIN candidates at
+   a time in the DMA buffers, summed across tasklets into seed_w. */
+#define SEED_WIN       (DMA_BYTES / sizeof(uint32_t))
+__mram_noinit uint32_t seed_part[NR_TASKLETS][SEED_OUT_MAX];
+uint32_t seed_cnt[NR_TASKLETS];
+__dma_aligned uint32_t seed_merge[16];
+far_point_t task_far[NR_TASKLETS][NINIT][FAR_SLOTS];  /* farthest first */
+dist_t   task_sse[NR_TASKLETS][NINIT];
+#if NINIT > 1
+uint16_t set_lbl[NR_TASKLETS][STATE_BATCH];  /* batch labels of sets 1.. */
+#endif
+uint32_t task_pruned[NR_TASKLETS];
+uint32_t task_changed[NR_TASKLETS];
+#if PRUNE
+__dma_aligned point_bound_t bnd_buf[NR_TASKLETS][STATE_BATCH];
+#endif
+#ifndef DYNAMIC
+# define DYNAMIC       0
+#endif
+__host uint64_t busy_cycles[NR_TASKLETS];    /* summed over launches      */
+#if STATS
+__host phase_stats_t phase_stats[NR_TASKLETS];
+/* charge the cycles since the last mark to phase f and mark again */
+# define STAT_MARK()   (st_mark=perfcounter_get())
+# define STAT_LAP(f)   do{ const perfcounter_t n_=perfcounter_get(); \
+                           phase_stats[tid].f+=n_-st_mark; st_mark=n_; }while(0)
+# define STAT_BYTES(b) (phase_stats[tid].dma_bytes+=(b))
+#else
+# define STAT_MARK()   ((void)0)
+# define STAT_LAP(f)   ((void)0)
+# define STAT_BYTES(b) ((void)0)
+#endif
+#if DYNAMIC
+# define DYN_CHUNKS   4            /* target batches per tasklet           */
+uint32_t next_batch;                         /* first point not yet taken */
+MUTEX_INIT(batch_mutex);
+#endif
 
 BARRIER_INIT(bar,NR_TASKLETS);
 
+/* shape specialisation: constant trip counts over the features */
+#ifdef FIXED_D
+# if FIXED_D < 1 || FIXED_D > MAX_FEATURES
+#  error "FIXED_D out of range"
+# endif
+# define UNROLL_D _Pragma("unroll")
+#else
+# define UNROLL_D
+#endif
+#if defined(FIXED_K) && (FIXED_K < 1 || FIXED_K > MAX_CLUSTERS)
+# error "FIXED_K out of range"
+#endif
+
+/* [lo,hi) of tasklet t's stripe of n items, cut in blocks of g items */
+static inline void stripe(uint32_t n, uint32_t g, uint32_t t,
+                          uint32_t *lo, uint32_t *hi)
+{
+    const uint32_t blocks=(n+g-1)/g;
+    const uint32_t per=blocks/NR_TASKLETS, rem=blocks%NR_TASKLETS;
+    *lo=MIN((t*per+MIN(t,rem))*g, n);
+    *hi=MIN(*lo+(per+(t<rem))*g, n);
+}
+
+/* mram_write of any multiple of 8 bytes, in DMA-sized pieces */
+static inline void mram_write_long(const void *src, __mram_ptr void *dst,
+                                   uint32_t bytes)
+{
+    for(uint32_t o=0;o<bytes;o+=DMA_BYTES)
+        mram_write((const uint8_t *)src+o, (__mram_ptr uint8_t *)dst+o,
+                   MIN(DMA_BYTES, bytes-o));
+}
+
+/* squared distance, feature f weighted by 2^c_wshift[f] (quant.h) */
+static inline dist_t dist2(const dpu_feature_t *pt,
+                           const dpu_feature_t *cent, uint32_t D)
+{
+    dist_t dsq=0;
+#ifdef FIXED_D
+    D=FIXED_D;
+#endif
+    UNROLL_D
+    for(uint32_t f=0;f<D;++f){
+#if FEATURE_FLOAT
+        double diff=pt[f] - cent[f];
+        dsq += diff*diff;
+#elif FEATURE_BITS == 32
+        int64_t diff=(int64_t)pt[f] - cent[f];
+        dsq += (diff*diff) << c_wshift[f];
+#elif DIST_MODE == DIST_LUT
+        int32_t diff=(int32_t)pt[f] - cent[f];
+        uint32_t a=diff<0?-diff:diff;
+        uint64_t sq=a<LUT_SIZE?sq_lut[a]:(uint64_t)a*a;
+        dsq += (int64_t)(sq << c_wshift[f]);
+#else
+        int32_t diff=(int32_t)pt[f] - cent[f];
+        dsq += ((int64_t)diff*diff) << c_wshift[f];
+#endif
+    }
+    return dsq;
+}
+
+#if DIST_MODE == DIST_EXPAND
+/* weighted dot product: dist2(x,c) = dot(x,x) - 2 dot(x,c) + dot(c,c) */
+static inline dist_t dot(const dpu_feature_t *a,
+                         const dpu_feature_t *b, uint32_t D)
+{
+    dist_t s=0;
+#ifdef FIXED_D
+    D=FIXED_D;
+#endif
+    UNROLL_D
+    for(uint32_t f=0;f<D;++f){
+#if FEATURE_FLOAT
+        s += a[f]*b[f];
+#elif FEATURE_BITS == 32
+        s += ((int64_t)a[f]*b[f]) << c_wshift[f];
+#else
+        s += (int64_t)((int32_t)a[f]*b[f]) << c_wshift[f];
+#endif
+    }
+    return s;
+}
+#endif
+
+#if !TILED
+/* what the scan over K minimises: the squared distance, less ||x||^2
+   with DIST_EXPAND */
+static inline dist_t score(const dpu_feature_t *pt, uint32_t k, uint32_t D)
+{
+#if DIST_MODE == DIST_EXPAND
+    return c_norms[k] - 2*dot(pt,&c_clusters[k*D],D);
+#else
+    return dist2(pt,&c_clusters[k*D],D);
+#endif
+}
+#endif
+
+#if TILED
+/* nearest of centroids kb..kb+K-1 for each of the n points, centroids
+   streamed from MRAM in tiles of whole rows (a multiple of 8 bytes); tiles
+   start on multiples of the tile size so every read is aligned */
+static void assign_tiled(const dpu_feature_t *pts, uint32_t n, uint32_t D,
+                         uint32_t kb, uint32_t K, uint32_t tid)
+{
+    const uint32_t row = D*sizeof(dpu_feature_t);
+    uint32_t tk = TILE_BYTES/row;
+    while((tk*row)&7) --tk;
+    dist_t *best=best_d[tid];
+    uint16_t *bk=best_k[tid];
+    for(uint32_t p=0;p<n;++p){ best[p]=DIST_MAX; bk[p]=(uint16_t)kb; }
+
+    for(uint32_t k0=kb/tk*tk;k0<kb+K;k0+=tk){
+        const uint32_t nk=MIN(tk,kb+K-k0), k1=k0<kb?kb-k0:0;
+        mram_read(&c_clusters[k0*D], tile[tid], align8(nk*row));
+        for(uint32_t p=0;p<n;++p){
+            const dpu_feature_t *pt=&pts[p*D];
+            for(uint32_t k=k1;k<nk;++k){
+                dist_t dsq=dist2(pt,&tile[tid][k*D],D);
+                if(dsq<best[p]){ best[p]=dsq; bk[p]=(uint16_t)(k0+k); }
+            }
+        }
+    }
+}
+
+static inline __mram_ptr uint64_t *acc_row(uint32_t t, uint32_t k)
+{
+    return &t_acc[((uint32_t)t*MAX_CLUSTERS + k)*ACC_ROW_WORDS];
+}
+
+static inline int row_touched(uint32_t t, uint32_t k)
+{
+    return (touched[t][k>>5] >> (k&31)) & 1;
+}
+
+/* make cluster k's row the one in row_buf (rb bytes), writing back the
+   previous one */
+static void row_load(uint32_t tid, uint32_t k, uint32_t rb)
+{
+    if(row_k[tid]==k) return;
+    if(row_k[tid]!=LABEL_NONE) mram_write(row_buf[tid], acc_row(tid,row_k[tid]), rb);
+    if(row_touched(tid,k)) mram_read(acc_row(tid,k), row_buf[tid], rb);
+    else{
+        memset(row_buf[tid],0,rb);
+        touched[tid][k>>5] |= 1u<<(k&31);
+    }
+    row_k[tid]=k;
+}
+#endif
+
+#if SPARSE
+# if 8 + (MAX_FEATURES * REC_SUM_BYTES + 7) / 8 * 8 > DMA_BYTES
+#  error "SPARSE stages record entries in the DMA buffer: lower MAX_FEATURES"
+# endif
+/* whether any point of the launch fell in cluster k */
+static inline int cluster_used(uint32_t k)
+{
+# if TILED
+    for(uint32_t t=0;t<NR_TASKLETS;++t) if(row_touched(t,k)) return 1;
+    return 0;
+# else
+    return acc_cnt[0][k]!=0;
+# endif
+}
+
+/* used clusters below k1: the entries that precede cluster k1's */
+static uint32_t used_below(uint32_t k1)
+{
+    uint32_t n=0;
+# if TILED
+    for(uint32_t w=0;w<k1/32;++w){
+        uint32_t m=0;
+        for(uint32_t t=0;t<NR_TASKLETS;++t) m|=touched[t][w];
+        n+=__builtin_popcount(m);
+    }
+    for(uint32_t k=k1/32*32;k<k1;++k) n+=cluster_used(k);
+# else
+    for(uint32_t k=0;k<k1;++k) n+=cluster_used(k);
+# endif
+    return n;
+}
+
+/* consecutive record entries of eb bytes, staged in buf and written a
+   buffer at a time */
+typedef struct {
+    __mram_ptr uint8_t *at;
+    uint8_t            *buf;
+    uint32_t            n, max, eb;
+} ent_out_t;
+
+static inline void ent_flush(ent_out_t *o)
+{
+    if(!o->n) return;
+    mram_write(o->buf, o->at, o->n*o->eb);
+    o->at+=o->n*o->eb; o->n=0;
+}
+
+static inline rec_entry_t *ent_next(ent_out_t *o, uint32_t k)
+{
+    if(o->n==o->max) ent_flush(o);
+    rec_entry_t *e=(rec_entry_t *)(o->buf+o->n++*o->eb);
+    e->k=k; e->count=0;
+    return e;
+}
+#endif
+
+/* the tasklet's farthest points so far in centroid set r; ties keep the
+   lower index, which comes first in every schedule */
+static inline void far_note(uint32_t tid, uint32_t r, dist_t d, uint32_t i)
+{
+    far_point_t *f=task_far[tid][r];
+    if(d<=f[FAR_SLOTS-1].d) return;
+    uint32_t s=FAR_SLOTS-1;
+    for(;s>0 && d>f[s-1].d;--s) f[s]=f[s-1];
+    f[s]=(far_point_t){ d, i, 0 };
+}
+
+/* set r's summed distances, saturating */
+static inline void sse_add(uint32_t tid, uint32_t r, dist_t d)
+{
+    dist_t *t=&task_sse[tid][r];
+    *t = *t > DIST_MAX-d ? DIST_MAX : *t+d;
+}
+
+/* SplitMix64: the random stream of point i in a sampling launch */
+static inline uint64_t seed_rand(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/* tasklet 0: the tasklets' sample lists, in tasklet order, into seed_idx
+   (only when they fit, so every list is whole) */
+static void seed_concat(void)
+{
+    uint32_t *in=(uint32_t *)buf[0];
+    uint32_t o=0, w=0;
+    for(uint32_t t=0;t<NR_TASKLETS;++t){
+        for(uint32_t i=0;i<seed_cnt[t];i+=SEED_WIN){
+            const uint32_t m=MIN(SEED_WIN,seed_cnt[t]-i);
+            mram_read(&seed_part[t][i], in, align8(m*sizeof *in));
+            for(uint32_t j=0;j<m;++j){
+                seed_merge[o++]=in[j];
+                if(o==16){ mram_write(seed_merge,&seed_idx[w],sizeof seed_merge); w+=16; o=0; }
+            }
+        }
+    }
+    if(o) mram_write(seed_merge,&seed_idx[w],align8(o*sizeof *seed_merge));
+}
+
+/* SEED_WEIGH: per-tasklet counts of SEED_WIN candidates at a time, one
+   pass over the stripe's states per window; the window's sums go to seed_w */
+static void seed_weigh(uint32_t tid, uint32_t lo, uint32_t hi)
+{
+    uint32_t *cnt=(uint32_t *)buf[tid];
+    for(uint32_t c0=0;c0<c_seed.n;c0+=SEED_WIN){
+        const uint32_t m=MIN(SEED_WIN,c_seed.n-c0);
+        memset(cnt,0,m*sizeof *cnt);
+        for(uint32_t i=lo;i<hi;++i){
+            __dma_aligned seed_state_t st;
+            mram_read(&t_seed[i], &st, sizeof st);
+            if(st.owner-c0<m) cnt[st.owner-c0]++;
+        }
+        barrier_wait(&bar);
+        for(uint32_t c=tid;c<m;c+=NR_TASKLETS)
+            for(uint32_t t=1;t<NR_TASKLETS;++t) ((uint32_t *)buf[0])[c]+=((uint32_t *)buf[t])[c];
+        barrier_wait(&bar);
+        if(tid==0) mram_write(buf[0],&seed_w[c0],align8(m*sizeof *cnt));
+        barrier_wait(&bar);
+    }
+}
+
+/* one k-means|| stage over this tasklet's stripe of the P points; the
+   per-point state goes through a 16-byte DMA each, its cost is small
+   next to the distance scan */
+static void seed_launch(uint32_t tid, uint32_t P, uint32_t D)
+{
+    const uint32_t mode = c_seed.mode;
+    const uint32_t bytes_pt = D*sizeof(dpu_feature_t);
+    uint32_t max_pts = MIN(DMA_BYTES / bytes_pt, STATE_BATCH);
+    max_pts -= max_pts % SLICE_ALIGN;
+    dist_t psi = 0;
+    uint32_t lo,hi;
+    stripe(P,SLICE_ALIGN,tid,&lo,&hi);
+
+    if(mode==SEED_WEIGH){
+        seed_weigh(tid,lo,hi);
+        return;
+    }
+    uint32_t *list=(uint32_t *)buf[tid], n=0;
+    for(uint32_t idx=lo, batch; idx<hi; idx+=batch){
+        batch = MIN(max_pts, hi-idx);
+        if(mode==SEED_UPDATE){
+            mram_read(&t_features[idx*D], buf[tid], align8(batch*bytes_pt));
+#if TILED
+            assign_tiled(buf[tid],batch,D,0,c_seed.n,tid);
+#endif
+        }
+        for(uint32_t p=0;p<batch;++p){
+            __dma_aligned seed_state_t st;
+            mram_read(&t_seed[idx+p], &st, sizeof st);
+            if(mode==SEED_UPDATE){
+#if TILED
+                const dist_t best=best_d[tid][p];
+                const uint32_t bk=best_k[tid][p];
+#else
+                const dpu_feature_t *pt=&buf[tid][p*D];
+                dist_t best=DIST_MAX; uint32_t bk=0;
+                for(uint32_t k=0;k<c_seed.n;++k){
+                    dist_t dsq=dist2(pt,&c_clusters[k*D],D);
+                    if(dsq<best){ best=dsq; bk=k; }
+                }
+#endif
+                if(c_seed.base==0 || best<st.d){
+                    st.d=best; st.owner=c_seed.base+bk;
+                    mram_write(&st, &t_seed[idx+p], sizeof st);
+                }
+                psi+=st.d;
+            }else{
+                const uint64_t r=seed_rand(c_seed.rng^(idx+p));
+#if FEATURE_FLOAT
+                const dist_t u=(double)(r>>11)*(1.0/9007199254740992.0)*c_seed.span;
+#else
+                const dist_t u=(dist_t)(r%(uint64_t)c_seed.span);
+#endif
+                if(u<st.d){
+                    /* past SEED_OUT_MAX only the count goes on */
+                    if(n<SEED_OUT_MAX){
+                        list[n%SEED_WIN]=idx+p;
+                        if(n%SEED_WIN==SEED_WIN-1)
+                            mram_write(list,&seed_part[tid][n-(SEED_WIN-1)],SEED_WIN*sizeof *list);
+                    }
+                    n++;
+                }
+            }
+        }
+    }
+    if(mode==SEED_SAMPLE){
+        const uint32_t kept=MIN(n,SEED_OUT_MAX), spilt=kept-kept%SEED_WIN;
+        if(kept>spilt)
+            mram_write(list,&seed_part[tid][spilt],align8((kept-spilt)*sizeof *list));
+        seed_cnt[tid]=n;
+    }
+    task_psi[tid]=psi;
+    barrier_wait(&bar);
+    if(tid==0){
+        if(mode==SEED_SAMPLE){
+            uint32_t t=0;
+            for(uint32_t i=0;i<NR_TASKLETS;++i) t+=seed_cnt[i];
+            seed_out.n=t;
+            if(t<=SEED_OUT_MAX) seed_concat();
+        }else{
+            dist_t t=0;
+            for(uint32_t i=0;i<NR_TASKLETS;++i) t+=task_psi[i];
+            seed_psi=t;
+        }
+    }
+}
+
+#if LOCAL_STEPS > 1
+/* quant_mean on the DPU: the integer mean rounded half away from zero */
+static inline dpu_feature_t local_mean(dpu_sum_t sum, dpu_count_t cnt)
+{
+#if FEATURE_FLOAT
+    return sum / (double)cnt;
+#else
+    const int64_t s = sum, c = (int64_t)cnt;
+    return (dpu_feature_t)(s >= 0 ? (s + c / 2) / c : -((-s + c / 2) / c));
+#endif
+}
+
+/* between two local steps: every tasklet folds its stripe of the clusters
+   over the accumulator copies and moves those centroids to their means;
+   the copies then start the next step from zero */
+static void local_update(uint32_t tid, uint32_t KT, uint32_t D, uint32_t nsum)
+{
+    barrier_wait(&bar);
+    uint32_t lo,hi;
+    stripe(KT,1,tid,&lo,&hi);
+    for(uint32_t k=lo;k<hi;++k){
+        for(uint32_t c=1;c<ACC_COPIES;++c){
+            acc_cnt[0][k]+=acc_cnt[c][k];
+            for(uint32_t f=0;f<D;++f) acc_sum[0][k*D+f]+=acc_sum[c][k*D+f];
+        }
+        if(!acc_cnt[0][k]) continue;
+        for(uint32_t f=0;f<D;++f)
+            c_clusters[k*D+f]=local_mean(acc_sum[0][k*D+f],acc_cnt[0][k]);
+#if DIST_MODE == DIST_EXPAND
+        c_norms[k]=dot(&c_clusters[k*D],&c_clusters[k*D],D);
+#endif
+    }
+    barrier_wait(&bar);                  /* copy 0 is read, c_clusters set */
+    if(tid<ACC_COPIES){
+        memset(acc_sum[tid],0,nsum*sizeof(dpu_sum_t));
+        memset(acc_cnt[tid],0,KT  *sizeof(dpu_count_t));
+    }
+#if DYNAMIC
+    if(tid==0) next_batch=0;
+#endif
+    barrier_wait(&bar);
+}
+#endif
+
 int main(void)
 {
     const uint32_t P  = DPU_INPUT_ARGUMENTS.dpu_points;
+#ifdef FIXED_D
+    const uint32_t D  = FIXED_D;
+#else
     const uint32_t D  = DPU_INPUT_ARGUMENTS.nfeatures;
+#endif
+#ifdef FIXED_K
+    const uint32_t K  = FIXED_K;
+#else
     const uint32_t K  = DPU_INPUT_ARGUMENTS.nclusters;
+#endif
+#if NINIT > 1
+    const uint32_t R  = MAX(DPU_INPUT_ARGUMENTS.nsets, 1);
+#else
+    const uint32_t R  = 1;
+#endif
+    const uint32_t KT = R*K;            /* clusters of all sets */
     const uint32_t tid = me();
+    /* KT*D sums padded to whole 8-byte words */
+    const uint32_t nsum = (KT*D*REC_SUM_BYTES+7)/8*8/REC_SUM_BYTES;
 
-    memset(task_sum[tid],0,K*D*sizeof(dpu_sum_t));
-    memset(task_cnt[tid],0,K  *sizeof(dpu_count_t));
+    /* refuse shapes beyond the arrays; the record is left not done, which
+       the host reports */
+    if(P>MAX_POINTS_DPU||D>MAX_FEATURES||R>NINIT||KT>MAX_CLUSTERS){
+        if(tid==0){
+            __dma_aligned rec_hdr_t hdr = { 0 };
+            mram_write(&hdr, centers_mram, sizeof hdr);
+        }
+        return 1;
+    }
 
-    /* my slice of points */
-    const uint32_t per = P/NR_TASKLETS, rem = P%NR_TASKLETS;
-    const uint32_t start = tid*per + MIN(tid,rem);
-    const uint32_t end   = start + per + (tid<rem);
+#if TILED
+    /* none of this tasklet's rows (rb bytes each) is used yet */
+    const uint32_t rb = 8 + align8(D*REC_SUM_BYTES);
+    memset(touched[tid],0,sizeof touched[tid]);
+    row_k[tid]=LABEL_NONE;
+    (void)nsum;
+#else
+    /* clear the accumulator copies before anyone adds to them */
+    if(tid<ACC_COPIES){
+        memset(acc_sum[tid],0,nsum*sizeof(dpu_sum_t));
+        memset(acc_cnt[tid],0,KT  *sizeof(dpu_count_t));
+    }
+#endif
+
+    /* launch set-up by tasklet 0 */
+    if(tid==0){
+        perfcounter_config(COUNT_CYCLES,true);
+#if DYNAMIC
+        next_batch=0;
+#endif
+#if DIST_MODE == DIST_LUT
+        /* squares by running sums: (a+1)^2 = a^2 + 2a + 1 */
+        if(!lut_ready){
+            uint32_t sq=0;
+            for(uint32_t a=0;a<LUT_SIZE;++a){ sq_lut[a]=sq; sq+=2*a+1; }
+            lut_ready=1;
+        }
+#endif
+    }
+    barrier_wait(&bar);
+    if(c_seed.mode!=SEED_OFF){
+        seed_launch(tid,P,D);
+        return 0;
+    }
+#if LOCAL_STEPS > 1
+    const uint32_t steps = MAX(DPU_INPUT_ARGUMENTS.steps, 1);
+    uint32_t steps_run = 0;
+next_step: ;
+#else
+    const uint32_t steps = 1;
+#endif
+    const perfcounter_t t_start=perfcounter_get();
+#if STATS
+    perfcounter_t st_mark=t_start;
+#endif
+
+    task_pruned[tid]=0;
+    task_changed[tid]=0;
+    for(uint32_t r=0;r<R;++r){
+        for(uint32_t s=0;s<FAR_SLOTS;++s) task_far[tid][r][s]=(far_point_t){ -1, FAR_NONE, 0 };
+        task_sse[tid][r]=0;
+    }
 
     const uint32_t bytes_pt = D*sizeof(dpu_feature_t);
-    const uint32_t max_pts_dma = DMA_BYTES / bytes_pt;   /* ≤ BUF_POINTS_MAX */
+    uint32_t max_pts_dma = DMA_BYTES / bytes_pt;         /* ≤ BUF_POINTS_MAX */
+    max_pts_dma = MIN(max_pts_dma, STATE_BATCH);
+    max_pts_dma -= max_pts_dma % SLICE_ALIGN;
+
+    /* the PV points of this launch, numbered densely: point i of the
+       sample is point at(i) in MRAM; with a stride a batch is one group */
+    const uint32_t stride = MAX(DPU_INPUT_ARGUMENTS.mb_stride, 1);
+    const uint32_t first  = DPU_INPUT_ARGUMENTS.mb_offset;
+    const uint32_t G = (P+SLICE_ALIGN-1)/SLICE_ALIGN;
+    uint32_t PV = 0;
+    if(first<G){
+        const uint32_t S=(G-first+stride-1)/stride;
+        const uint32_t g=first+(S-1)*stride;     /* the last group, maybe short */
+        PV=(S-1)*SLICE_ALIGN + MIN(SLICE_ALIGN, P-g*SLICE_ALIGN);
+    }
+    if(stride>1) max_pts_dma = SLICE_ALIGN;
+#if PRUNE
+    const int bounds_valid = c_prune.valid;
+#endif
 
-    for(uint32_t idx = start; idx < end; ){
-        uint32_t batch = MIN(max_pts_dma, end-idx);
-        mram_read(&t_features[idx*D], buf[tid], batch*bytes_pt);
+#if DYNAMIC
+    /* about DYN_CHUNKS batches per tasklet, at most one DMA buffer each;
+       batches are handed out in order, so every start is a multiple of
+       step, hence of SLICE_ALIGN */
+    uint32_t step = (PV + NR_TASKLETS*DYN_CHUNKS - 1) / (NR_TASKLETS*DYN_CHUNKS);
+    step = (step + SLICE_ALIGN - 1) / SLICE_ALIGN * SLICE_ALIGN;
+    step = MIN(step, max_pts_dma);
+    for(;;){
+        mutex_lock(batch_mutex);
+        const uint32_t idx = next_batch;
+        next_batch += step;
+        mutex_unlock(batch_mutex);
+        if(idx >= PV) break;
+        const uint32_t batch = MIN(step, PV-idx);
+#else
+    /* my slice of points, in groups of SLICE_ALIGN */
+    const uint32_t groups = (PV+SLICE_ALIGN-1)/SLICE_ALIGN;
+    const uint32_t per = groups/NR_TASKLETS, rem = groups%NR_TASKLETS;
+    const uint32_t start = (tid*per + MIN(tid,rem))*SLICE_ALIGN;
+    const uint32_t end   = MIN(start + (per + (tid<rem))*SLICE_ALIGN, PV);
 
-        for(uint32_t p=0;p<batch;++p){
-            dpu_feature_t *pt=&buf[tid][p*D];
-            int64_t best=INT64_MAX; uint32_t bestk=0;
-
-            for(uint32_t k=0;k<K;++k){
-                const dpu_feature_t *cent=&c_clusters[k*D];
-                int64_t dsq=0;
-                for(uint32_t f=0;f<D;++f){
-                    int32_t diff=(int32_t)pt[f] - cent[f];
-                    dsq += (int64_t)diff*diff;
+    for(uint32_t idx = start, batch; idx < end; idx += batch){
+        batch = MIN(max_pts_dma, end-idx);
+#endif
+        const uint32_t at = (first + idx/SLICE_ALIGN*stride)*SLICE_ALIGN + idx%SLICE_ALIGN;
+        STAT_MARK();
+        mram_read(&t_features[at*D], buf[tid], align8(batch*bytes_pt));
+        mram_read(&t_labels[at], lbl_buf[tid], align8(batch*sizeof(uint16_t)));
+#if PRUNE
+        if(bounds_valid)
+            mram_read(&t_bounds[at], bnd_buf[tid], batch*sizeof(point_bound_t));
+        /* the bounds are read when valid and always written back */
+        STAT_BYTES((1+bounds_valid)*batch*sizeof(point_bound_t));
+#endif
+        /* features in, labels in and back out */
+        STAT_BYTES(align8(batch*bytes_pt)+2*align8(batch*sizeof(uint16_t)));
+        STAT_LAP(dma);
+        /* each centroid set in turn, from the same batch in WRAM */
+        for(uint32_t r=0;r<R;++r){
+            const uint32_t k0=r*K;
+#if TILED
+            assign_tiled(buf[tid],batch,D,k0,K,tid);
+#endif
+
+            for(uint32_t p=0;p<batch;++p){
+                dpu_feature_t *pt=&buf[tid][p*D];
+                uint32_t bestk=0;
+#if PRUNE
+# if DIST_MODE == DIST_EXPAND
+                const dist_t xn=dot(pt,pt,D);       /* score + xn = distance */
+# else
+                const dist_t xn=0;
+# endif
+                point_bound_t *b=&bnd_buf[tid][p];
+                if(bounds_valid){
+                    /* move the bounds by how far the centroids drifted */
+                    const uint32_t a=lbl_buf[tid][p];
+                    const uint32_t ld=(a==c_prune.max_drift_k)?c_prune.max_drift2
+                                                               :c_prune.max_drift;
+                    uint32_t u=b->upper+c_prune.drift[a];
+                    uint32_t l=b->lower>ld?b->lower-ld:0;
+                    uint32_t m=MAX(c_prune.half[a],l);
+                    if(u>=m){
+                        /* tighten the upper bound and test again */
+                        u=isqrt64_ceil((uint64_t)(score(pt,a,D)+xn));
+                    }
+                    if(u<m){
+                        b->upper=u; b->lower=l; bestk=a;
+                        task_pruned[tid]++;
+                        /* the bounds prove the label, not that the point is
+                           close: one whose upper bound reaches the tasklet's
+                           farthest points is measured and noted */
+                        const dist_t fd=task_far[tid][r][FAR_SLOTS-1].d;
+                        if(fd<0||(dist_t)((uint64_t)u*u)>fd)
+                            far_note(tid,r,score(pt,a,D)+xn,at+p);
+                        goto assigned;
+                    }
+                }
+#endif
+#if TILED
+                bestk=best_k[tid][p];
+                far_note(tid,r,best_d[tid][p],at+p);
+                sse_add(tid,r,best_d[tid][p]);
+#else
+                {
+                    dist_t best=DIST_MAX, second=DIST_MAX;
+                    for(uint32_t k=k0;k<k0+K;++k){
+                        dist_t dsq=score(pt,k,D);
+                        if(dsq<best){second=best; best=dsq; bestk=k;}
+                        else if(dsq<second) second=dsq;
+                    }
+#if PRUNE
+                    b->upper=isqrt64_ceil((uint64_t)(best+xn));
+                    b->lower=second==DIST_MAX?UINT32_MAX:isqrt64((uint64_t)(second+xn),NULL);
+#else
+                    (void)second;
+# if DIST_MODE == DIST_EXPAND
+                    const dist_t xn=dot(pt,pt,D);
+# else
+                    const dist_t xn=0;
+# endif
+#endif
+                    far_note(tid,r,best+xn,at+p);
+                    sse_add(tid,r,best+xn);
                 }
-                if(dsq<best){best=dsq; bestk=k;}
+#endif
+#if PRUNE
+assigned:
+#endif
+#if NINIT > 1
+                if(r) set_lbl[tid][p]=(uint16_t)bestk;
+                else
+#endif
+                if(lbl_buf[tid][p]!=bestk){
+                    lbl_buf[tid][p]=(uint16_t)bestk;
+                    task_changed[tid]++;
+                }
+                STAT_LAP(dist);
+#if TILED
+                row_load(tid,bestk,rb);
+                row_buf[tid][0]++;
+                dpu_sum_t *sv=(dpu_sum_t *)&row_buf[tid][1];
+                UNROLL_D
+                for(uint32_t f=0;f<D;++f) sv[f]+=pt[f];
+                STAT_LAP(acc);
+#elif !ACC_SHARED
+                acc_cnt[tid][bestk]++;
+                dpu_sum_t *sv=&acc_sum[tid][bestk*D];
+                UNROLL_D
+                for(uint32_t f=0;f<D;++f) sv[f]+=pt[f];
+                STAT_LAP(acc);
+#endif
             }
+#if ACC_SHARED
+            /* fold the batch into the shared copy; labels are still in lbl_buf
+               (set_lbl for sets 1..) */
+            {
+                const uint32_t c=tid%ACC_COPIES;
+#if NINIT > 1
+                const uint16_t *lb=r?set_lbl[tid]:lbl_buf[tid];
+#else
+                const uint16_t *lb=lbl_buf[tid];
+#endif
+                mutex_pool_lock(&acc_mutex,c);
+                for(uint32_t p=0;p<batch;++p){
+                    const uint32_t k=lb[p];
+                    const dpu_feature_t *pt=&buf[tid][p*D];
+                    acc_cnt[c][k]++;
+                    dpu_sum_t *sv=&acc_sum[c][k*D];
+                    UNROLL_D
+                    for(uint32_t f=0;f<D;++f) sv[f]+=pt[f];
+                }
+                mutex_pool_unlock(&acc_mutex,c);
+                STAT_LAP(acc);
+            }
+#endif
+        }
+        mram_write(lbl_buf[tid], &t_labels[at], align8(batch*sizeof(uint16_t)));
+#if PRUNE
+        mram_write(bnd_buf[tid], &t_bounds[at], batch*sizeof(point_bound_t));
+#endif
+        STAT_LAP(dma);
+    }
+#if TILED
+    STAT_MARK();
+    if(row_k[tid]!=LABEL_NONE) mram_write(row_buf[tid], acc_row(tid,row_k[tid]), rb);
+    STAT_LAP(acc);
+#endif
+    busy_cycles[tid] += perfcounter_get()-t_start;
+#if LOCAL_STEPS > 1
+    /* a local step: move the centroids and assign again; only the last
+       step's partials, labels and farthest points reach the record */
+    if(++steps_run<steps){
+        local_update(tid,KT,D,nsum);
+        goto next_step;
+    }
+#endif
 
-            task_cnt[tid][bestk]++;
-            dpu_sum_t *sv=&task_sum[tid][bestk*D];
-            for(uint32_t f=0;f<D;++f) sv[f]+=pt[f];
+    /* reduction: every tasklet sums its stripe of the counts and of the
+       sums over all copies into copy 0 and writes that stripe of the
+       record; the header goes last, once every stripe is in place, so done
+       is only visible with the whole payload */
+    barrier_wait(&bar);
+    STAT_MARK();
+    __mram_ptr uint8_t *rec=(__mram_ptr uint8_t *)centers_mram;
+#if SPARSE
+    {
+        /* every tasklet lists the used clusters of its stripe, after the
+           entries of the stripes below */
+        const uint32_t eb=sizeof(rec_entry_t)+align8(D*REC_SUM_BYTES);
+        uint32_t lo,hi;
+        stripe(KT,1,tid,&lo,&hi);
+# if !TILED
+        for(uint32_t k=lo;k<hi;++k)
+            for(uint32_t c=1;c<ACC_COPIES;++c){
+                acc_cnt[0][k]+=acc_cnt[c][k];
+                for(uint32_t f=0;f<D;++f) acc_sum[0][k*D+f]+=acc_sum[c][k*D+f];
+            }
+        barrier_wait(&bar);               /* every count is in copy 0 */
+# endif
+        ent_out_t o={ rec+rec_ent_off()+used_below(lo)*eb, (uint8_t *)buf[tid],
+                      0, DMA_BYTES/eb, eb };
+        for(uint32_t k=lo;k<hi;++k){
+            if(!cluster_used(k)) continue;
+            rec_entry_t *e=ent_next(&o,k);
+            dpu_sum_t *out=(dpu_sum_t *)(e+1);
+# if TILED
+            memset(out,0,D*sizeof(dpu_sum_t));
+            for(uint32_t t=0;t<NR_TASKLETS;++t){
+                if(!row_touched(t,k)) continue;
+                mram_read(acc_row(t,k), row_buf[tid], rb);
+                e->count+=(uint32_t)row_buf[tid][0];
+                const dpu_sum_t *sv=(const dpu_sum_t *)&row_buf[tid][1];
+                for(uint32_t f=0;f<D;++f) out[f]+=sv[f];
+            }
+# else
+            e->count=(uint32_t)acc_cnt[0][k];
+            for(uint32_t f=0;f<D;++f) out[f]=acc_sum[0][k*D+f];
+# endif
+        }
+        ent_flush(&o);
+    }
+#elif TILED
+    {
+        /* stripes of whole row groups: g rows of sums end on an 8-byte
+           boundary of the record (two rows for odd D with int32 sums);
+           the tile buffer holds a group's totals */
+        const uint32_t g=(D*REC_SUM_BYTES)%8?2:1;
+        dpu_sum_t *out=(dpu_sum_t *)tile[tid];
+        uint32_t lo,hi;
+        stripe(KT,g,tid,&lo,&hi);
+        for(uint32_t k0=lo;k0<hi;k0+=g){
+            const uint32_t n=MIN(g,hi-k0);
+            __dma_aligned dpu_count_t cnt[2] = { 0, 0 };
+            memset(out,0,g*D*sizeof(dpu_sum_t));
+            for(uint32_t r=0;r<n;++r)
+                for(uint32_t t=0;t<NR_TASKLETS;++t){
+                    if(!row_touched(t,k0+r)) continue;
+                    mram_read(acc_row(t,k0+r), row_buf[tid], rb);
+                    cnt[r]+=row_buf[tid][0];
+                    const dpu_sum_t *sv=(const dpu_sum_t *)&row_buf[tid][1];
+                    for(uint32_t f=0;f<D;++f) out[r*D+f]+=sv[f];
+                }
+            mram_write(cnt, rec+rec_cnt_off()+k0*sizeof(dpu_count_t), n*sizeof(dpu_count_t));
+            mram_write(out, rec+rec_sum_off(KT)+k0*D*sizeof(dpu_sum_t),
+                       align8(n*D*sizeof(dpu_sum_t)));
         }
-        idx += batch;
     }
+#else
+    {
+        uint32_t lo,hi;
+        stripe(KT,1,tid,&lo,&hi);
+        for(uint32_t k=lo;k<hi;++k)
+            for(uint32_t c=1;c<ACC_COPIES;++c) acc_cnt[0][k]+=acc_cnt[c][k];
+        mram_write_long(&acc_cnt[0][lo], rec+rec_cnt_off()+lo*sizeof(dpu_count_t),
+                        (hi-lo)*sizeof(dpu_count_t));
 
-    /* reduction */
+        stripe(nsum,8/REC_SUM_BYTES,tid,&lo,&hi);
+        for(uint32_t e=lo;e<hi;++e)
+            for(uint32_t c=1;c<ACC_COPIES;++c) acc_sum[0][e]+=acc_sum[c][e];
+        mram_write_long(&acc_sum[0][lo], rec+rec_sum_off(KT)+lo*sizeof(dpu_sum_t),
+                        (hi-lo)*sizeof(dpu_sum_t));
+    }
+#endif
+    STAT_LAP(reduce);
     barrier_wait(&bar);
     if(tid==0){
-        for(uint32_t t=1;t<NR_TASKLETS;++t){
-            for(uint32_t k=0;k<K;++k){
-                task_cnt[0][k] += task_cnt[t][k];
-                dpu_sum_t *dst=&task_sum[0][k*D];
-                dpu_sum_t *src=&task_sum[t][k*D];
-                for(uint32_t f=0;f<D;++f) dst[f]+=src[f];
+        STAT_MARK();
+        /* per set, the FAR_SLOTS farthest of the tasklets' farthest points
+           and the total distance */
+        __dma_aligned dist_t sse[NINIT];
+        for(uint32_t r=0;r<R;++r){
+            __dma_aligned far_point_t far[FAR_SLOTS];
+            for(uint32_t s=0;s<FAR_SLOTS;++s) far[s]=(far_point_t){ -1, FAR_NONE, 0 };
+            sse[r]=0;
+            for(uint32_t t=0;t<NR_TASKLETS;++t){
+                const dist_t v=task_sse[t][r];
+                sse[r] = sse[r] > DIST_MAX-v ? DIST_MAX : sse[r]+v;
+            }
+            for(uint32_t e=0;e<NR_TASKLETS*FAR_SLOTS;++e){
+                far_point_t c=task_far[e/FAR_SLOTS][r][e%FAR_SLOTS];
+                if(c.idx==FAR_NONE) continue;
+                for(uint32_t s=0;s<FAR_SLOTS;++s)
+                    if(c.d>far[s].d || (c.d==far[s].d && c.idx<far[s].idx)){
+                        far_point_t o=far[s]; far[s]=c; c=o;
+                    }
             }
+            mram_write(far, rec+rec_far_off(KT,D)+r*sizeof far, sizeof far);
         }
-        mram_write(task_sum[0],  centers_sum_mram,
-                   K*D*sizeof(dpu_sum_t));
-        mram_write(task_cnt[0], centers_count_mram,
-                   K*sizeof(dpu_count_t));
+        mram_write(sse, rec+rec_sse_off(KT,D,R), R*sizeof(dist_t));
+
+        __dma_aligned rec_hdr_t hdr = { .done = 1, .steps = steps };
+        for(uint32_t t=0;t<NR_TASKLETS;++t){
+            hdr.pruned  += task_pruned[t];
+            hdr.changed += task_changed[t];
+        }
+#if SPARSE
+        hdr.entries = used_below(KT);
+#endif
+        mram_write(&hdr, rec, sizeof hdr);
+        STAT_LAP(reduce);
     }
     return 0;
-}
\ No newline at end of file
+}
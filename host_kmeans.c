@@ -1,5 +1,5 @@
-/* host_kmeans.c — INT16 */
-#define _POSIX_C_SOURCE 199309L
+/* host_kmeans.c — host side of the FEATURE_BITS kernel family (common.h) */
+#define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,25 +8,30 @@
 #include <math.h>
 #include <time.h>
 #include <limits.h>
+#include <stdatomic.h>
+#include <unistd.h>
 #include <dpu.h>
 
+#include "common.h"
+#include "cpu_kmeans.h"
+#include "dataset.h"
+#include "params.h"
+#include "pim_host.h"
+#include "quant.h"
+#include "reduce.h"
+#include "stream.h"
+
 /*  data types */
 typedef double    feature_t;  
-typedef uint64_t  count_t;     /* cluster sizes                               */
-
-typedef int16_t   q_feature_t; /* 16-bit feature sent to DPU & used by CPU ref*/
-typedef int32_t   q_sum_t;     /* 32-bit running sums (safe for our ranges)   */
-
-/* argument struct */
-typedef struct {
-    uint32_t dpu_points;
-    uint32_t nfeatures;
-    uint32_t nclusters;
-} dpu_arguments_t;
 
 /* constants */
 #define MAX_NUMBER 99          /* random data range 0…98 */
 
+/* build options (see Makefile) */
+#ifndef DYNAMIC
+#define DYNAMIC 0              /* 1 = tasklets pull batches off a counter  */
+#endif
+
 /* helpers */
 static feature_t *
 gen_fp_data(unsigned *p_pts, unsigned *p_dim)
@@ -38,49 +43,66 @@ gen_fp_data(unsigned *p_pts, unsigned *p_dim)
     return a;
 }
 
-/* INT-CPU reference (mirrors DPU) */
+/* host threads: -T, or every online core */
+static unsigned cpu_threads(const Params *prm)
+{
+    if (prm->cpu_threads) return prm->cpu_threads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+/* CPU reference in the kernel's types (mirrors DPU), the assignment
+   spread over nt threads (cpu_kmeans.h) */
 static unsigned
-kmeans_int16(const q_feature_t *pts,
+kmeans_ref(const q_feature_t *pts,
              q_feature_t       *c,
+             const uint8_t     *wshift,     /* per-feature weights     */
              unsigned N, unsigned D, unsigned K,
              double   thr,                /* convergence threshold   */
-             unsigned max_iter)           /* hard upper bound        */
+             unsigned max_iter,           /* hard upper bound        */
+             unsigned nt)                 /* threads                 */
 {
-    q_sum_t *sum = calloc((size_t)K*D, sizeof *sum);
-    count_t *cnt = calloc(K, sizeof *cnt);
-    if (!sum || !cnt) { perror("calloc"); exit(1); }
-
+    global_acc_t acc = { PTHREAD_MUTEX_INITIALIZER,
+                         malloc(K*sizeof(count_t)), malloc((size_t)K*D*sizeof(q_sum_t)), K, D };
     q_feature_t *prev = malloc((size_t)K*D * sizeof *prev);
+    q_feature_t *ct   = malloc((size_t)K*D * sizeof *ct);  /* transposed */
+    dist_t *dmin = malloc((size_t)N * sizeof *dmin);   /* for re-seeding */
+    cpu_pool_t pool;
+    if (!acc.cnt || !acc.sum || !prev || !ct || !dmin || cpu_pool_init(&pool, nt, K, D)) {
+        perror("malloc"); exit(1);
+    }
+    const count_t *cnt = acc.cnt;
+    const q_sum_t *sum = acc.sum;
 
     unsigned it = 0;
     double shift = thr + 1.0;
 
     while (it < max_iter && shift > thr) {
         memcpy(prev, c, (size_t)K*D*sizeof *prev);
-        memset(sum, 0, (size_t)K*D*sizeof *sum);
-        memset(cnt, 0, K*sizeof *cnt);
+        acc_reset(&acc);
 
         // asign
-        for (unsigned i = 0; i < N; ++i) {
-            int64_t best = INT64_MAX; unsigned bestk = 0;
-            for (unsigned k = 0; k < K; ++k) {
-                int64_t dsq = 0;
-                for (unsigned f = 0; f < D; ++f) {
-                    int32_t d = (int32_t)pts[i*D+f] - c[k*D+f];
-                    dsq += (int64_t)d * d;
-                }
-                if (dsq < best) { best = dsq; bestk = k; }
-            }
-            cnt[bestk]++;
-            for (unsigned f = 0; f < D; ++f)
-                sum[bestk*D+f] += pts[i*D+f];
+        cpu_transpose(c, ct, K, D);
+        cpu_pool_bind(&pool, pts, N, 0, ct, wshift, D, K, 1, NULL, dmin, &acc);
+        cpu_start(&pool);
+        cpu_wait(&pool);
+
+        // empty clusters restart at the farthest points, farthest first
+        for (unsigned k = 0; k < K; ++k) {
+            if (cnt[k]) continue;
+            dist_t far = 0; size_t fi = N;
+            for (size_t i = 0; i < N; ++i)
+                if (dmin[i] > far) { far = dmin[i]; fi = i; }
+            if (fi == N) break;
+            memcpy(&c[k*D], &pts[fi*D], D*sizeof *c);
+            dmin[fi] = -1;
         }
 
         // update
         for (unsigned k = 0; k < K; ++k)
             if (cnt[k])
                 for (unsigned f = 0; f < D; ++f)
-                    c[k*D+f] = (q_feature_t)(sum[k*D+f] / (int32_t)cnt[k]);
+                    c[k*D+f] = quant_mean(sum[k*D+f], cnt[k]);
 
         // shift
         shift = 0.0;
@@ -92,63 +114,892 @@ kmeans_int16(const q_feature_t *pts,
         ++it;
     }
 
-    free(prev); free(sum); free(cnt);
+    free(prev); free(ct); free(acc.sum); free(acc.cnt); free(dmin);
+    cpu_pool_free(&pool);
     return it;               /* <= max_iter */
 }
 
-// print
+/* double-precision Lloyd on the real features (what the v2 double kernel
+   computes): reference for the quantisation error report */
+static unsigned
+kmeans_double(quant_value_fn val, const void *src, double *c,
+              unsigned N, unsigned D, unsigned K, unsigned max_iter)
+{
+    double  *sum = malloc((size_t)K*D*sizeof *sum);
+    count_t *cnt = malloc(K*sizeof *cnt);
+    if (!sum || !cnt) { perror("malloc"); exit(1); }
+
+    unsigned it = 0;
+    int moved = 1;
+    while (it < max_iter && moved) {
+        memset(sum, 0, (size_t)K*D*sizeof *sum);
+        memset(cnt, 0, K*sizeof *cnt);
+        for (unsigned i = 0; i < N; ++i) {
+            double x[MAX_FEATURES], best = DBL_MAX; unsigned bestk = 0;
+            for (unsigned f = 0; f < D; ++f) x[f] = val(src, (size_t)i*D+f);
+            for (unsigned k = 0; k < K; ++k) {
+                double dsq = 0.0;
+                for (unsigned f = 0; f < D; ++f) {
+                    double d = x[f] - c[k*D+f];
+                    dsq += d*d;
+                }
+                if (dsq < best) { best = dsq; bestk = k; }
+            }
+            cnt[bestk]++;
+            for (unsigned f = 0; f < D; ++f) sum[bestk*D+f] += x[f];
+        }
+        moved = 0;
+        for (unsigned k = 0; k < K; ++k)
+            if (cnt[k])
+                for (unsigned f = 0; f < D; ++f) {
+                    double m = sum[k*D+f] / cnt[k];
+                    if (m != c[k*D+f]) { c[k*D+f] = m; moved = 1; }
+                }
+        ++it;
+    }
+    free(sum); free(cnt);
+    return it;
+}
+
+/* sum of squared distances of the real points to their nearest centroid */
+static double
+inertia(quant_value_fn val, const void *src, const double *c,
+        unsigned N, unsigned D, unsigned K)
+{
+    double sse = 0.0;
+    for (unsigned i = 0; i < N; ++i) {
+        double best = DBL_MAX;
+        for (unsigned k = 0; k < K; ++k) {
+            double dsq = 0.0;
+            for (unsigned f = 0; f < D; ++f) {
+                double d = val(src, (size_t)i*D+f) - c[k*D+f];
+                dsq += d*d;
+            }
+            if (dsq < best) best = dsq;
+        }
+        sse += best;
+    }
+    return sse;
+}
+
+// print (de-quantised)
 static void print_centroids(const char *lbl,
-                            const q_feature_t *c_i16,
+                            const q_feature_t *c_i16, const quant_t *q,
                             unsigned K,unsigned D)
 {
     printf("%s\n",lbl);
     for(unsigned k=0;k<K;++k){
         printf(" cluster %u ⇒ (",k);
         for(unsigned f=0;f<D;++f){
-            printf("%d%s",c_i16[k*D+f],f==D-1?")\n":", ");
+            printf("%.6g%s",quant_decode(q,f,c_i16[k*D+f]),f==D-1?")\n":", ");
+        }
+    }
+}
+
+/* real-valued sources for the quantiser and the double reference */
+static double fp_value(const void *src, size_t i)
+{
+    return ((const feature_t *)src)[i];
+}
+static double file_value(const void *src, size_t i)
+{
+    return kmb_value(src, i);
+}
+
+/* DPU share of n points when the host takes about frac of them, in whole
+   groups of 8 points per DPU (the scatter moves multiples of 8 bytes) */
+static uint32_t hybrid_split(uint32_t n, uint32_t NR, double frac)
+{
+    const uint64_t grp=8ull*NR;
+    uint64_t nd=(uint64_t)((1.0-frac)*n)/grp*grp;
+    if(nd<grp) nd=n<grp?n:grp;
+    return (uint32_t)nd;
+}
+
+/* shard source over the in-memory quantised dataset (an int16 file's
+   mapping: the copy reads the shard's pages from disk) */
+typedef struct { const q_feature_t *pts; unsigned D; } mem_source_t;
+
+static void mem_read(void *src, uint64_t first, uint32_t n, void *dst)
+{
+    const mem_source_t *m=src;
+    memcpy(dst,&m->pts[first*m->D],(size_t)n*m->D*sizeof(q_feature_t));
+}
+
+/* shard source over the real features: the shard is read and quantised
+   into dst, so no quantised copy of the dataset is needed */
+static void rows_read(void *src, uint64_t first, uint32_t n, void *dst)
+{
+    const row_source_t *rs=src;
+    quant_encode_rows(rs->qz,rs->val,rs->src,first,n,dst);
+}
+
+/* ---------------- k-means|| seeding ---------------- */
+/* n centroid-like rows (seed candidates) into the kernel's centroid slot;
+   c must be readable up to the next 8 bytes */
+static void push_centers(struct dpu_set_t dpus, const q_feature_t *c,
+                         unsigned n, unsigned D)
+{
+    const size_t bytes=align8((size_t)n*D*sizeof *c);
+    DPU_ASSERT(dpu_broadcast_to(dpus,"c_clusters",0,c,bytes,DPU_XFER_DEFAULT));
+}
+
+/* the same bytes of symbol sym from every DPU, into dst[NR][bytes] */
+static void pull_all(struct dpu_set_t dpus, const char *sym, void *dst, size_t bytes)
+{
+    struct dpu_set_t d; uint32_t i;
+    DPU_FOREACH(dpus,d,i){
+        DPU_ASSERT(dpu_prepare_xfer(d,(uint8_t *)dst+(size_t)i*bytes));
+    }
+    DPU_ASSERT(dpu_push_xfer(dpus,DPU_XFER_FROM_DPU,sym,0,bytes,DPU_XFER_DEFAULT));
+}
+
+/* one seeding stage on every DPU; rng differs per DPU */
+static void seed_stage(struct dpu_set_t dpus, seed_args_t *sa, uint32_t NR,
+                       seed_args_t a)
+{
+    struct dpu_set_t d; uint32_t i;
+    for(uint32_t j=0;j<NR;++j){ sa[j]=a; sa[j].rng=a.rng+0x9E3779B97F4A7C15ULL*j; }
+    DPU_FOREACH(dpus,d,i){DPU_ASSERT(dpu_prepare_xfer(d,&sa[i]));}
+    DPU_ASSERT(dpu_push_xfer(dpus,DPU_XFER_TO_DPU,"c_seed",0,sizeof *sa,DPU_XFER_DEFAULT));
+    if(a.mode!=SEED_OFF) DPU_ASSERT(dpu_launch(dpus,DPU_SYNCHRONOUS));
+}
+
+/* weighted squared distance in the kernel's metric, real-valued centroid */
+static double seed_dist2(const double *c, const q_feature_t *x,
+                         const uint8_t *wshift, unsigned D)
+{
+    double s=0.0;
+    for(unsigned f=0;f<D;++f){
+        double d=(double)x[f]-c[f];
+#if FEATURE_FLOAT
+        s+=d*d; (void)wshift;
+#else
+        s+=ldexp(d*d,wshift[f]);
+#endif
+    }
+    return s;
+}
+
+/* K centroids from C weighted candidates: k-means++ picks, then weighted
+   Lloyd iterations (C is small: a few K) */
+static void seed_recluster(const q_feature_t *cand, const uint64_t *w, unsigned C,
+                           unsigned D, unsigned K, const uint8_t *wshift,
+                           q_feature_t *cent)
+{
+    double  *c  =malloc((size_t)K*D*sizeof *c);
+    double  *sum=malloc((size_t)K*D*sizeof *sum);
+    double  *d2 =malloc(C*sizeof *d2);
+    double  *cnt=malloc(K*sizeof *cnt);
+    if(!c||!sum||!d2||!cnt){perror("malloc");exit(1);}
+
+    for(unsigned k=0;k<K;++k){
+        double tot=0.0;
+        for(unsigned i=0;i<C;++i){
+            double dd=k?d2[i]:1.0;
+            tot+=dd*w[i];
+        }
+        /* candidate with probability weight x distance (weight alone first) */
+        double r=tot*rand()/((double)RAND_MAX+1.0);
+        unsigned pick=C-1;
+        for(unsigned i=0;i<C;++i){
+            r-=(k?d2[i]:1.0)*w[i];
+            if(r<0.0){pick=i;break;}
+        }
+        if(tot<=0.0) pick=(unsigned)(k%C);
+        for(unsigned f=0;f<D;++f) c[k*D+f]=cand[(size_t)pick*D+f];
+        for(unsigned i=0;i<C;++i){
+            double dd=seed_dist2(&c[k*D],&cand[(size_t)i*D],wshift,D);
+            if(!k||dd<d2[i]) d2[i]=dd;
+        }
+    }
+    for(unsigned it=0;it<30;++it){
+        int moved=0;
+        memset(sum,0,(size_t)K*D*sizeof *sum);
+        memset(cnt,0,K*sizeof *cnt);
+        for(unsigned i=0;i<C;++i){
+            double best=DBL_MAX; unsigned bk=0;
+            for(unsigned k=0;k<K;++k){
+                double dd=seed_dist2(&c[k*D],&cand[(size_t)i*D],wshift,D);
+                if(dd<best){best=dd;bk=k;}
+            }
+            cnt[bk]+=w[i];
+            for(unsigned f=0;f<D;++f) sum[bk*D+f]+=(double)w[i]*cand[(size_t)i*D+f];
+        }
+        for(unsigned k=0;k<K;++k)
+            if(cnt[k]>0)
+                for(unsigned f=0;f<D;++f){
+                    double v=sum[k*D+f]/cnt[k];
+                    if(v!=c[k*D+f]){c[k*D+f]=v;moved=1;}
+                }
+        if(!moved) break;
+    }
+    for(unsigned i=0;i<K*D;++i)
+#if FEATURE_FLOAT
+        cent[i]=c[i];
+#else
+        cent[i]=(q_feature_t)lrint(c[i]);
+#endif
+    free(c); free(sum); free(d2); free(cnt);
+}
+
+/*
+ * k-means|| (Bahmani et al.) over the resident points: from one random
+ * candidate, each round the DPUs fold the new candidates into every point's
+ * nearest-candidate distance d(x), the host sums psi = sum d(x), and the
+ * DPUs take each point with probability SEED_OVERSAMPLE*K*d(x)/psi. The
+ * DPUs then count the points nearest to each candidate, and the weighted
+ * candidates are clustered into K on the host. Returns the candidate count.
+ */
+static unsigned
+kmeans_par_seed(struct dpu_set_t dpus, uint32_t NR, const part_t *part,
+                const q_feature_t *pts, unsigned N, unsigned D, unsigned K,
+                const uint8_t *wshift, unsigned rounds, q_feature_t *cent)
+{
+    const unsigned cap=SEED_CAND_MAX;
+    /* padded: push_centers reads up to 8 bytes past the last row */
+    q_feature_t *cand=malloc(((size_t)cap*D+8)*sizeof *cand);
+    seed_args_t *sa=malloc(NR*sizeof *sa);
+    seed_out_t  *out=malloc(NR*sizeof *out);
+    uint32_t    *idx=malloc((size_t)NR*align8(SEED_OUT_MAX*sizeof(uint32_t)));
+    dist_t      *psi=malloc(NR*sizeof *psi);
+    uint64_t    *w=calloc(cap,sizeof *w);
+    uint32_t    *wd=malloc((size_t)NR*align8(cap*sizeof(uint32_t)));
+    if(!cand||!sa||!out||!idx||!psi||!w||!wd){perror("malloc");exit(1);}
+
+    unsigned C=1, done=0;
+    memcpy(cand,&pts[(size_t)(rand()%N)*D],D*sizeof *cand);
+    for(unsigned r=0;;++r){
+        /* distances to the candidates added since the last round */
+        for(unsigned b=done;b<C;b+=MAX_CLUSTERS){
+            const unsigned n=C-b<MAX_CLUSTERS?C-b:MAX_CLUSTERS;
+            push_centers(dpus,&cand[(size_t)b*D],n,D);
+            seed_stage(dpus,sa,NR,(seed_args_t){SEED_UPDATE,b,n,0,0,0});
+        }
+        done=C;
+        if(r==rounds||C==cap) break;
+
+        pull_all(dpus,"seed_psi",psi,sizeof *psi);
+        dist_t tot=0;
+        for(uint32_t j=0;j<NR;++j) tot+=psi[j];
+        if(tot<=0) break;                       /* every point is a candidate */
+#if FEATURE_FLOAT
+        const dist_t span=tot/(SEED_OVERSAMPLE*K);
+#else
+        dist_t span=tot/(SEED_OVERSAMPLE*K);
+        if(span<1) span=1;
+#endif
+        const uint64_t rng=((uint64_t)rand()<<32)^(uint64_t)rand();
+        seed_stage(dpus,sa,NR,(seed_args_t){SEED_SAMPLE,0,0,0,rng,span});
+        pull_all(dpus,"seed_out",out,sizeof *out);
+        uint32_t most=0;
+        for(uint32_t j=0;j<NR;++j){
+            if(out[j].n>SEED_OUT_MAX){
+                fprintf(stderr,"DPU %u: %u seed samples in a round, over SEED_OUT_MAX (%u)\n",
+                        j,out[j].n,(unsigned)SEED_OUT_MAX);
+                exit(1);
+            }
+            if(out[j].n>most) most=out[j].n;
+        }
+        if(most==0) continue;
+        const size_t ibytes=align8(most*sizeof *idx);
+        pull_all(dpus,"seed_idx",idx,ibytes);
+        for(uint32_t j=0;j<NR&&C<cap;++j){
+            const uint32_t *ij=&idx[(size_t)j*ibytes/sizeof *idx];
+            for(uint32_t t=0;t<out[j].n&&C<cap;++t)
+                memcpy(&cand[(size_t)C++*D],&pts[((size_t)part[j].off+ij[t])*D],
+                       D*sizeof *cand);
+        }
+    }
+
+    /* weights: points nearest to each candidate, summed over the DPUs */
+    const size_t wbytes=align8(C*sizeof(uint32_t));
+    seed_stage(dpus,sa,NR,(seed_args_t){SEED_WEIGH,0,C,0,0,0});
+    pull_all(dpus,"seed_w",wd,wbytes);
+    for(uint32_t j=0;j<NR;++j)
+        for(unsigned i=0;i<C;++i) w[i]+=wd[(size_t)j*wbytes/sizeof *wd+i];
+    seed_stage(dpus,sa,NR,(seed_args_t){SEED_OFF,0,0,0,0,0});
+
+    if(C<K){
+        /* too few distinct candidates: every one becomes a centroid */
+        for(unsigned k=0;k<K;++k)
+            memcpy(&cent[k*D],&cand[(size_t)(k%C)*D],D*sizeof *cand);
+    }else{
+        seed_recluster(cand,w,C,D,K,wshift,cent);
+    }
+    free(cand); free(sa); free(out); free(idx); free(psi); free(w); free(wd);
+    return C;
+}
+
+/* the host threads' farthest points, sources NR.. of fs; pts is the whole
+   dataset */
+static void far_collect_cpu(far_set_t *fs, const cpu_pool_t *p, uint32_t NR,
+                            unsigned D, unsigned R, const q_feature_t *pts)
+{
+    const uint32_t NS=fs->n/(R*FAR_SLOTS);
+    for(uint32_t r=0;r<R;++r)
+        for(uint32_t t=0;t<p->nt;++t){
+            const far_point_t *fp=p->part[t].far[r];
+            for(uint32_t s=0;s<FAR_SLOTS;++s){
+                const uint32_t slot=(r*NS+NR+t)*FAR_SLOTS+s;
+                if(fp[s].idx==FAR_NONE) continue;
+                const uint64_t gi=p->part[t].first+fp[s].idx;
+                fs->d[slot]=fp[s].d;
+                fs->gi[slot]=gi;
+                memcpy(&fs->pt[(size_t)slot*D],&pts[gi*D],D*sizeof *pts);
+            }
+        }
+}
+
+/* mini-batch step: each centroid moves towards the mean of its batch points
+   at rate n_batch / n_seen, a per-centroid learning rate that keeps it the
+   mean of every point it was assigned so far; c holds the centroids
+   unrounded, out gets them in the kernel's type */
+static void minibatch_update(double *c, count_t *seen, const count_t *cnt,
+                             const q_sum_t *sum, q_feature_t *out,
+                             unsigned K, unsigned D)
+{
+    for(unsigned k=0;k<K;++k){
+        if(cnt[k]){
+            seen[k]+=cnt[k];
+            const double lr=(double)cnt[k]/seen[k];
+            for(unsigned f=0;f<D;++f)
+                c[k*D+f]+=lr*((double)sum[k*D+f]/cnt[k]-c[k*D+f]);
+        }
+        for(unsigned f=0;f<D;++f)
+#if FEATURE_FLOAT
+            out[k*D+f]=c[k*D+f];
+#else
+            out[k*D+f]=(q_feature_t)lrint(c[k*D+f]);
+#endif
+    }
+}
+
+/* ---------------- batched jobs (-J) ---------------- */
+/*
+ * Independent problems on one allocation. The ranks are cut into slots of
+ * whole ranks; a slot runs one job at a time with that job's own D, K,
+ * weights and centroids (broadcast per rank, D and K in the per-DPU
+ * arguments) and takes the next job of the list once its job converges.
+ * Every step launches the ranks of all busy slots together, so small jobs
+ * share the machine instead of queueing for all of it.
+ */
+typedef struct {
+    char        *path;
+    unsigned     K;            /* 0: the file's suggestion */
+    kmb_file_t   kf;
+    unsigned     N, D;
+    quant_t      qz;
+    const q_feature_t *pts;
+    q_feature_t *own, *cent, *prev;
+    q_feature_t *ref;          /* -v: the seeds, for the CPU reference */
+    count_t     *cnt;
+    q_sum_t     *sum;
+    uint8_t     *recs;         /* the slot's records */
+    size_t       rb;
+    uint32_t     ents;         /* SPARSE: entries fetched with the prefix */
+    far_set_t    far;
+#if PRUNE
+    prune_info_t pr;
+#endif
+    unsigned     it;
+    uint64_t     changed;
+    double       t0;
+} job_t;
+
+typedef struct {
+    uint32_t rank0, nranks;    /* its ranks ...           */
+    uint32_t dpu0, ndpus;      /* ... and their DPUs      */
+    int      job;              /* running job, -1: idle   */
+} slot_t;
+
+/* one job per line: "<file.kmb> [K]"; blank lines and '#' comments skipped */
+static job_t *read_jobs(const char *path, unsigned *nj)
+{
+    FILE *f=fopen(path,"r");
+    if(!f){perror(path);exit(1);}
+    job_t *j=NULL; unsigned n=0,cap=0;
+    char line[4096];
+    while(fgets(line,sizeof line,f)){
+        char *p=strtok(line," \t\r\n");
+        if(!p||*p=='#') continue;
+        if(n==cap){
+            cap=cap?2*cap:16;
+            j=realloc(j,cap*sizeof *j);
+            if(!j){perror("realloc");exit(1);}
+        }
+        memset(&j[n],0,sizeof *j);
+        j[n].path=malloc(strlen(p)+1);
+        if(!j[n].path){perror("malloc");exit(1);}
+        strcpy(j[n].path,p);
+        const char *k=strtok(NULL," \t\r\n");
+        j[n].K=k?(unsigned)atoi(k):0;
+        n++;
+    }
+    fclose(f);
+    *nj=n;
+    return j;
+}
+
+/* open, quantise and scatter job j over slot s; seeds are K random points */
+static int job_start(job_t *j, const slot_t *s, const struct dpu_set_t *rk,
+                     const uint32_t *rank_first, part_t *part,
+                     dpu_arguments_t *arg, const Params *prm)
+{
+    if(kmb_open(j->path,&j->kf)) return -1;
+    const kmb_file_t *kf=&j->kf;
+    if(kf->hdr.n_points>UINT32_MAX){
+        fprintf(stderr,"%s: more than %u points\n",j->path,UINT32_MAX);
+        kmb_close(&j->kf); return -1;
+    }
+    j->N=(unsigned)kf->hdr.n_points; j->D=kf->hdr.n_features;
+    if(!j->K) j->K=kf->hdr.n_clusters?kf->hdr.n_clusters:prm->n_clusters;
+    const unsigned N=j->N,D=j->D,K=j->K;
+    if(!check_limits(N,D,K)){ kmb_close(&j->kf); return -1; }
+    if(N>(uint64_t)s->ndpus*MAX_POINTS_DPU){
+        fprintf(stderr,"%s: %u points exceed the %u DPUs of a slot "
+                       "(MAX_POINTS_DPU=%d each)\n",j->path,N,s->ndpus,MAX_POINTS_DPU);
+        kmb_close(&j->kf); return -1;
+    }
+
+    if(FEATURE_BITS==16 && kf->hdr.dtype==KMB_INT16 && prm->quant_mode<0){
+        quant_identity(&j->qz,D,kf->hdr.scale,kf->hdr.offset);
+        j->pts=kf->data;
+    }else{
+        j->own=malloc((size_t)N*D*sizeof *j->own);
+        if(!j->own){perror("malloc");exit(1);}
+        quant_fit(&j->qz,file_value,kf,N,D,prm->quant_mode<0?QUANT_RANGE:prm->quant_mode);
+        quant_encode(&j->qz,file_value,kf,N,j->own);
+        j->pts=j->own;
+    }
+
+    j->rb=rec_bytes(K,D,1);
+    j->cent=calloc(1,align8((size_t)K*D*sizeof *j->cent));
+    j->prev=malloc((size_t)K*D*sizeof *j->prev);
+    j->cnt =malloc(K*sizeof *j->cnt);
+    j->sum =malloc((size_t)K*D*sizeof *j->sum);
+    j->recs=malloc((size_t)s->ndpus*j->rb);
+    far_alloc(&j->far,s->ndpus*FAR_SLOTS,D);
+    if(!j->cent||!j->prev||!j->cnt||!j->sum||!j->recs){
+        perror("malloc");exit(1);
+    }
+    for(unsigned k=0;k<K;++k)
+        memcpy(&j->cent[k*D],&j->pts[(size_t)(rand()%N)*D],D*sizeof *j->cent);
+    if(prm->validate){
+        j->ref=malloc((size_t)K*D*sizeof *j->ref);
+        if(!j->ref){perror("malloc");exit(1);}
+        memcpy(j->ref,j->cent,(size_t)K*D*sizeof *j->ref);
+    }
+#if PRUNE
+    memset(&j->pr,0,sizeof j->pr);
+#endif
+
+    /* each rank takes a share of the points in proportion to its DPUs */
+    for(uint32_t r=s->rank0;r<s->rank0+s->nranks;++r){
+        const uint32_t d0=rank_first[r]-s->dpu0, d1=rank_first[r+1]-s->dpu0;
+        const uint32_t p0=(uint32_t)((uint64_t)N*d0/s->ndpus);
+        const uint32_t p1=(uint32_t)((uint64_t)N*d1/s->ndpus);
+        scatter_points(rk[r],d1-d0,&j->pts[(size_t)p0*D],p1-p0,D,K,1,
+                       &part[rank_first[r]],&arg[rank_first[r]],NULL);
+        for(uint32_t i=rank_first[r];i<rank_first[r+1];++i) part[i].off+=p0;
+        DPU_ASSERT(dpu_broadcast_to(rk[r],"c_wshift",0,j->qz.wshift,
+                   sizeof j->qz.wshift,DPU_XFER_DEFAULT));
+    }
+    j->it=0;
+    j->t0=now_ms();
+    return 0;
+}
+
+static void job_finish(job_t *j, unsigned id, unsigned slot, const Params *prm)
+{
+    char label[160];
+    snprintf(label,sizeof label,"\nJob %u (%s, slot %u): %u points, %u features, "
+             "%u clusters | %u iters, %llu labels changed in the last, %.2f ms",
+             id,j->path,slot,j->N,j->D,j->K,j->it,(unsigned long long)j->changed,
+             now_ms()-j->t0);
+    print_centroids(label,j->cent,&j->qz,j->K,j->D);
+    if(j->ref){
+        const unsigned it=kmeans_ref(j->pts,j->ref,j->qz.wshift,j->N,j->D,j->K,
+                                     prm->shift_thr,prm->max_iter,cpu_threads(prm));
+#if FEATURE_FLOAT
+        int same=it==j->it;
+        for(unsigned i=0;i<j->K*j->D;++i)
+            if(fabs(j->ref[i]-j->cent[i])>1e-9*(1.0+fabs(j->ref[i]))) same=0;
+#else
+        int same=it==j->it && !memcmp(j->ref,j->cent,(size_t)j->K*j->D*sizeof *j->ref);
+#endif
+        printf("Validation: job %u %s CPU reference\n",id,same?"matches":"DIFFERS FROM");
+        free(j->ref);
+    }
+    free(j->own); free(j->cent); free(j->prev); free(j->cnt); free(j->sum);
+    free(j->recs); far_free(&j->far);
+    kmb_close(&j->kf);
+}
+
+static int run_jobs(const char *jobfile, const Params *prm)
+{
+    unsigned NJ; job_t *jobs=read_jobs(jobfile,&NJ);
+    if(!NJ){fprintf(stderr,"%s: no jobs\n",jobfile);return 1;}
+    srand((unsigned)time(NULL));
+
+    const double b0=now_ms();
+    struct dpu_set_t dpus;
+    DPU_ASSERT(dpu_alloc(NR_DPUS,NULL,&dpus));
+    DPU_ASSERT(dpu_load(dpus,DPU_BINARY,NULL));
+    uint32_t NR, NRANKS;
+    DPU_ASSERT(dpu_get_nr_dpus(dpus,&NR));
+    DPU_ASSERT(dpu_get_nr_ranks(dpus,&NRANKS));
+
+    struct dpu_set_t *rk=malloc(NRANKS*sizeof *rk);
+    uint32_t *rank_first=malloc((NRANKS+1)*sizeof *rank_first);
+    part_t *part=malloc(NR*sizeof *part);
+    dpu_arguments_t *arg=malloc(NR*sizeof *arg);
+    if(!rk||!rank_first||!part||!arg){perror("malloc");exit(1);}
+    {
+        struct dpu_set_t r; uint32_t ri=0,first=0;
+        DPU_RANK_FOREACH(dpus,r,ri){
+            uint32_t n; DPU_ASSERT(dpu_get_nr_dpus(r,&n));
+            rk[ri]=r; rank_first[ri]=first; first+=n;
+        }
+        rank_first[NRANKS]=first;
+    }
+
+    /* as many slots as jobs, up to one per rank; the ranks spread evenly */
+    const uint32_t NS=NJ<NRANKS?NJ:NRANKS;
+    slot_t *slot=malloc(NS*sizeof *slot);
+    if(!slot){perror("malloc");exit(1);}
+    for(uint32_t s=0,r=0;s<NS;++s){
+        const uint32_t n=NRANKS/NS+(s<NRANKS%NS);
+        slot[s]=(slot_t){r,n,rank_first[r],rank_first[r+n]-rank_first[r],-1};
+        r+=n;
+    }
+    printf("Batch: %u jobs, %u DPUs in %u ranks, %u slots (kernel %s)\n",
+           NJ,NR,NRANKS,NS,DPU_BINARY);
+
+    unsigned next=0, done=0, failed=0;
+    uint64_t steps=0, busy_ranks=0;
+    while(done+failed<NJ){
+        /* idle slots take the next jobs that load */
+        for(uint32_t s=0;s<NS;++s)
+            while(slot[s].job<0&&next<NJ){
+                const unsigned id=next++;
+                if(job_start(&jobs[id],&slot[s],rk,rank_first,part,arg,prm)) failed++;
+                else slot[s].job=(int)id;
+            }
+        if(done+failed==NJ) break;
+
+        /* ship every busy slot's centroids and launch its ranks */
+        for(uint32_t s=0;s<NS;++s){
+            if(slot[s].job<0) continue;
+            job_t *j=&jobs[slot[s].job];
+            const unsigned D=j->D,K=j->K;
+            const size_t cbytes=align8((size_t)K*D*sizeof(q_feature_t));
+            memcpy(j->prev,j->cent,(size_t)K*D*sizeof *j->prev);
+#if DIST_MODE == DIST_EXPAND
+            dist_t cnorm[MAX_CLUSTERS];
+            static const q_feature_t zero[MAX_FEATURES];
+            for(unsigned k=0;k<K;++k)
+                cnorm[k]=quant_dist2(&j->cent[k*D],zero,j->qz.wshift,D);
+#endif
+            for(uint32_t r=slot[s].rank0;r<slot[s].rank0+slot[s].nranks;++r){
+                DPU_ASSERT(dpu_broadcast_to(rk[r],"c_clusters",0,j->cent,
+                           cbytes,DPU_XFER_DEFAULT));
+#if DIST_MODE == DIST_EXPAND
+                DPU_ASSERT(dpu_broadcast_to(rk[r],"c_norms",0,cnorm,
+                           K*sizeof *cnorm,DPU_XFER_DEFAULT));
+#endif
+#if PRUNE
+                DPU_ASSERT(dpu_broadcast_to(rk[r],"c_prune",0,&j->pr,
+                           sizeof j->pr,DPU_XFER_DEFAULT));
+#endif
+                DPU_ASSERT(dpu_launch(rk[r],DPU_ASYNCHRONOUS));
+            }
+            busy_ranks+=slot[s].nranks;
+        }
+        steps++;
+        DPU_ASSERT(dpu_sync(dpus));
+
+        /* per slot: gather, fold, update, and retire converged jobs */
+        for(uint32_t s=0;s<NS;++s){
+            if(slot[s].job<0) continue;
+            job_t *j=&jobs[slot[s].job];
+            const unsigned D=j->D,K=j->K;
+            for(uint32_t r=slot[s].rank0;r<slot[s].rank0+slot[s].nranks;++r)
+                pull_records(rk[r],j->recs+(size_t)(rank_first[r]-slot[s].dpu0)*j->rb,
+                             j->rb,D,&j->ents);
+            j->changed=0;
+            for(uint32_t i=0;i<slot[s].ndpus;++i){
+                const rec_hdr_t *h=(const rec_hdr_t *)(j->recs+(size_t)i*j->rb);
+                if(!h->done){
+                    fprintf(stderr,"DPU %u: stale record (not done)\n",slot[s].dpu0+i);
+                    exit(1);
+                }
+                j->changed+=h->changed;
+            }
+            rec_fold(j->cnt,j->sum,j->recs,j->rb,0,slot[s].ndpus,K,D);
+            far_reset(&j->far);
+            far_collect(&j->far,j->recs,j->rb,slot[s].ndpus,K,D,1,
+                        &part[slot[s].dpu0],j->pts,0);
+            far_reseed(&j->far,j->cnt,j->cent,K,D);
+            for(unsigned k=0;k<K;++k)
+                if(j->cnt[k])
+                    for(unsigned f=0;f<D;++f)
+                        j->cent[k*D+f]=quant_mean(j->sum[k*D+f],j->cnt[k]);
+#if PRUNE
+            prune_update(&j->pr,j->prev,j->cent,j->qz.wshift,K,D);
+#endif
+            j->it++;
+
+            double shift=0.0;
+            for(unsigned i=0;i<K*D;++i){
+                double diff=(double)j->cent[i]-(double)j->prev[i];
+                shift+=diff*diff;
+            }
+            shift=sqrt(shift);
+            if((double)j->changed<=prm->changed_frac*j->N||shift<=prm->shift_thr||
+               j->it>=prm->max_iter){
+                job_finish(j,(unsigned)slot[s].job,s,prm);
+                slot[s].job=-1;
+                done++;
+            }
         }
     }
+
+    const double total_ms=now_ms()-b0;
+    printf("\nBatch:        %u jobs done, %u failed in %.2f ms | %llu steps, "
+           "ranks busy %.1f%%\n",done,failed,total_ms,(unsigned long long)steps,
+           steps?100.0*busy_ranks/((double)steps*NRANKS):0.0);
+
+    DPU_ASSERT(dpu_free(dpus));
+    for(unsigned i=0;i<NJ;++i) free(jobs[i].path);
+    free(jobs); free(rk); free(rank_first); free(part); free(arg); free(slot);
+    return failed?1:0;
+}
+
+#define SERVE_REPS 100              /* timed batches per batch size */
+
+static int dbl_cmp(const void *a, const void *b)
+{
+    const double x=*(const double *)a, y=*(const double *)b;
+    return x<y?-1:x>y;
+}
+
+/* nearest-rank pct-th percentile of the n>0 sorted values s: the
+   ceil(pct/100*n)-th smallest */
+static double pct_rank(const double *s, unsigned n, unsigned pct)
+{
+    return s[((size_t)pct*n+99)/100-1];
+}
+
+/* -P: latency of the batch sizes in list (comma separated) for the model
+   c[K*D], on batches cut from the dataset; -v checks every label */
+static int run_serve(const char *list, const Params *prm, const quant_t *qz,
+                     const q_feature_t *c, const q_feature_t *pts, unsigned N,
+                     unsigned D, unsigned K)
+{
+    uint32_t sizes[64], ns=0, cap=0;
+    for(const char *p=list;*p&&ns<64;){
+        const long v=strtol(p,(char **)&p,10);
+        if(v<=0){fprintf(stderr,"-P takes batch sizes, as in 1,64,4096\n");return 1;}
+        sizes[ns]=(uint32_t)(v<(long)N?v:(long)N);
+        if(sizes[ns]>cap) cap=sizes[ns];
+        ns++;
+        if(*p==',') p++;
+    }
+    engine_t e;
+    const double i0=now_ms();
+    struct dpu_set_t dpus;
+    DPU_ASSERT(dpu_alloc(NR_DPUS,NULL,&dpus));
+    char kpath[128];
+    DPU_ASSERT(dpu_load(dpus,pick_kernel(D,K,kpath,sizeof kpath),NULL));
+    if(engine_init(&e,dpus,D,K,cap)){DPU_ASSERT(dpu_free(dpus)); return 1;}
+    engine_load(&e,qz,c);
+    printf("\nServing:      model loaded on %u DPUs in %.2f ms\n",e.NR,now_ms()-i0);
+
+    uint16_t *lab=malloc((size_t)cap*sizeof *lab);
+    double *lat=malloc(SERVE_REPS*sizeof *lat);
+    if(!lab||!lat){perror("malloc");exit(1);}
+    uint64_t wrong=0;
+    for(uint32_t s=0;s<ns;++s){
+        const uint32_t b=sizes[s];
+        for(unsigned r=0;r<prm->n_warmup+SERVE_REPS;++r){
+            const q_feature_t *x=&pts[(size_t)(rand()%(N-b+1))*D];
+            const double t0=now_ms();
+            engine_assign(&e,x,b,lab);
+            if(r>=prm->n_warmup) lat[r-prm->n_warmup]=now_ms()-t0;
+            if(prm->validate)
+                for(uint32_t i=0;i<b;++i){
+                    dist_t best=DIST_MAX; unsigned bk=0;
+                    for(unsigned k=0;k<K;++k){
+                        const dist_t dd=quant_dist2(&x[(size_t)i*D],&c[k*D],qz->wshift,D);
+                        if(dd<best){best=dd;bk=k;}
+                    }
+                    wrong+=lab[i]!=bk;
+                }
+        }
+        qsort(lat,SERVE_REPS,sizeof *lat,dbl_cmp);
+        const double p50=pct_rank(lat,SERVE_REPS,50), p99=pct_rank(lat,SERVE_REPS,99);
+        printf("Serve:        batch %7u  p50 %8.3f ms  p99 %8.3f ms (of %u)  %10.0f points/s\n",
+               b,p50,p99,SERVE_REPS,p50>0?b/p50*1e3:0.0);
+    }
+    if(prm->validate)
+        printf("Validation: served labels %s CPU assignment\n",wrong?"DIFFER FROM":"match");
+    engine_free(&e);
+    DPU_ASSERT(dpu_free(dpus));
+    free(lab); free(lat);
+    return wrong?1:0;
 }
 
 /* =================================================================== */
+/* per-iteration wall time of the main loop (-O) */
+typedef struct {
+    int      mini;                     /* a mini-batch launch             */
+    double   bcast_ms;                 /* arguments, centroids, norms, c_prune */
+    double   scatter_ms;               /* streamed shards                 */
+    double   launch_ms, gather_ms;     /* as in launch_and_gather         */
+    double   merge_ms;                 /* far points, distances, update   */
+    uint64_t changed;
+} iter_times_t;
+
+typedef struct {
+    const char          *kernel;
+    uint32_t             N, D, K, R, NR;
+    double               cpu_ms, setup_ms, total_ms;
+    const iter_times_t  *iter;         /* the last run's passes           */
+    unsigned             nit;
+    const double        *run_ms;       /* the timed runs' loops, sorted   */
+    unsigned             nrun;
+    uint64_t             busy;         /* DPU cycles, all tasklets        */
+    const phase_stats_t *ps;           /* the same by phase, NULL: STATS=0 */
+    double               scans;        /* points assigned on the DPUs     */
+} run_report_t;
+
+/* -O: the run as JSON (path ending in .json) or the iterations as CSV;
+   returns 0, or -1 after printing the error */
+static int write_report(const char *path, const run_report_t *rp)
+{
+    FILE *f=fopen(path,"w");
+    if(!f){perror(path);return -1;}
+    const size_t len=strlen(path);
+    if(len>=5&&!strcmp(path+len-5,".json")){
+        static const char *dist[]={"direct","lut","expand"};
+        double tot[5]={0};
+        for(unsigned i=0;i<rp->nit;++i){
+            const iter_times_t *t=&rp->iter[i];
+            tot[0]+=t->bcast_ms; tot[1]+=t->scatter_ms; tot[2]+=t->launch_ms;
+            tot[3]+=t->gather_ms; tot[4]+=t->merge_ms;
+        }
+        fprintf(f,"{\n  \"config\": {\"points\": %u, \"features\": %u, \"clusters\": %u, "
+                  "\"sets\": %u, \"dpus\": %u, \"tasklets\": %d, \"kernel\": \"%s\", "
+                  "\"feature\": \"%s\", \"dist\": \"%s\", "
+                  "\"async\": %d, \"dynamic\": %d, \"prune\": %d, \"tiled\": %d, "
+                  "\"local_steps\": %d},\n",
+                rp->N,rp->D,rp->K,rp->R,rp->NR,NR_TASKLETS,rp->kernel,FEAT_NAME,
+                dist[DIST_MODE],ASYNC,DYNAMIC,PRUNE,TILED,LOCAL_STEPS);
+        fprintf(f,"  \"totals_ms\": {\"cpu\": %.4f, \"setup\": %.4f, \"broadcast\": %.4f, "
+                  "\"scatter\": %.4f, \"launch\": %.4f, \"gather\": %.4f, \"merge\": %.4f, "
+                  "\"total\": %.4f},\n",
+                rp->cpu_ms,rp->setup_ms,tot[0],tot[1],tot[2],tot[3],tot[4],rp->total_ms);
+        fprintf(f,"  \"runs_ms\": [");
+        for(unsigned i=0;i<rp->nrun;++i) fprintf(f,"%s%.4f",i?", ":"",rp->run_ms[i]);
+        fprintf(f,"],\n");
+        fprintf(f,"  \"dpu_cycles\": {\"busy\": %llu",(unsigned long long)rp->busy);
+        if(rp->ps)
+            fprintf(f,", \"dma\": %llu, \"dist\": %llu, \"acc\": %llu, \"reduce\": %llu, "
+                      "\"dma_bytes\": %llu, \"point_scans\": %.0f",
+                    (unsigned long long)rp->ps->dma,(unsigned long long)rp->ps->dist,
+                    (unsigned long long)rp->ps->acc,(unsigned long long)rp->ps->reduce,
+                    (unsigned long long)rp->ps->dma_bytes,rp->scans);
+        fprintf(f,"},\n  \"iterations\": [");
+        for(unsigned i=0;i<rp->nit;++i){
+            const iter_times_t *t=&rp->iter[i];
+            fprintf(f,"%s\n    {\"mini\": %d, \"bcast_ms\": %.4f, \"scatter_ms\": %.4f, "
+                      "\"launch_ms\": %.4f, \"gather_ms\": %.4f, \"merge_ms\": %.4f, "
+                      "\"changed\": %llu}",
+                    i?",":"",t->mini,t->bcast_ms,t->scatter_ms,t->launch_ms,
+                    t->gather_ms,t->merge_ms,(unsigned long long)t->changed);
+        }
+        fprintf(f,"\n  ]\n}\n");
+    }else{
+        fprintf(f,"iter,mini,bcast_ms,scatter_ms,launch_ms,gather_ms,merge_ms,changed\n");
+        for(unsigned i=0;i<rp->nit;++i){
+            const iter_times_t *t=&rp->iter[i];
+            fprintf(f,"%u,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%llu\n",i,t->mini,t->bcast_ms,
+                    t->scatter_ms,t->launch_ms,t->gather_ms,t->merge_ms,
+                    (unsigned long long)t->changed);
+        }
+    }
+    if(fclose(f)){perror(path);return -1;}
+    return 0;
+}
+
 int main(int argc,char **argv)
 {
-    unsigned N=1024,D=2,K=5;
-    if(argc==4){ N=atoi(argv[1]); D=atoi(argv[2]); K=atoi(argv[3]); }
-    else if(argc!=1){
-        fprintf(stderr,"Usage: %s <points> <features> <clusters>\n",argv[0]);
+    char *data_file;
+    Params prm=input_params_kmeans(argc,argv,&data_file);
+    if(prm.job_file) return run_jobs(prm.job_file,&prm);
+    unsigned N=prm.n_points,D=prm.n_features,K=prm.n_clusters;
+    kmb_file_t kf={0};
+    if(data_file){
+        if(kmb_open(data_file,&kf)) return 1;
+        if(kf.hdr.n_points>UINT32_MAX){
+            fprintf(stderr,"%s: more than %u points\n",data_file,UINT32_MAX);
+            return 1;
+        }
+        N=(unsigned)kf.hdr.n_points; D=kf.hdr.n_features;
+        if(kf.hdr.n_clusters) K=kf.hdr.n_clusters;
+    }
+    if(!check_limits(N,D,K)) return 1;
+    /* restarts: R centroid sets side by side, the best one reported */
+    const unsigned R=prm.n_init?prm.n_init:1, KT=R*K;
+    if(R>NINIT){
+        fprintf(stderr,"%u restarts exceed NINIT=%d (make NINIT=%u)\n",R,NINIT,R);
+        return 1;
+    }
+    if(KT>MAX_CLUSTERS){
+        fprintf(stderr,"%u restarts of %u clusters exceed MAX_CLUSTERS=%d\n",
+                R,K,MAX_CLUSTERS);
         return 1;
     }
     srand((unsigned)time(NULL));
 
-    /* generate & quantise data */
-    feature_t  *pts_fp = gen_fp_data(&N,&D);
-    q_feature_t *pts_q = malloc((size_t)N*D*sizeof *pts_q);
-    for(unsigned i=0;i<N*D;++i) pts_q[i]=(q_feature_t)lrintf(pts_fp[i]);
+    /* int16 files feed the int16 kernel straight from the mapping (their
+       scale/offset is shared by all features); anything else, or any file
+       when -q asks for it, is quantised to the kernel's type, into pts_own
+       when a mode needs it on the host (see the DPU set-up) */
+    feature_t   *pts_fp  = NULL;
+    q_feature_t *pts_own = NULL;
+    const q_feature_t *pts_q = NULL;
+    quant_t qz;
+    quant_value_fn rval=file_value;             /* real features */
+    const void *rsrc=&kf;
+    if(!data_file){
+        pts_fp=gen_fp_data(&N,&D);
+        rval=fp_value; rsrc=pts_fp;
+    }
+    if(FEATURE_BITS==16 && data_file && kf.hdr.dtype==KMB_INT16 && prm.quant_mode<0){
+        quant_identity(&qz,D,kf.hdr.scale,kf.hdr.offset);
+        pts_q=kf.data;
+    }else{
+        quant_fit(&qz,rval,rsrc,N,D,prm.quant_mode<0?QUANT_RANGE:prm.quant_mode);
+    }
+    const row_source_t rs={&qz,rval,rsrc};
 
     printf("Loaded dataset: %u points, %u features, %u clusters\n",N,D,K);
 
-    /* common centroid seed (integers 0-99) */
-    q_feature_t *cent_cpu = malloc((size_t)K*D*sizeof *cent_cpu);
-    q_feature_t *cent_dpu = malloc((size_t)K*D*sizeof *cent_dpu);
+    /* common centroid seeds: R sets of K random points, unless k-means||
+       replaces them */
+    q_feature_t *cent_cpu = malloc((size_t)KT*D*sizeof *cent_cpu);
+    /* padded to 8 bytes: the centroid push must be a multiple of 8 */
+    q_feature_t *cent_dpu = calloc(1,align8((size_t)KT*D*sizeof *cent_dpu));
+    if(!cent_cpu||!cent_dpu){perror("malloc");exit(1);}
 
-    for(unsigned i=0;i<K*D;++i)
-        cent_cpu[i]=cent_dpu[i]=(rand()%MAX_NUMBER);
-
-    /* ---------------- CPU INT16 reference ---------------- */
-    struct timespec t0,t1;
-    const double THR = 0.0001;
-    const unsigned CPU_MAX = 300;
-
-    clock_gettime(CLOCK_MONOTONIC, &t0);
-    unsigned cpu_iters = kmeans_int16(pts_q, cent_cpu, N, D, K, THR, CPU_MAX);
-    clock_gettime(CLOCK_MONOTONIC, &t1);
-
-    double cpu_ms = (t1.tv_sec - t0.tv_sec)*1e3 +
-                    (t1.tv_nsec - t0.tv_nsec)/1e6;
-    char label[64];
-    snprintf(label, sizeof label, "CPU-INT16 final (%u iters)", cpu_iters);
-    print_centroids(label, cent_cpu, K, D);
+    for(unsigned k=0;k<KT;++k){
+        const size_t i=(size_t)(rand()%N);
+        if(pts_q) memcpy(&cent_cpu[k*D],&pts_q[i*D],D*sizeof *pts_q);
+        else quant_encode_rows(&qz,rval,rsrc,i,1,&cent_cpu[k*D]);
+        memcpy(&cent_dpu[k*D],&cent_cpu[k*D],D*sizeof *cent_dpu);
+    }
 
     /* ---------------- DPU set-up ---------------- */
     struct timespec s0,s1;
@@ -156,115 +1007,704 @@ int main(int argc,char **argv)
 
     struct dpu_set_t dpus;
     DPU_ASSERT(dpu_alloc(NR_DPUS,NULL,&dpus));
-    DPU_ASSERT(dpu_load(dpus,"./bin/kmeans_dpu",NULL));
+    char kpath[128];
+    const char *kernel=pick_kernel(D,K,kpath,sizeof kpath);
+    DPU_ASSERT(dpu_load(dpus,kernel,NULL));
 
     uint32_t NR; DPU_ASSERT(dpu_get_nr_dpus(dpus,&NR));
-    printf("Number of DPUs: %u\n",NR);
-
-    typedef struct{uint32_t n,off;} part_t;
-    part_t *part=malloc(NR*sizeof *part);
+    printf("Number of DPUs: %u (kernel %s)\n",NR,kernel);
 
-    uint32_t base=N/NR,rem=N%NR,off=0;
-    for(uint32_t i=0;i<NR;++i){
-        uint32_t n=base+(i<rem);
-        part[i]=(part_t){n,off}; off+=n;
-    }
+    /* per-feature distance weights undo the per-feature scales */
+    DPU_ASSERT(dpu_broadcast_to(dpus,"c_wshift",0,qz.wshift,
+               sizeof qz.wshift,DPU_XFER_DEFAULT));
 
+    part_t *part=malloc(NR*sizeof *part);
     dpu_arguments_t *arg=malloc(NR*sizeof *arg);
+    if(!part||!arg){perror("malloc");exit(1);}
 
-    struct dpu_set_t d; uint32_t idx=0;
-    DPU_FOREACH(dpus,d,idx){
-        arg[idx]=(dpu_arguments_t){part[idx].n,D,K};
-        q_feature_t *sub=&pts_q[part[idx].off*D];
-        size_t bytes=(size_t)part[idx].n*D*sizeof(q_feature_t);
-        DPU_ASSERT(dpu_prepare_xfer(d,sub));
-        DPU_ASSERT(dpu_push_xfer(d,DPU_XFER_TO_DPU,
-                   "t_features",0,bytes,DPU_XFER_DEFAULT));
-    }
-    /* push args */
-    idx=0; DPU_FOREACH(dpus,d,idx){DPU_ASSERT(dpu_prepare_xfer(d,&arg[idx]));}
-    DPU_ASSERT(dpu_push_xfer(dpus,DPU_XFER_TO_DPU,
-               "DPU_INPUT_ARGUMENTS",0,sizeof(dpu_arguments_t),
-               DPU_XFER_DEFAULT));
+    /* datasets larger than NR x shard points are streamed shard by shard */
+    const uint32_t shard_cap=prm.shard_points?prm.shard_points:MAX_POINTS_DPU;
+    if(shard_cap>MAX_POINTS_DPU){
+        fprintf(stderr,"Shard size is limited to %d points per DPU\n",MAX_POINTS_DPU);
+        return 1;
+    }
+    const uint64_t shard_n=(uint64_t)NR*shard_cap;
+    const int streaming=N>shard_n;
+    /* mini-batch launches and seeding sample the resident points */
+    const unsigned MB=prm.mb_stride>1?(prm.mb_batches?prm.mb_batches:prm.mb_stride):0;
+    if((MB||prm.seed_rounds)&&streaming){
+        fprintf(stderr,"Mini-batch and k-means|| seeding need the dataset resident "
+                       "(%u > %llu points)\n",N,(unsigned long long)shard_n);
+        return 1;
+    }
+    if(R>1&&(MB||prm.seed_rounds)){
+        fprintf(stderr,"Restarts (-n) take random seeds and full-batch iterations "
+                       "(no -m or -k)\n");
+        return 1;
+    }
+    if(MB&&PRUNE){
+        fprintf(stderr,"Mini-batch does not combine with PRUNE "
+                       "(unsampled points would keep stale bounds)\n");
+        return 1;
+    }
+    /* hybrid: the host threads assign points [ND, N), the DPUs [0, ND) */
+    const int hybrid=prm.host_frac!=0;
+    const unsigned NT=cpu_threads(&prm);
+    if(hybrid&&(streaming||MB||prm.seed_rounds)){
+        fprintf(stderr,"Hybrid mode (-H) needs the dataset resident and full-batch "
+                       "iterations (no -m or -k)\n");
+        return 1;
+    }
+    if(prm.host_frac>=1){
+        fprintf(stderr,"-H takes a fraction below 1 or 'auto'\n");
+        return 1;
+    }
+#if LOCAL_STEPS > 1
+    if(streaming||hybrid){
+        fprintf(stderr,"LOCAL_STEPS moves the DPUs' centroids within a launch and "
+                       "needs the dataset resident on the DPUs (no streaming or -H)\n");
+        return 1;
+    }
+#endif
+    if(prm.labels_out&&(streaming||R>1)){
+        fprintf(stderr,"Labels (-o) need the dataset resident and one seed set "
+                       "(streamed shards and restarts keep no final labels)\n");
+        return 1;
+    }
+    uint32_t ND=N;
+    if(hybrid)
+        ND=hybrid_split(N,NR,prm.host_frac>0?prm.host_frac:(double)NT/(NT+NR));
+    /* the CPU reference, hybrid, seeding and serving read the quantised
+       points on the host; otherwise the ranks quantise their shares while
+       scattering, or the stream's helper thread one shard at a time, and
+       the quantised dataset is never built */
+    const int host_copy=prm.validate||hybrid||prm.seed_rounds||prm.serve_sizes;
+    double quant_ms=0;
+    if(!pts_q&&host_copy){
+        const double q0=now_ms();
+        pts_own=malloc((size_t)N*D*sizeof *pts_own);
+        if(!pts_own){perror("malloc");exit(1);}
+        quant_encode(&qz,rval,rsrc,N,pts_own);
+        pts_q=pts_own;
+        quant_ms=now_ms()-q0;
+    }
+    mem_source_t msrc={pts_q,D};
+    shard_stream_t ss;
+    scatter_stage_t sst={0};
+    if(streaming){
+#if PRUNE
+        fprintf(stderr,"PRUNE keeps per-point bounds in MRAM and needs the "
+                       "dataset resident (%u > %llu points)\n",
+                N,(unsigned long long)shard_n);
+        return 1;
+#endif
+        /* shard s+1 is read while shard s runs: from the int16 mapping,
+           else quantised from the real features */
+        const int mapped=pts_q&&!pts_own;
+        if(stream_init(&ss,mapped?mem_read:rows_read,mapped?(void *)&msrc:(void *)&rs,
+                       N,(size_t)D*sizeof(q_feature_t),shard_n)){
+            perror("malloc");exit(1);
+        }
+        printf("Streaming %u shards of up to %llu points\n",
+               ss.nshards,(unsigned long long)shard_n);
+        stream_prefetch(&ss,0);
+    }else{
+        const double c0=now_ms();
+        if(pts_q) scatter_points(dpus,NR,pts_q,ND,D,K,R,part,arg,NULL);
+        else      scatter_encode(dpus,NR,&rs,ND,D,K,R,part,arg);
+        const double c1=now_ms();
+        if(pts_own)
+            printf("Scatter:      %u points in %.2f ms, quantised on the host in %.2f ms\n",
+                   ND,c1-c0,quant_ms);
+        else
+            printf("Scatter:      %u points in %.2f ms, %s\n",ND,c1-c0,
+                   pts_q?"straight from the file mapping":"quantised per rank while scattering");
+    }
 
     clock_gettime(CLOCK_MONOTONIC,&s1);
     double setup_ms=(s1.tv_sec-s0.tv_sec)*1e3+(s1.tv_nsec-s0.tv_nsec)/1e6;
 
+    /* ---------------- k-means|| seeding (optional) ---------------- */
+    double seed_ms=0;
+    unsigned seed_cand=0, rand_iters=0;
+    if(prm.seed_rounds){
+        q_feature_t *cent_rand=malloc((size_t)K*D*sizeof *cent_rand);
+        if(!cent_rand){perror("malloc");exit(1);}
+        memcpy(cent_rand,cent_cpu,(size_t)K*D*sizeof *cent_rand);
+
+        double m0=now_ms();
+        seed_cand=kmeans_par_seed(dpus,NR,part,pts_q,N,D,K,qz.wshift,
+                                  prm.seed_rounds,cent_dpu);
+        seed_ms=now_ms()-m0;
+        memcpy(cent_cpu,cent_dpu,(size_t)K*D*sizeof *cent_cpu);
+
+        /* what the seeds save: the reference's iterations from random ones */
+        if(prm.validate)
+            rand_iters=kmeans_ref(pts_q,cent_rand,qz.wshift,N,D,K,
+                                  prm.shift_thr,prm.max_iter,cpu_threads(&prm));
+        free(cent_rand);
+    }
+
+    /* ---------------- CPU reference (optional) ---------------- */
+    struct timespec t0,t1;
+    double cpu_ms=0;
+    unsigned cpu_iters=0;
+    unsigned *cpu_it=calloc(R,sizeof *cpu_it);  /* per set */
+    double *cent_ref=NULL;              /* double-precision run, same seeds */
+    if(!cpu_it){perror("calloc");exit(1);}
+    if(prm.validate){
+        cent_ref=malloc((size_t)KT*D*sizeof *cent_ref);
+        if(!cent_ref){perror("malloc");exit(1);}
+        dequantise(&qz,cent_cpu,cent_ref,KT,D);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(unsigned r=0;r<R;++r)
+            cpu_it[r] = kmeans_ref(pts_q, &cent_cpu[(size_t)r*K*D], qz.wshift, N, D, K,
+                                   prm.shift_thr, prm.max_iter, cpu_threads(&prm));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        cpu_iters = cpu_it[0];
+
+        cpu_ms = (t1.tv_sec - t0.tv_sec)*1e3 +
+                 (t1.tv_nsec - t0.tv_nsec)/1e6;
+        for(unsigned r=0;r<R;++r){
+            char label[64];
+            if(R>1) snprintf(label, sizeof label, "CPU-%s final, set %u (%u iters)",
+                             FEAT_NAME, r, cpu_it[r]);
+            else    snprintf(label, sizeof label, "CPU-%s final (%u iters)", FEAT_NAME, cpu_iters);
+            print_centroids(label, &cent_cpu[(size_t)r*K*D], &qz, K, D);
+        }
+    }
+
+
     /* ---------------- iterative DPU K-means ---------------- */
-    const unsigned MAX_IT = cpu_iters;
-    double comp_ms=0, read_ms=0;
+    const unsigned MAX_IT = prm.max_iter;
+    uint64_t last_changed=N;
+    phase_times_t tm={0};
 
-    struct timespec run0,run1; clock_gettime(CLOCK_MONOTONIC,&run0);
     unsigned it=0;
 
-    q_feature_t *prev = malloc((size_t)K*D*sizeof *prev);
+    q_feature_t *prev = malloc((size_t)KT*D*sizeof *prev);
 
-    while(it<MAX_IT){
-        memcpy(prev,cent_dpu,(size_t)K*D*sizeof *prev);
+    /* preallocated gather/reduction buffers: one record slot per DPU,
+       one partial per rank, one running global accumulator */
+    uint32_t NRANKS; DPU_ASSERT(dpu_get_nr_ranks(dpus,&NRANKS));
+    uint32_t *rank_first=malloc(NRANKS*sizeof *rank_first);
+    {
+        struct dpu_set_t r; uint32_t ri=0,first=0;
+        DPU_RANK_FOREACH(dpus,r,ri){
+            uint32_t n; DPU_ASSERT(dpu_get_nr_dpus(r,&n));
+            rank_first[ri]=first; first+=n;
+        }
+    }
+    gather_ctx_t g = {
+        .rb         = rec_bytes(KT,D,R),
+        .rank_first = rank_first,
+        .acc        = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, KT, D },
+    };
+    g.recs     = malloc((size_t)NR*g.rb);
+    g.rank_cnt = malloc((size_t)NRANKS*KT*sizeof *g.rank_cnt);
+    g.rank_sum = malloc((size_t)NRANKS*KT*D*sizeof *g.rank_sum);
+    g.acc.cnt  = malloc(KT*sizeof *g.acc.cnt);
+    g.acc.sum  = malloc((size_t)KT*D*sizeof *g.acc.sum);
+    g.cb_start = malloc(NRANKS*sizeof *g.cb_start);
+    g.cb_end   = malloc(NRANKS*sizeof *g.cb_end);
+    g.rank_ents= calloc(NRANKS,sizeof *g.rank_ents);
+    if(!rank_first||!g.recs||!g.rank_cnt||!g.rank_sum||!g.acc.cnt||!g.acc.sum||
+       !g.cb_start||!g.cb_end||!g.rank_ents){
+        perror("malloc");exit(1);
+    }
+    const count_t *gc=g.acc.cnt;
+    const q_sum_t *gs=g.acc.sum;
+#if PRUNE
+    prune_info_t pr={0};               /* valid=0: first launch scans all */
+#endif
+#if DIST_MODE == DIST_EXPAND
+    dist_t cnorm[MAX_CLUSTERS];        /* ||c_k||^2 for the kernel */
+#endif
+    const uint32_t nshards=streaming?ss.nshards:1;
 
-        /* ship current centroids */
-        size_t cbytes=(size_t)K*D*sizeof(q_feature_t);
-        idx=0; DPU_FOREACH(dpus,d,idx){DPU_ASSERT(dpu_prepare_xfer(d,cent_dpu));}
-        DPU_ASSERT(dpu_push_xfer(dpus,DPU_XFER_TO_DPU,
-                   "c_clusters",0,cbytes,DPU_XFER_DEFAULT));
+    double  *mb_c=NULL;                /* mini-batch centroids, unrounded */
+    count_t *mb_seen=NULL;             /* points each centroid has seen   */
+    unsigned mb_it=0;
+    double   mb_ms=0;
+    if(MB){
+        mb_c=malloc((size_t)K*D*sizeof *mb_c);
+        mb_seen=calloc(K,sizeof *mb_seen);
+        if(!mb_c||!mb_seen){perror("malloc");exit(1);}
+        for(unsigned i=0;i<K*D;++i) mb_c[i]=cent_dpu[i];
+    }
 
-        /* launch */
-        struct timespec l0,l1; clock_gettime(CLOCK_MONOTONIC,&l0);
-        DPU_ASSERT(dpu_launch(dpus,DPU_SYNCHRONOUS));
-        clock_gettime(CLOCK_MONOTONIC,&l1);
-        comp_ms+=(l1.tv_sec-l0.tv_sec)*1e3+(l1.tv_nsec-l0.tv_nsec)/1e6;
+    far_set_t far;
+    far_alloc(&far,R*(NR+(hybrid?NT:0))*FAR_SLOTS,D);
+    if(!pts_q) far.rs=&rs;             /* re-seeds quantise their points */
+    unsigned reseeded=0;
 
-        /* gather partial sums */
-        q_sum_t *gs = calloc((size_t)K*D,sizeof *gs);
-        count_t *gc = calloc(K,sizeof *gc);
+    /* per set: iterations, converged flag, summed distances of the last
+       assignment (the kernel's metric) */
+    unsigned *set_it=calloc(R,sizeof *set_it);
+    uint8_t  *set_done=calloc(R,1);
+    double   *sse=calloc(R,sizeof *sse);
+    if(!set_it||!set_done||!sse){perror("calloc");exit(1);}
+    unsigned live=R;
 
-        size_t sb=(size_t)K*D*sizeof(q_sum_t);
-        size_t cb=K*sizeof(count_t);
+    /* hybrid: host labels (set 0, indexed like the dataset), transposed
+       centroids and the thread pool; the split is timed on the first
+       iteration and, with -H auto, moved once to even out both sides */
+    uint16_t    *hlab=NULL;
+    q_feature_t *ct=NULL;
+    cpu_pool_t   pool={0};
+    double host_ms=0, dpu_ms=0, meas_frac=0;
+    unsigned resplit=0;
+    if(hybrid){
+        hlab=malloc((size_t)N*sizeof *hlab);
+        ct=malloc((size_t)KT*D*sizeof *ct);
+        if(!hlab||!ct||cpu_pool_init(&pool,NT,KT,D)){perror("malloc");exit(1);}
+        for(size_t i=0;i<N;++i) hlab[i]=LABEL_NONE;
+    }
 
-        DPU_FOREACH(dpus,d,idx){
-            q_sum_t *ls = calloc((size_t)K*D,sizeof *ls);
-            count_t *lc = calloc(K,sizeof *lc);
+    /* per-iteration timings, one entry per pass of the loop */
+    iter_times_t *itt=calloc(MB+MAX_IT+1,sizeof *itt);
+    if(!itt){perror("calloc");exit(1);}
+    unsigned nit=0;
 
-            struct timespec r0,r1; clock_gettime(CLOCK_MONOTONIC,&r0);
-            DPU_ASSERT(dpu_prepare_xfer(d,ls));
-            DPU_ASSERT(dpu_push_xfer(d,DPU_XFER_FROM_DPU,
-                       "centers_sum_mram",0,sb,DPU_XFER_DEFAULT));
-            DPU_ASSERT(dpu_prepare_xfer(d,lc));
-            DPU_ASSERT(dpu_push_xfer(d,DPU_XFER_FROM_DPU,
-                       "centers_count_mram",0,cb,DPU_XFER_DEFAULT));
-            clock_gettime(CLOCK_MONOTONIC,&r1);
-            read_ms+=(r1.tv_sec-r0.tv_sec)*1e3+(r1.tv_nsec-r0.tv_nsec)/1e6;
+    /* -w warm-up and -r timed runs of the whole loop, each from the same
+       seeds, fresh labels and the initial hybrid split; the report is of
+       the last run */
+    const uint32_t ND0=ND;
+    const unsigned NREP=prm.n_warmup+(prm.n_reps?prm.n_reps:1);
+    q_feature_t *seeds=malloc((size_t)KT*D*sizeof *seeds);
+    double *run_ms=malloc(NREP*sizeof *run_ms);
+    if(!seeds||!run_ms){perror("malloc");exit(1);}
+    memcpy(seeds,cent_dpu,(size_t)KT*D*sizeof *seeds);
+    double dpu_scans=0;                /* points the DPUs assigned, all runs */
+    for(unsigned rep=0;rep<NREP;++rep){
+        if(rep){
+            memcpy(cent_dpu,seeds,(size_t)KT*D*sizeof *cent_dpu);
+            if(ND!=ND0){
+                /* undo the last run's -H auto re-split */
+                ND=ND0;
+                scatter_points(dpus,NR,pts_q,ND,D,K,R,part,arg,NULL);
+            }
+            if(!streaming) clear_labels(dpus,part[0].n);
+            it=mb_it=nit=reseeded=0; live=R;
+            mb_ms=0; last_changed=N;
+            tm=(phase_times_t){0};
+            atomic_store(&g.pruned,0);
+            atomic_store(&g.fetched,0); atomic_store(&g.fetched_recs,0);
+            memset(set_it,0,R*sizeof *set_it);
+            memset(set_done,0,R);
+            memset(itt,0,(MB+MAX_IT+1)*sizeof *itt);
+#if PRUNE
+            pr=(prune_info_t){0};
+#endif
+            if(MB){
+                for(unsigned i=0;i<K*D;++i) mb_c[i]=cent_dpu[i];
+                memset(mb_seen,0,K*sizeof *mb_seen);
+            }
+            if(hybrid){
+                host_ms=dpu_ms=meas_frac=0; resplit=0;
+                for(size_t i=0;i<N;++i) hlab[i]=LABEL_NONE;
+            }
+        }
+        const double run0=now_ms();
 
-            for(unsigned k=0;k<K;++k){
-                gc[k]+=lc[k];
-                for(unsigned f=0;f<D;++f)
-                    gs[k*D+f]+=ls[k*D+f];
+        while(mb_it<MB || it<MAX_IT){
+            const int mini=mb_it<MB;
+            const double l0=now_ms();
+            iter_times_t *ti=&itt[nit++];
+            ti->mini=mini;
+            if(mini||(MB&&it==0)||(LOCAL_STEPS>1&&nit==1)){
+                /* this launch's sample (a random phase of the stride), or every
+                   point again once the mini-batches are done; full launches
+                   run LOCAL_STEPS Lloyd steps */
+                const uint32_t off=mini?(uint32_t)(rand()%prm.mb_stride):0;
+                for(uint32_t i=0;i<NR;++i){
+                    arg[i].mb_offset=off;
+                    arg[i].mb_stride=mini?prm.mb_stride:1;
+                    arg[i].steps=mini?1:LOCAL_STEPS;
+                }
+                push_args(dpus,arg);
+                ti->bcast_ms+=now_ms()-l0;
+            }
+            g.steps=mini?1:LOCAL_STEPS;
+            memcpy(prev,cent_dpu,(size_t)KT*D*sizeof *prev);
+            acc_reset(&g.acc);
+            far_reset(&far);
+            for(unsigned r=0;r<R;++r) sse[r]=0;
+            atomic_store(&g.changed,0);
+
+            /* one launch per shard; sums of all shards meet in g.acc */
+            for(uint32_t sh=0;sh<nshards;++sh){
+                const q_feature_t *cur=pts_q;
+                if(streaming){
+                    double w0=now_ms();
+                    cur=stream_wait(&ss);
+                    double w1=now_ms();
+                    stream_prefetch(&ss,(sh+1)%nshards);
+                    scatter_points(dpus,NR,cur,shard_len(&ss,sh),D,K,R,part,arg,&sst);
+                    tm.wait_ms+=w1-w0;
+                    ti->scatter_ms+=now_ms()-w1;
+                    tm.scatter_ms+=now_ms()-w1;
+                }
+
+                /* ship current centroids */
+                const double b0=now_ms();
+                if(sh==0)
+                    DPU_ASSERT(dpu_broadcast_to(dpus,"c_clusters",0,cent_dpu,
+                               align8((size_t)KT*D*sizeof(q_feature_t)),DPU_XFER_DEFAULT));
+#if DIST_MODE == DIST_EXPAND
+                if(sh==0){
+                    static const q_feature_t zero[MAX_FEATURES];
+                    for(unsigned k=0;k<KT;++k)
+                        cnorm[k]=quant_dist2(&cent_dpu[k*D],zero,qz.wshift,D);
+                    DPU_ASSERT(dpu_broadcast_to(dpus,"c_norms",0,cnorm,
+                               KT*sizeof *cnorm,DPU_XFER_DEFAULT));
+                }
+#endif
+#if PRUNE
+                DPU_ASSERT(dpu_broadcast_to(dpus,"c_prune",0,&pr,
+                           sizeof pr,DPU_XFER_DEFAULT));
+#endif
+                ti->bcast_ms+=now_ms()-b0;
+                double h0=0;
+                if(hybrid){
+                    cpu_transpose(cent_dpu,ct,KT,D);
+                    cpu_pool_bind(&pool,&pts_q[(size_t)ND*D],N-ND,ND,ct,qz.wshift,
+                                  D,K,R,&hlab[ND],NULL,&g.acc);
+                    h0=now_ms();
+                    cpu_start(&pool);
+                }
+                const double d0=now_ms(), c0=tm.comp_ms, r0=tm.read_ms;
+                launch_and_gather(dpus,&g,NRANKS,&tm);
+                const double d1=now_ms();
+                ti->launch_ms+=tm.comp_ms-c0;
+                ti->gather_ms+=tm.read_ms-r0;
+                far_collect(&far,g.recs,g.rb,NR,KT,D,R,part,cur,
+                            streaming?shard_first(&ss,sh):0);
+                for(uint32_t j=0;j<NR;++j){
+                    const dist_t *ds=(const dist_t *)(g.recs+(size_t)j*g.rb+rec_sse_off(KT,D,R));
+                    for(unsigned r=0;r<R;++r) sse[r]+=(double)ds[r];
+                }
+                ti->merge_ms+=now_ms()-d1;
+                if(hybrid){
+                    cpu_wait(&pool);
+                    double h1=h0;
+                    for(uint32_t t=0;t<pool.nt;++t){
+                        const cpu_part_t *w=&pool.part[t];
+                        if(w->end_ms>h1) h1=w->end_ms;
+                        for(unsigned r=0;r<R;++r) sse[r]+=(double)w->sse[r];
+                        atomic_fetch_add(&g.changed,w->changed);
+                    }
+                    far_collect_cpu(&far,&pool,NR,D,R,pts_q);
+                    host_ms+=h1-h0; dpu_ms+=d1-d0;
+                    if(it==0){
+                        /* points per ms of either side on the first iteration */
+                        const double rc=(N-ND)/fmax(h1-h0,1e-3), rd=ND/fmax(d1-d0,1e-3);
+                        meas_frac=rc/(rc+rd);
+                    }
+                }
+            }
+
+            const double u0=now_ms();
+            if(mini){
+                minibatch_update(mb_c,mb_seen,gc,gs,cent_dpu,K,D);
+                ti->merge_ms+=now_ms()-u0;
+                ti->changed=atomic_load(&g.changed);
+                mb_it++;
+                mb_ms+=now_ms()-l0;
+                continue;
+            }
+
+            /* per set: empty clusters restart at the farthest points, the
+               others move to their mean — **pure integer mean**; converged sets
+               keep their centroids */
+            last_changed=atomic_load(&g.changed);
+            for(unsigned r=0;r<R;++r){
+                if(set_done[r]) continue;
+                const far_set_t fr=far_view(&far,r,R,D);
+                q_feature_t *c=&cent_dpu[(size_t)r*K*D];
+                const q_feature_t *pc=&prev[(size_t)r*K*D];
+                const count_t *sc=&gc[r*K];
+                const q_sum_t *sm=&gs[(size_t)r*K*D];
+                reseeded+=far_reseed(&fr,sc,c,K,D);
+                for(unsigned k=0;k<K;++k)
+                    if(sc[k])
+                        for(unsigned f=0;f<D;++f)
+                            c[k*D+f]=quant_mean(sm[k*D+f],sc[k]);
+                set_it[r]++;
+
+                /* convergence: few enough label changes (of set 0, so with one
+                   set only), or centroids stopped; streamed shards reload their
+                   labels, so only the shift counts */
+                double shift=0.0;
+                for(unsigned i=0;i<K*D;++i){
+                    double diff=(double)c[i]-(double)pc[i];
+                    shift+=diff*diff;
+                }
+                shift=sqrt(shift);
+                if((R==1 && !streaming && (double)last_changed<=prm.changed_frac*N) ||
+                   shift<=prm.shift_thr){
+                    set_done[r]=1; live--;
+                }
+            }
+#if PRUNE
+            prune_update(&pr,prev,cent_dpu,qz.wshift,K,D);
+#endif
+            ti->merge_ms+=now_ms()-u0;
+            ti->changed=last_changed;
+            it++;
+            if(!live) break;
+
+            /* -H auto: move the split to the measured rates, once, if it moves
+               by more than 1% of the points; both sides restart their labels */
+            if(hybrid&&it==1&&prm.host_frac<0){
+                const uint32_t nd=hybrid_split(N,NR,meas_frac);
+                if((nd>ND?nd-ND:ND-nd)>N/100){
+                    ND=nd; resplit=1;
+                    scatter_points(dpus,NR,pts_q,ND,D,K,R,part,arg,NULL);
+                    for(size_t i=0;i<N;++i) hlab[i]=LABEL_NONE;
+#if PRUNE
+                    pr.valid=0;
+#endif
+                }
             }
-            free(ls); free(lc);
         }
+        run_ms[rep]=now_ms()-run0;
+        for(unsigned i=0;i<nit;++i)
+            dpu_scans+=itt[i].mini?(double)ND/prm.mb_stride:(double)ND*LOCAL_STEPS;
+    }
+    const double total_ms=run_ms[NREP-1];   /* before sorting */
+    if(streaming) stream_free(&ss);
+    stage_free(&sst);
 
-        /* host update — **pure integer mean** */
-        for(unsigned k=0;k<K;++k)
-            if(gc[k])
-                for(unsigned f=0;f<D;++f)
-                    cent_dpu[k*D+f]=(q_feature_t)(gs[k*D+f]/(int32_t)gc[k]);
-        
-        free(gs); 
-        free(gc);
-        it++; 
+    /* labels of the last assignment: the DPUs' points, then the host's */
+    double lab_ms=0;
+    const size_t lw=K<=256?sizeof(uint8_t):sizeof(uint16_t);
+    if(prm.labels_out){
+        label_file_t lf;
+        if(label_create(prm.labels_out,N,lw,&lf)) return 1;
+        const double o0=now_ms();
+        if(nit&&(itt[nit-1].mini||LOCAL_STEPS>1)){
+            /* mini-batch launches label their sample only, and local steps
+               label against the DPU's own centroids: one full assignment
+               against the final centroids labels every point */
+            for(uint32_t i=0;i<NR;++i){ arg[i].mb_offset=0; arg[i].mb_stride=1; arg[i].steps=1; }
+            push_args(dpus,arg);
+            DPU_ASSERT(dpu_broadcast_to(dpus,"c_clusters",0,cent_dpu,
+                       align8((size_t)K*D*sizeof(q_feature_t)),DPU_XFER_DEFAULT));
+#if DIST_MODE == DIST_EXPAND
+            static const q_feature_t zero[MAX_FEATURES];
+            for(unsigned k=0;k<K;++k) cnorm[k]=quant_dist2(&cent_dpu[k*D],zero,qz.wshift,D);
+            DPU_ASSERT(dpu_broadcast_to(dpus,"c_norms",0,cnorm,
+                       K*sizeof *cnorm,DPU_XFER_DEFAULT));
+#endif
+            DPU_ASSERT(dpu_launch(dpus,DPU_SYNCHRONOUS));
+        }
+        read_labels(dpus,NR,part,lf.map,lw,NULL);
+        for(size_t i=ND;i<N;++i){
+            if(lw==sizeof(uint16_t)) ((uint16_t *)lf.map)[i]=hlab[i];
+            else ((uint8_t *)lf.map)[i]=(uint8_t)hlab[i];
+        }
+        lab_ms=now_ms()-o0;
+        label_close(&lf);
+    }
+
+    /* tasklet balance: busy cycles of every tasklet, summed over launches */
+    uint64_t *busy=malloc((size_t)NR*NR_TASKLETS*sizeof *busy);
+    if(!busy){perror("malloc");exit(1);}
+    {
+        struct dpu_set_t d; uint32_t i;
+        DPU_FOREACH(dpus,d,i){
+            DPU_ASSERT(dpu_prepare_xfer(d,&busy[(size_t)i*NR_TASKLETS]));
+        }
+        DPU_ASSERT(dpu_push_xfer(dpus,DPU_XFER_FROM_DPU,"busy_cycles",0,
+                   NR_TASKLETS*sizeof *busy,DPU_XFER_DEFAULT));
+    }
+    /* per DPU: slowest tasklet over the mean one, and the share of tasklet
+       time spent waiting for the slowest at the barrier */
+    double imb_sum=0.0, imb_worst=0.0, idle=0.0, span=0.0;
+    for(uint32_t i=0;i<NR;++i){
+        uint64_t mx=0, tot=0;
+        for(uint32_t t=0;t<NR_TASKLETS;++t){
+            uint64_t b=busy[(size_t)i*NR_TASKLETS+t];
+            tot+=b; if(b>mx) mx=b;
+        }
+        double imb=tot?(double)mx*NR_TASKLETS/tot:1.0;
+        imb_sum+=imb; if(imb>imb_worst) imb_worst=imb;
+        idle+=(double)mx*NR_TASKLETS-tot; span+=(double)mx*NR_TASKLETS;
     }
-    clock_gettime(CLOCK_MONOTONIC,&run1);
-    double total_ms=(run1.tv_sec-run0.tv_sec)*1e3+(run1.tv_nsec-run0.tv_nsec)/1e6;
+    uint64_t busy_all=0;
+    for(size_t i=0;i<(size_t)NR*NR_TASKLETS;++i) busy_all+=busy[i];
+
+    /* iteration phases of the last run, and with STATS=1 the DPUs' cycles
+       by phase summed over every tasklet and run */
+    double ph[5]={0}, run_pts=0;
+    for(unsigned i=0;i<nit;++i){
+        ph[0]+=itt[i].bcast_ms; ph[1]+=itt[i].launch_ms; ph[2]+=itt[i].gather_ms;
+        ph[3]+=itt[i].merge_ms; ph[4]+=itt[i].scatter_ms;
+        run_pts+=itt[i].mini?(double)N/prm.mb_stride:(double)N*LOCAL_STEPS;
+    }
+    /* the timed runs, sorted; points/s from the points assigned per run */
+    const unsigned ntimed=NREP-prm.n_warmup;
+    double *run_sorted=&run_ms[prm.n_warmup];
+    qsort(run_sorted,ntimed,sizeof *run_sorted,dbl_cmp);
+    const double run_med=ntimed%2?run_sorted[ntimed/2]
+                                 :(run_sorted[ntimed/2-1]+run_sorted[ntimed/2])/2;
+    const phase_stats_t *ps=NULL;
+#if STATS
+    phase_stats_t ps_all={0};
+    {
+        phase_stats_t *st=malloc((size_t)NR*NR_TASKLETS*sizeof *st);
+        if(!st){perror("malloc");exit(1);}
+        pull_all(dpus,"phase_stats",st,NR_TASKLETS*sizeof *st);
+        for(size_t i=0;i<(size_t)NR*NR_TASKLETS;++i){
+            ps_all.dma+=st[i].dma; ps_all.dist+=st[i].dist; ps_all.acc+=st[i].acc;
+            ps_all.reduce+=st[i].reduce; ps_all.dma_bytes+=st[i].dma_bytes;
+        }
+        free(st);
+        ps=&ps_all;
+    }
+#endif
 
     /* ---------------- report ---------------- */
-    print_centroids("\nDPU final",cent_dpu,K,D);
+    /* restarts: the set with the least inertia in its last assignment */
+    unsigned best=0;
+    for(unsigned r=1;r<R;++r) if(sse[r]<sse[best]) best=r;
+    const q_feature_t *cent_best=&cent_dpu[(size_t)best*K*D];
+    char dlabel[96];
+    if(R>1)
+        snprintf(dlabel, sizeof dlabel, "\nDPU final, set %u of %u (%u iters)", best, R, set_it[best]);
+    else if(streaming)
+        snprintf(dlabel, sizeof dlabel, "\nDPU final (%u iters)", it);
+    else
+        snprintf(dlabel, sizeof dlabel, "\nDPU final (%u iters, %llu labels changed in the last)",
+                 it, (unsigned long long)last_changed);
+    print_centroids(dlabel,cent_best,&qz,K,D);
+    if(LOCAL_STEPS>1)
+        printf("Local steps:  %d Lloyd steps per launch, %u launches\n",LOCAL_STEPS,it);
+    if(prm.validate){
+        /* every set against the reference from its seeds */
+        int same=1;
+        for(unsigned r=0;r<R;++r) if(cpu_it[r]!=(R>1?set_it[r]:it)) same=0;
+#if FEATURE_FLOAT
+        /* the DPUs sum in a different order: allow for the rounding */
+        for(unsigned i=0;i<KT*D;++i)
+            if(fabs(cent_cpu[i]-cent_dpu[i])>1e-9*(1.0+fabs(cent_cpu[i]))) same=0;
+#else
+        if(memcmp(cent_cpu,cent_dpu,(size_t)KT*D*sizeof *cent_cpu)) same=0;
+#endif
+        if(MB)
+            printf("\nValidation: skipped, the mini-batch start differs from the "
+                   "reference (compare the inertia)\n");
+        else if(LOCAL_STEPS>1)
+            printf("\nValidation: skipped, LOCAL_STEPS=%d moves each DPU's centroids "
+                   "between merges (compare the inertia)\n",LOCAL_STEPS);
+        else
+            printf("\nValidation: DPU %s CPU reference\n",same?"matches":"DIFFERS FROM");
+
+        /* quantisation error: de-quantised DPU centroids against a double
+           run from the same seeds */
+        double *ref_best=&cent_ref[(size_t)best*K*D];
+        unsigned ref_iters=kmeans_double(rval,rsrc,ref_best,N,D,K,prm.max_iter);
+        double *cent_real=malloc((size_t)K*D*sizeof *cent_real);
+        if(!cent_real){perror("malloc");exit(1);}
+        dequantise(&qz,cent_best,cent_real,K,D);
+        double err=0.0, step=0.0;
+        for(unsigned k=0;k<K;++k)
+            for(unsigned f=0;f<D;++f){
+                double e=fabs(cent_real[k*D+f]-ref_best[k*D+f]);
+                if(e>err){err=e; step=e/qz.scale[f];}
+            }
+        double sse_q=inertia(rval,rsrc,cent_real,N,D,K);
+        double sse_d=inertia(rval,rsrc,ref_best,N,D,K);
+        printf("Quantisation: %s | vs double (%u iters): centroid error max %.4g (%.1f steps)"
+               "  inertia %.6g vs %.6g (%+.3f%%)\n",
+               FEAT_NAME,ref_iters,err,step,sse_q,sse_d,
+               sse_d>0?100.0*(sse_q-sse_d)/sse_d:0.0);
+        free(cent_real);
+    }
     printf("\nTiming (ms):  CPU %6.2f | DPU setup %6.2f  compute %6.2f  read %6.2f  total %6.2f\n",
-           cpu_ms,setup_ms,comp_ms,read_ms,total_ms);
+           cpu_ms,setup_ms,tm.comp_ms,tm.read_ms,total_ms);
+    /* overlap: share of the per-rank merge work hidden behind DPU compute */
+    printf("Merge (ms):   rank work %6.2f  overlapped %6.2f  overlap %5.1f%%\n",
+           tm.merge_ms,tm.hidden_ms,tm.merge_ms>0?100.0*tm.hidden_ms/tm.merge_ms:0.0);
+    printf("Phases (ms):  broadcast %6.2f  scatter %6.2f  launch %6.2f  gather %6.2f"
+           "  merge %6.2f  (%u passes)\n",ph[0],ph[4],ph[1],ph[2],ph[3],nit);
+    printf("Runs:         %u warm-up + %u timed, loop min %.2f  median %.2f ms; "
+           "%.4g points/s, setup %.1f%% of setup + loop\n",
+           prm.n_warmup,NREP-prm.n_warmup,run_sorted[0],run_med,
+           run_med>0?run_pts/run_med*1e3:0.0,100.0*setup_ms/(setup_ms+run_med));
+    if(ps){
+        const double cyc=(double)(ps->dma+ps->dist+ps->acc+ps->reduce);
+        printf("DPU phases:   DMA %5.1f%%  distance %5.1f%%  accumulate %5.1f%%  "
+               "reduce %5.1f%% of %.4g tasklet cycles; %.1f DMA bytes/point\n",
+               cyc>0?100.0*ps->dma/cyc:0.0,cyc>0?100.0*ps->dist/cyc:0.0,
+               cyc>0?100.0*ps->acc/cyc:0.0,cyc>0?100.0*ps->reduce/cyc:0.0,cyc,
+               dpu_scans>0?ps->dma_bytes/dpu_scans:0.0);
+    }
+    if(g.fetched_recs)
+        printf("Records:      %.0f of %zu bytes fetched per DPU and launch (%s)\n",
+               (double)g.fetched/g.fetched_recs,g.rb,SPARSE?"sparse":"dense");
+    if(prm.seed_rounds){
+        printf("Seeding:      k-means|| %u rounds, %u candidates in %.2f ms, "
+               "then %u Lloyd iterations",prm.seed_rounds,seed_cand,seed_ms,it);
+        if(prm.validate)
+            printf(" (CPU reference: %u from these seeds, %u from random points)",
+                   cpu_iters,rand_iters);
+        printf("\n");
+    }
+    if(R>1){
+        printf("Restarts:     %u seed sets in one pass, best %u; inertia of the last "
+               "assignment (kernel metric):",R,best);
+        for(unsigned r=0;r<R;++r) printf(" %.6g (%u iters)",sse[r],set_it[r]);
+        printf("\n");
+    }
+    if(hybrid)
+        printf("Hybrid:       host %u points (%.1f%%) on %u threads%s, %.2f ms/iter | "
+               "DPUs %u points %.2f ms/iter; measured host share %.1f%%\n",
+               N-ND,100.0*(N-ND)/N,pool.nt,resplit?" after re-split":"",
+               it?host_ms/it:0.0,ND,it?dpu_ms/it:0.0,100.0*meas_frac);
+    if(prm.labels_out)
+        printf("Labels:       %u x uint%u of the last assignment to %s in %.2f ms\n",
+               N,(unsigned)lw*8,prm.labels_out,lab_ms);
+    if(reseeded)
+        printf("Empty:        %u clusters re-seeded at the farthest points\n",reseeded);
+    if(MB)
+        printf("Mini-batch:   %u launches of 1/%u of the points in %.2f ms, "
+               "then %u full-batch iterations\n",MB,prm.mb_stride,mb_ms,it);
+    if(streaming)
+        printf("Stream (ms):  scatter %6.2f  read stall %6.2f  (%u shards x %u iters)\n",
+               tm.scatter_ms,tm.wait_ms,nshards,it);
+    printf("Tasklets:     %s schedule, busy max/mean %.3f (worst DPU %.3f), "
+           "%.1f%% idle at the barrier\n",
+           DYNAMIC?"dynamic":"static",imb_sum/NR,imb_worst,span>0?100.0*idle/span:0.0);
+#if PRUNE
+    const double scans=(double)N*it;
+    printf("Pruning:      %llu of %.0f point scans skipped (%5.1f%%)\n",
+           (unsigned long long)g.pruned,scans,scans>0?100.0*g.pruned/scans:0.0);
+#endif
+
+    int rc=0;
+    if(prm.stats_out){
+        const run_report_t rp={ kernel, N, D, K, R, NR, cpu_ms, setup_ms, total_ms,
+                                itt, nit, run_sorted, ntimed, busy_all, ps, dpu_scans };
+        if(write_report(prm.stats_out,&rp)) rc=1;
+        else printf("Report:       %u passes to %s\n",nit,prm.stats_out);
+    }
 
     /* ---------------- cleanup -------------- */
     DPU_ASSERT(dpu_free(dpus));
-    free(pts_fp); free(pts_q);
-    free(cent_cpu); free(cent_dpu); free(prev);
-    free(part); free(arg);
-    return 0;
+    if(prm.serve_sizes&&!rc) rc=run_serve(prm.serve_sizes,&prm,&qz,cent_best,pts_q,N,D,K);
+    free(pts_fp); free(pts_own);
+    if(data_file) kmb_close(&kf);
+    free(cent_cpu); free(cent_dpu); free(prev); free(cent_ref);
+    free(part); free(arg); free(busy); free(itt); free(seeds); free(run_ms); free(mb_c); free(mb_seen);
+    far_free(&far);
+    free(cpu_it); free(set_it); free(set_done); free(sse);
+    free(hlab); free(ct);
+    if(hybrid) cpu_pool_free(&pool);
+    free(rank_first); free(g.recs); free(g.rank_cnt); free(g.rank_sum);
+    free(g.acc.cnt); free(g.acc.sum); free(g.cb_start); free(g.cb_end);
+    free(g.rank_ents);
+    return rc;
 }
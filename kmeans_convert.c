@@ -0,0 +1,106 @@
+/* kmeans_convert.c — text dataset → binary dataset (format in dataset.h)
+ *
+ * Input:  first line "points features clusters", then one point per line.
+ * Output: int16 rows when every value is an integer in int16 range,
+ *         float32 rows otherwise.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "dataset.h"
+
+/* whole file in memory, NUL-terminated */
+static char *slurp(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) { perror(path); exit(1); }
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = malloc((size_t)n + 1);
+    if (!buf) { perror("malloc"); exit(1); }
+    if (fread(buf, 1, (size_t)n, fp) != (size_t)n) { perror(path); exit(1); }
+    buf[n] = '\0';
+    fclose(fp);
+    *len = (size_t)n;
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <input.txt> <output.kmb>\n", argv[0]);
+        return 1;
+    }
+    size_t len;
+    char *txt = slurp(argv[1], &len), *p = txt, *end;
+
+    unsigned long long N = strtoull(p, &end, 10); p = end;
+    unsigned long D = strtoul(p, &end, 10);       p = end;
+    unsigned long K = strtoul(p, &end, 10);
+    if (end == p || !N || !D) {
+        fprintf(stderr, "%s: bad header, expected \"points features clusters\"\n", argv[1]);
+        return 1;
+    }
+    p = end;
+
+    float *val = malloc((size_t)N * D * sizeof *val);
+    if (!val) { perror("malloc"); return 1; }
+    int integral = 1;
+    size_t i;
+    for (i = 0; i < (size_t)N * D; ++i) {
+        double v = strtod(p, &end);
+        if (end == p) break;
+        p = end;
+        val[i] = (float)v;
+        if (v != floor(v) || v < INT16_MIN || v > INT16_MAX) integral = 0;
+    }
+    if (i != (size_t)N * D) {
+        fprintf(stderr, "%s: header promises %llu x %lu values, found %zu\n",
+                argv[1], N, D, i);
+        return 1;
+    }
+
+    kmb_header_t h = {0};
+    memcpy(h.magic, KMB_MAGIC, 8);
+    h.version     = KMB_VERSION;
+    h.dtype       = integral ? KMB_INT16 : KMB_FLOAT32;
+    h.n_points    = N;
+    h.n_features  = (uint32_t)D;
+    h.n_clusters  = (uint32_t)K;
+    h.scale       = 1.0;
+    h.offset      = 0.0;
+    h.data_offset = KMB_ALIGN;
+
+    FILE *out = fopen(argv[2], "wb");
+    if (!out) { perror(argv[2]); return 1; }
+    struct stat st;             /* only a regular file is removed on error */
+    const int regular = fstat(fileno(out), &st) == 0 && S_ISREG(st.st_mode);
+    static const char zero[KMB_ALIGN];
+    int ok = fwrite(&h, sizeof h, 1, out) == 1 &&
+             fwrite(zero, 1, KMB_ALIGN - sizeof h, out) == KMB_ALIGN - sizeof h;
+    if (integral) {
+        int16_t row[4096];
+        for (size_t at = 0; ok && at < (size_t)N * D; ) {
+            size_t n = (size_t)N * D - at < 4096 ? (size_t)N * D - at : 4096;
+            for (size_t j = 0; j < n; ++j) row[j] = (int16_t)val[at + j];
+            ok = fwrite(row, sizeof *row, n, out) == n;
+            at += n;
+        }
+    } else if (ok) {
+        ok = fwrite(val, sizeof *val, (size_t)N * D, out) == (size_t)N * D;
+    }
+    /* a short write or a failed flush leaves a truncated file: remove it */
+    if (!ok) perror(argv[2]);
+    if (fclose(out) != 0) { if (ok) perror(argv[2]); ok = 0; }
+    if (!ok) { if (regular) unlink(argv[2]); return 1; }
+
+    printf("%s: %llu points, %lu features, %lu clusters, %s\n", argv[2], N, D, K,
+           integral ? "int16" : "float32");
+    free(val); free(txt);
+    return 0;
+}
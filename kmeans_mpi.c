@@ -0,0 +1,387 @@
+/* kmeans_mpi.c — k-means over several nodes, each driving its own DPUs
+ *
+ *   mpirun -np <nodes> ./bin/kmeans_mpi [options] [data.kmb]
+ *
+ * One MPI process per node. Each takes a contiguous shard of the points,
+ * quantises and scatters it to its DPUs rank by rank (pim_host.h) and runs
+ * the kernel of kmeans_host on it. Every iteration the nodes' counts and
+ * sums, changed labels and inertia are combined with one MPI_Allreduce;
+ * node 0 then broadcasts the centroids and the stop decision, so every node
+ * starts the next launch from the same state. The quantisation is fitted on
+ * the merged statistics of all shards and the seeds are drawn over the whole
+ * dataset, so a run does not depend on the number of nodes.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <mpi.h>
+#include <dpu.h>
+
+#include "common.h"
+#include "dataset.h"
+#include "pim_host.h"
+#include "quant.h"
+#include "reduce.h"
+
+/* MPI types of the kernel's features and of the global sums */
+#if FEATURE_FLOAT
+# define MPI_FEAT MPI_DOUBLE
+# define MPI_QSUM MPI_DOUBLE
+#else
+# if FEATURE_BITS == 8
+#  define MPI_FEAT MPI_INT8_T
+# elif FEATURE_BITS == 16
+#  define MPI_FEAT MPI_INT16_T
+# else
+#  define MPI_FEAT MPI_INT32_T
+# endif
+# define MPI_QSUM MPI_INT64_T
+#endif
+
+#define MAX_NUMBER 99          /* synthetic data range 0…98, as kmeans_host */
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "\nUsage:  mpirun -np <nodes> %s [options] [data_file.kmb]"
+        "\n"
+        "\n    -h            help"
+        "\n    -p <NPOINTS>  points over all nodes, without a data file (default=1024)"
+        "\n    -f <NFEAT>    number of features (default=2)"
+        "\n    -c <NCLUST>   number of clusters (default=5)"
+        "\n    -i <IT>       max. k-means iterations (default=300)"
+        "\n    -t <FRAC>     stop when at most FRAC of the points change cluster (default=0)"
+        "\n    -s <SHIFT>    stop when the centroid shift is at most SHIFT (default=0.0001)"
+        "\n    -q <MODE>     quantisation range: 'range' (default) or 'std'"
+        "\n    -x <SEED>     seed of the synthetic data and of the K seed points (default=1)"
+        "\n\nEvery node maps the data file (shared file system) and reads only its shard."
+        "\n\n", prog);
+}
+
+/* a node's shard: rows first.. of the dataset */
+typedef struct {
+    const kmb_file_t *kf;      /* NULL: synthetic, in val                  */
+    const double     *val;
+    uint64_t          first;
+    unsigned          D;
+} shard_t;
+
+static double shard_value(const void *src, size_t i)
+{
+    const shard_t *s=src;
+    return s->kf?kmb_value(s->kf,s->first*s->D+i):s->val[i];
+}
+
+/* synthetic value i of the whole dataset, the same on every node */
+static double synth_value(uint64_t seed, uint64_t i)
+{
+    uint64_t z=(i+1)*0x9E3779B97F4A7C15ULL^seed;
+    z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+    z=(z^(z>>27))*0x94D049BB133111EBULL;
+    return (double)((z^(z>>31))%MAX_NUMBER);
+}
+
+/* one far-point candidate shared between nodes: distance, dataset index
+   and coordinates (D features follow) */
+typedef struct { dist_t d; uint64_t gi; } far_share_t;
+
+/* restart the empty clusters at the farthest points of all nodes: every
+   node sends its K farthest candidates, quantised from its shard, and
+   every node ranks the same union (far_reseed) */
+static unsigned far_reseed_all(far_set_t *far, far_set_t *all, uint8_t *mine, uint8_t *every,
+                               const count_t *cnt, q_feature_t *c, unsigned K, unsigned D,
+                               uint64_t first, int nodes)
+{
+    const size_t eb=sizeof(far_share_t)+(size_t)D*sizeof(q_feature_t);
+    uint32_t n=0;
+    for(uint32_t i=0;i<far->n;++i)
+        if(far->d[i]>0) far->rk[n++]=(far_rank_t){far->d[i],far->gi[i],i};
+    qsort(far->rk,n,sizeof *far->rk,far_cmp);
+    for(unsigned k=0;k<K;++k){
+        far_share_t *e=(far_share_t *)(mine+k*eb);
+        e->d=-1; e->gi=0;
+        if(k>=n) continue;
+        *e=(far_share_t){far->rk[k].d,far->rk[k].gi};
+        quant_encode_rows(far->rs->qz,far->rs->val,far->rs->src,far->rk[k].gi-first,1,
+                          (q_feature_t *)(e+1));
+    }
+    MPI_Allgather(mine,(int)(K*eb),MPI_BYTE,every,(int)(K*eb),MPI_BYTE,MPI_COMM_WORLD);
+    for(uint32_t i=0;i<(uint32_t)nodes*K;++i){
+        const far_share_t *e=(const far_share_t *)(every+i*eb);
+        all->d[i]=e->d; all->gi[i]=e->gi;
+        memcpy(&all->pt[(size_t)i*D],e+1,D*sizeof(q_feature_t));
+    }
+    return far_reseed(all,cnt,c,K,D);
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc,&argv);
+    int node, nodes;
+    MPI_Comm_rank(MPI_COMM_WORLD,&node);
+    MPI_Comm_size(MPI_COMM_WORLD,&nodes);
+
+    uint64_t N=1024, seed=1;
+    unsigned D=2, K=5, max_iter=300;
+    double changed_frac=0.0, thr=0.0001;
+    int quant_mode=QUANT_RANGE, opt;
+    while((opt=getopt(argc,argv,"hp:f:c:i:t:s:q:x:"))>=0){
+        switch(opt){
+            case 'h': if(!node) usage(argv[0]); MPI_Finalize(); return 0;
+            case 'p': N=strtoull(optarg,NULL,10); break;
+            case 'f': D=(unsigned)atoi(optarg); break;
+            case 'c': K=(unsigned)atoi(optarg); break;
+            case 'i': max_iter=(unsigned)atoi(optarg); break;
+            case 't': changed_frac=atof(optarg); break;
+            case 's': thr=atof(optarg); break;
+            case 'x': seed=strtoull(optarg,NULL,10); break;
+            case 'q':
+                if(!strcmp(optarg,"range")) quant_mode=QUANT_RANGE;
+                else if(!strcmp(optarg,"std")) quant_mode=QUANT_STD;
+                else{ if(!node) fprintf(stderr,"-q takes 'range' or 'std'\n"); MPI_Abort(MPI_COMM_WORLD,1); }
+                break;
+            default: if(!node) usage(argv[0]); MPI_Abort(MPI_COMM_WORLD,1);
+        }
+    }
+
+    /* the shard: rows [first, first+n) */
+    kmb_file_t kf;
+    shard_t sh={0};
+    if(optind<argc){
+        if(kmb_open(argv[optind],&kf)) MPI_Abort(MPI_COMM_WORLD,1);
+        N=kf.hdr.n_points; D=kf.hdr.n_features;
+        if(kf.hdr.n_clusters) K=kf.hdr.n_clusters;
+        sh.kf=&kf;
+    }
+    sh.D=D;
+    sh.first=N*(uint64_t)node/nodes;
+    const uint32_t n=(uint32_t)(N*(uint64_t)(node+1)/nodes-sh.first);
+    double *syn=NULL;
+    if(!sh.kf){
+        syn=malloc((size_t)n*D*sizeof *syn);
+        if(!syn){perror("malloc");MPI_Abort(MPI_COMM_WORLD,1);}
+        for(size_t i=0;i<(size_t)n*D;++i) syn[i]=synth_value(seed,sh.first*D+i);
+        sh.val=syn;
+    }
+    if(!check_limits(n,D,K)) MPI_Abort(MPI_COMM_WORLD,1);
+
+    const double s0=now_ms();
+    struct dpu_set_t dpus;
+    uint32_t NR, NRANKS;
+    DPU_ASSERT(dpu_alloc(NR_DPUS,NULL,&dpus));
+    char kpath[128];
+    DPU_ASSERT(dpu_load(dpus,pick_kernel(D,K,kpath,sizeof kpath),NULL));
+    DPU_ASSERT(dpu_get_nr_dpus(dpus,&NR));
+    DPU_ASSERT(dpu_get_nr_ranks(dpus,&NRANKS));
+    if(n>(uint64_t)NR*MAX_POINTS_DPU){
+        fprintf(stderr,"node %d: %u points exceed %u DPUs x MAX_POINTS_DPU=%d\n",
+                node,n,NR,MAX_POINTS_DPU);
+        MPI_Abort(MPI_COMM_WORLD,1);
+    }
+
+    /* quantisation of the whole dataset from the merged shard statistics */
+    quant_t qz;
+    {
+        quant_stats_t st;
+        quant_stats(&st,shard_value,&sh,n,D);
+        MPI_Allreduce(MPI_IN_PLACE,st.lo,(int)D,MPI_DOUBLE,MPI_MIN,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,st.hi,(int)D,MPI_DOUBLE,MPI_MAX,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,st.s1,(int)D,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,st.s2,(int)D,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,&st.n,1,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+        quant_fit_stats(&qz,&st,D,quant_mode);
+    }
+    const row_source_t rs={&qz,shard_value,&sh};
+    DPU_ASSERT(dpu_broadcast_to(dpus,"c_wshift",0,qz.wshift,sizeof qz.wshift,
+               DPU_XFER_DEFAULT));
+    part_t *part=malloc(NR*sizeof *part);
+    dpu_arguments_t *arg=malloc(NR*sizeof *arg);
+    uint32_t *rank_first=malloc(NRANKS*sizeof *rank_first);
+    if(!part||!arg||!rank_first){perror("malloc");MPI_Abort(MPI_COMM_WORLD,1);}
+    scatter_encode(dpus,NR,&rs,n,D,K,1,part,arg);
+    {
+        struct dpu_set_t r; uint32_t ri=0,f0=0;
+        DPU_RANK_FOREACH(dpus,r,ri){
+            uint32_t nd; DPU_ASSERT(dpu_get_nr_dpus(r,&nd));
+            rank_first[ri]=f0; f0+=nd;
+        }
+    }
+
+    gather_ctx_t g={ .rb=rec_bytes(K,D,1), .rank_first=rank_first,
+                     .acc={ PTHREAD_MUTEX_INITIALIZER, NULL, NULL, K, D } };
+    g.recs     =malloc((size_t)NR*g.rb);
+    g.rank_cnt =malloc((size_t)NRANKS*K*sizeof *g.rank_cnt);
+    g.rank_sum =malloc((size_t)NRANKS*K*D*sizeof *g.rank_sum);
+    g.acc.cnt  =malloc(K*sizeof *g.acc.cnt);
+    g.acc.sum  =malloc((size_t)K*D*sizeof *g.acc.sum);
+    g.cb_start =malloc(NRANKS*sizeof *g.cb_start);
+    g.cb_end   =malloc(NRANKS*sizeof *g.cb_end);
+    g.rank_ents=calloc(NRANKS,sizeof *g.rank_ents);
+    const size_t cbytes=align8((size_t)K*D*sizeof(q_feature_t));
+    q_feature_t *cent=calloc(1,cbytes+sizeof(int));   /* + the stop flag */
+    q_feature_t *prev=malloc((size_t)K*D*sizeof *prev);
+    q_sum_t *red=malloc(((size_t)K*D+K+1)*sizeof *red);  /* the Allreduce */
+    const size_t feb=sizeof(far_share_t)+(size_t)D*sizeof(q_feature_t);
+    uint8_t *far_mine=malloc(K*feb), *far_every=malloc((size_t)nodes*K*feb);
+    if(!g.recs||!g.rank_cnt||!g.rank_sum||!g.acc.cnt||!g.acc.sum||!g.cb_start||
+       !g.cb_end||!g.rank_ents||!cent||!prev||!red||!far_mine||!far_every){
+        perror("malloc");MPI_Abort(MPI_COMM_WORLD,1);
+    }
+    far_set_t far, far_all;
+    far_alloc(&far,NR*FAR_SLOTS,D);
+    far_alloc(&far_all,(uint32_t)nodes*K,D);
+    far.rs=&rs;
+    count_t *gc=g.acc.cnt;
+    q_sum_t *gs=g.acc.sum;
+
+    /* K seed points drawn over the whole dataset; their owners fill them in */
+    {
+        uint64_t rng=0x9E3779B97F4A7C15ULL*(seed+1);
+        for(unsigned k=0;k<K;++k){
+            rng^=rng<<13; rng^=rng>>7; rng^=rng<<17;
+            const uint64_t gi=rng%N;
+            if(gi>=sh.first&&gi<sh.first+n)
+                quant_encode_rows(&qz,shard_value,&sh,gi-sh.first,1,&cent[k*D]);
+        }
+        MPI_Allreduce(MPI_IN_PLACE,cent,(int)(K*D),MPI_FEAT,MPI_SUM,MPI_COMM_WORLD);
+    }
+#if PRUNE
+    prune_info_t pr={0};
+#endif
+    phase_times_t tm={0};
+    MPI_Barrier(MPI_COMM_WORLD);
+    const double setup_ms=now_ms()-s0;
+
+    /* per iteration: launch and local gather (compute), the Allreduce and
+       the broadcast (comm), the centroid update in between */
+    double compute_ms=0.0, comm_ms=0.0, update_ms=0.0;
+    unsigned it=0, reseeded=0;
+    uint64_t changed=N;
+    double lsse=0.0, sse=0.0;          /* this node's, all nodes' inertia */
+    int *stop=(int *)((uint8_t *)cent+cbytes);
+    const double l0=now_ms();
+    while(it<max_iter){
+        const double t0=now_ms();
+        memcpy(prev,cent,(size_t)K*D*sizeof *prev);
+        acc_reset(&g.acc);
+        far_reset(&far);
+        atomic_store(&g.changed,0);
+        DPU_ASSERT(dpu_broadcast_to(dpus,"c_clusters",0,cent,cbytes,DPU_XFER_DEFAULT));
+#if DIST_MODE == DIST_EXPAND
+        dist_t cnorm[MAX_CLUSTERS];
+        static const q_feature_t zero[MAX_FEATURES];
+        for(unsigned k=0;k<K;++k) cnorm[k]=quant_dist2(&cent[k*D],zero,qz.wshift,D);
+        DPU_ASSERT(dpu_broadcast_to(dpus,"c_norms",0,cnorm,K*sizeof *cnorm,
+                   DPU_XFER_DEFAULT));
+#endif
+#if PRUNE
+        DPU_ASSERT(dpu_broadcast_to(dpus,"c_prune",0,&pr,sizeof pr,DPU_XFER_DEFAULT));
+#endif
+        launch_and_gather(dpus,&g,NRANKS,&tm);
+        far_collect(&far,g.recs,g.rb,NR,K,D,1,part,NULL,sh.first);
+        /* in double: the DPUs' saturated sums cannot overflow it */
+        lsse=0.0;
+        for(uint32_t j=0;j<NR;++j)
+            lsse+=(double)*(const dist_t *)(g.recs+(size_t)j*g.rb+rec_sse_off(K,D,1));
+        const double t1=now_ms();
+
+        /* every node's counts, changed labels and sums, in one call (counts
+           as double are exact below 2^53); the inertia is only reported,
+           so the last iteration's is reduced after the loop */
+        for(unsigned k=0;k<K;++k) red[k]=(q_sum_t)gc[k];
+        red[K]=(q_sum_t)atomic_load(&g.changed);
+        memcpy(&red[K+1],gs,(size_t)K*D*sizeof *gs);
+        MPI_Allreduce(MPI_IN_PLACE,red,(int)(K*D+K+1),MPI_QSUM,MPI_SUM,MPI_COMM_WORLD);
+        for(unsigned k=0;k<K;++k) gc[k]=(count_t)red[k];
+        changed=(uint64_t)red[K];
+        memcpy(gs,&red[K+1],(size_t)K*D*sizeof *gs);
+        const double t2=now_ms();
+
+        /* empty clusters restart at the farthest points of all nodes (every
+           node sees the same counts, so all take part or none), the others
+           move to their mean */
+        unsigned empty=0;
+        for(unsigned k=0;k<K;++k) empty+=!gc[k];
+        if(empty)
+            reseeded+=far_reseed_all(&far,&far_all,far_mine,far_every,gc,cent,K,D,
+                                     sh.first,nodes);
+        for(unsigned k=0;k<K;++k)
+            if(gc[k])
+                for(unsigned f=0;f<D;++f)
+                    cent[k*D+f]=quant_mean(gs[k*D+f],gc[k]);
+#if PRUNE
+        prune_update(&pr,prev,cent,qz.wshift,K,D);
+#endif
+        it++;
+        double shift=0.0;
+        for(unsigned i=0;i<K*D;++i){
+            double diff=(double)cent[i]-(double)prev[i];
+            shift+=diff*diff;
+        }
+        *stop=(double)changed<=changed_frac*N||sqrt(shift)<=thr;
+        const double t3=now_ms();
+
+        /* node 0's centroids and decision for everyone */
+        MPI_Bcast(cent,(int)(cbytes+sizeof *stop),MPI_BYTE,0,MPI_COMM_WORLD);
+        const double t4=now_ms();
+        compute_ms+=t1-t0; comm_ms+=(t2-t1)+(t4-t3); update_ms+=t3-t2;
+        if(*stop) break;
+    }
+    const double loop_ms=now_ms()-l0;
+    MPI_Reduce(&lsse,&sse,1,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+
+    /* per node: compute, comm; the comm of the node slowest to compute is
+       the network's share, the others' also holds their wait for it */
+    double mine[3]={compute_ms,comm_ms,setup_ms}, *all=NULL;
+    if(!node){
+        all=malloc((size_t)nodes*3*sizeof *all);
+        if(!all){perror("malloc");MPI_Abort(MPI_COMM_WORLD,1);}
+    }
+    MPI_Gather(mine,3,MPI_DOUBLE,all,3,MPI_DOUBLE,0,MPI_COMM_WORLD);
+    uint32_t nmin=n, nmax=n, dmin=NR, dmax=NR;
+    MPI_Reduce(node?&n:MPI_IN_PLACE,&nmin,1,MPI_UINT32_T,MPI_MIN,0,MPI_COMM_WORLD);
+    MPI_Reduce(node?&n:MPI_IN_PLACE,&nmax,1,MPI_UINT32_T,MPI_MAX,0,MPI_COMM_WORLD);
+    MPI_Reduce(node?&NR:MPI_IN_PLACE,&dmin,1,MPI_UINT32_T,MPI_MIN,0,MPI_COMM_WORLD);
+    MPI_Reduce(node?&NR:MPI_IN_PLACE,&dmax,1,MPI_UINT32_T,MPI_MAX,0,MPI_COMM_WORLD);
+    if(!node){
+        printf("Clusters:\n");
+        for(unsigned k=0;k<K;++k){
+            printf(" cluster %u ⇒ (",k);
+            for(unsigned f=0;f<D;++f)
+                printf("%.6g%s",quant_decode(&qz,f,cent[k*D+f]),f==D-1?")\n":", ");
+        }
+        int slow=0;
+        double cmean=0.0, mmean=0.0, mmax=0.0;
+        for(int r=0;r<nodes;++r){
+            if(all[r*3]>all[slow*3]) slow=r;
+            if(all[r*3+1]>mmax) mmax=all[r*3+1];
+            cmean+=all[r*3]/nodes; mmean+=all[r*3+1]/nodes;
+        }
+        printf("\nNodes:        %d, %u..%u points and %u..%u DPUs each, %llu points\n",
+               nodes,nmin,nmax,dmin,dmax,(unsigned long long)N);
+        printf("DPU final after %u iterations: %llu changed, inertia %.6g (kernel "
+               "metric), %u clusters re-seeded\n",it,(unsigned long long)changed,sse,reseeded);
+        printf("Timing (ms):  setup %.2f  loop %.2f  (%.2f per iteration)\n",setup_ms,
+               loop_ms,it?loop_ms/it:0.0);
+        printf("Nodes (ms):   compute max %.2f mean %.2f | comm of that node %.2f "
+               "max %.2f mean %.2f | update %.2f | that node's comm %.1f%% of the loop\n",
+               all[slow*3],cmean,all[slow*3+1],mmax,mmean,update_ms,
+               loop_ms>0?100.0*all[slow*3+1]/loop_ms:0.0);
+        free(all);
+    }
+
+    DPU_ASSERT(dpu_free(dpus));
+    far_free(&far); far_free(&far_all);
+    free(g.recs); free(g.rank_cnt); free(g.rank_sum); free(g.acc.cnt); free(g.acc.sum);
+    free(g.cb_start); free(g.cb_end); free(g.rank_ents);
+    free(cent); free(prev); free(red); free(far_mine); free(far_every);
+    free(part); free(arg); free(rank_first); free(syn);
+    if(sh.kf) kmb_close(&kf);
+    MPI_Finalize();
+    return 0;
+}
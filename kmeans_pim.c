@@ -0,0 +1,258 @@
+/* kmeans_pim.c — libkmeans_pim (kmeans_pim.h) over the host helpers of
+   pim_host.h */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <dpu.h>
+
+#include "kmeans_pim.h"
+#include "common.h"
+#include "pim_host.h"
+#include "quant.h"
+#include "reduce.h"
+
+struct kmp_ctx {
+    struct dpu_set_t dpus;
+    uint32_t         NR, NRANKS, D, K, cap;
+    uint32_t         kfixed;          /* the kernel's FIXED_K, else 0     */
+    uint64_t         tag;             /* the resident points: their tag,  */
+    uint32_t         tag_n;           /* count and quantisation; tag_n 0: */
+    int              tag_mode;        /* nothing usable in MRAM           */
+    uint32_t        *rank_first;
+    part_t          *part;
+    dpu_arguments_t *arg;
+    gather_ctx_t     g;               /* records, per-rank partials, sums */
+    phase_times_t    tm;
+    far_set_t        far;
+    quant_t          qz;              /* the last fit's quantisation      */
+    row_source_t     rs;              /* the fit's points, for re-seeds   */
+    q_feature_t     *batch;           /* a predict batch, [cap][D]        */
+    q_feature_t     *cent, *prev;     /* centroids, padded to 8 bytes     */
+    int              fitted, loaded;  /* loaded: the engine has the model */
+    engine_t         eng;             /* predict                          */
+#if PRUNE
+    prune_info_t     pr;
+#endif
+};
+
+static double row_value(const void *src, size_t i)
+{
+    return ((const double *)src)[i];
+}
+
+/* content hash of n*D doubles, a word at a time (FNV-style multiply with
+   a final avalanche); never 0, which stands for "no tag" */
+static uint64_t data_hash(const double *x, size_t m)
+{
+    uint64_t h=0xCBF29CE484222325ULL^m;
+    for(size_t i=0;i<m;++i){
+        uint64_t w; memcpy(&w,&x[i],sizeof w);
+        h=(h^w)*0x100000001B3ULL;
+        h^=h>>29;
+    }
+    h^=h>>33; h*=0xFF51AFD7ED558CCDULL; h^=h>>33;
+    return h?h:1;
+}
+
+kmp_ctx_t *kmp_create(uint32_t max_points, uint32_t D, uint32_t K)
+{
+    if(!check_limits(max_points,D,K)) return NULL;
+    kmp_ctx_t *c=calloc(1,sizeof *c);
+    if(!c){perror("calloc");return NULL;}
+    DPU_ASSERT(dpu_alloc(NR_DPUS,NULL,&c->dpus));
+    char kpath[128], kfix[128];
+    DPU_ASSERT(dpu_load(c->dpus,pick_kernel(D,K,kpath,sizeof kpath),NULL));
+    snprintf(kfix,sizeof kfix,DPU_BINARY FIXED_TAG "_d%u_k%u",D,K);
+    if(strcmp(kpath,kfix)==0) c->kfixed=K;
+    DPU_ASSERT(dpu_get_nr_dpus(c->dpus,&c->NR));
+    DPU_ASSERT(dpu_get_nr_ranks(c->dpus,&c->NRANKS));
+    if(max_points>(uint64_t)c->NR*MAX_POINTS_DPU){
+        fprintf(stderr,"%u points exceed %u DPUs x MAX_POINTS_DPU=%d\n",
+                max_points,c->NR,MAX_POINTS_DPU);
+        DPU_ASSERT(dpu_free(c->dpus)); free(c);
+        return NULL;
+    }
+    c->D=D; c->K=K; c->cap=max_points;
+    const uint32_t NR=c->NR, NRANKS=c->NRANKS;
+
+    c->rank_first=malloc(NRANKS*sizeof *c->rank_first);
+    c->part =malloc(NR*sizeof *c->part);
+    c->arg  =malloc(NR*sizeof *c->arg);
+    c->batch=malloc((size_t)max_points*D*sizeof *c->batch);
+    c->cent =calloc(1,align8((size_t)K*D*sizeof *c->cent));
+    c->prev =malloc((size_t)K*D*sizeof *c->prev);
+    if(!c->rank_first||!c->part||!c->arg||!c->batch||!c->cent||!c->prev){
+        perror("malloc");exit(1);
+    }
+    {
+        struct dpu_set_t r; uint32_t ri=0,first=0;
+        DPU_RANK_FOREACH(c->dpus,r,ri){
+            uint32_t n; DPU_ASSERT(dpu_get_nr_dpus(r,&n));
+            c->rank_first[ri]=first; first+=n;
+        }
+    }
+    gather_ctx_t *g=&c->g;
+    g->rb=rec_bytes(K,D,1);
+    g->rank_first=c->rank_first;
+    pthread_mutex_init(&g->acc.lock,NULL);
+    g->acc.K=K; g->acc.D=D;
+    g->recs    =malloc((size_t)NR*g->rb);
+    g->rank_cnt=malloc((size_t)NRANKS*K*sizeof *g->rank_cnt);
+    g->rank_sum=malloc((size_t)NRANKS*K*D*sizeof *g->rank_sum);
+    g->acc.cnt =malloc(K*sizeof *g->acc.cnt);
+    g->acc.sum =malloc((size_t)K*D*sizeof *g->acc.sum);
+    g->cb_start=malloc(NRANKS*sizeof *g->cb_start);
+    g->cb_end  =malloc(NRANKS*sizeof *g->cb_end);
+    g->rank_ents=calloc(NRANKS,sizeof *g->rank_ents);
+    if(!g->recs||!g->rank_cnt||!g->rank_sum||!g->acc.cnt||!g->acc.sum||
+       !g->cb_start||!g->cb_end||!g->rank_ents){
+        perror("malloc");exit(1);
+    }
+    far_alloc(&c->far,NR*FAR_SLOTS,D);
+    if(engine_init(&c->eng,c->dpus,D,K,max_points)){ kmp_destroy(c); return NULL; }
+    return c;
+}
+
+int kmp_fit(kmp_ctx_t *c, const double *x, uint32_t n, const kmp_options_t *opt,
+            double *centroids, kmp_result_t *res)
+{
+    static const kmp_options_t defaults;
+    const kmp_options_t *o=opt?opt:&defaults;
+    const unsigned D=c->D, K=o->clusters?o->clusters:c->K;
+    const unsigned max_iter=o->max_iter?o->max_iter:300;
+    const double thr=o->shift_thr>0?o->shift_thr:0.0001;
+    if(K>c->K||(c->kfixed&&K!=c->kfixed)){
+        fprintf(stderr,"kmp_fit: %u clusters, the context's kernel takes %s%u\n",
+                K,c->kfixed?"":"at most ",c->K);
+        return -1;
+    }
+    if(n<K||n>c->cap){
+        fprintf(stderr,"kmp_fit: %u points, need %u..%u\n",n,K,c->cap);
+        return -1;
+    }
+    const double t0=now_ms();
+    gather_ctx_t *g=&c->g;
+    g->rb=rec_bytes(K,D,1);
+    g->acc.K=K;
+    c->eng.K=K;
+
+    /* the ranks quantise their shares as they scatter them, unless the same
+       points under the same quantisation are still in MRAM: then only the
+       labels and the arguments (K) are reset. K random points as seeds */
+    const uint64_t tag=o->data_tag?o->data_tag:data_hash(x,(size_t)n*D);
+    const int cached=c->tag_n==n&&c->tag==tag&&c->tag_mode==o->quant_mode;
+    c->rs=(row_source_t){&c->qz,row_value,x};
+    c->far.rs=&c->rs;
+    if(cached){
+        uint32_t maxc=0;
+        for(uint32_t i=0;i<c->NR;++i){
+            c->arg[i].nclusters=K;
+            if(c->part[i].n>maxc) maxc=c->part[i].n;
+        }
+        clear_labels(c->dpus,maxc);
+        push_args(c->dpus,c->arg);
+    }else{
+        c->tag_n=0;
+        quant_fit(&c->qz,row_value,x,n,D,o->quant_mode);
+        DPU_ASSERT(dpu_broadcast_to(c->dpus,"c_wshift",0,c->qz.wshift,
+                   sizeof c->qz.wshift,DPU_XFER_DEFAULT));
+        scatter_encode(c->dpus,c->NR,&c->rs,n,D,K,1,c->part,c->arg);
+        c->tag=tag; c->tag_n=n; c->tag_mode=o->quant_mode;
+    }
+    uint64_t rng=0x9E3779B97F4A7C15ULL*(o->seed+1);
+    for(unsigned k=0;k<K;++k){
+        rng^=rng<<13; rng^=rng>>7; rng^=rng<<17;
+        quant_encode_rows(&c->qz,row_value,x,(size_t)(rng%n),1,&c->cent[k*D]);
+    }
+#if PRUNE
+    memset(&c->pr,0,sizeof c->pr);   /* new points: the first launch scans all */
+#endif
+    c->fitted=c->loaded=0;
+
+    const size_t cbytes=align8((size_t)K*D*sizeof *c->cent);
+    unsigned it=0, reseeded=0;
+    uint64_t changed=n;
+    double sse=0.0;
+    while(it<max_iter){
+        memcpy(c->prev,c->cent,(size_t)K*D*sizeof *c->prev);
+        acc_reset(&g->acc);
+        far_reset(&c->far);
+        atomic_store(&g->changed,0);
+        DPU_ASSERT(dpu_broadcast_to(c->dpus,"c_clusters",0,c->cent,
+                   cbytes,DPU_XFER_DEFAULT));
+#if DIST_MODE == DIST_EXPAND
+        dist_t cnorm[MAX_CLUSTERS];
+        static const q_feature_t zero[MAX_FEATURES];
+        for(unsigned k=0;k<K;++k) cnorm[k]=quant_dist2(&c->cent[k*D],zero,c->qz.wshift,D);
+        DPU_ASSERT(dpu_broadcast_to(c->dpus,"c_norms",0,cnorm,
+                   K*sizeof *cnorm,DPU_XFER_DEFAULT));
+#endif
+#if PRUNE
+        DPU_ASSERT(dpu_broadcast_to(c->dpus,"c_prune",0,&c->pr,
+                   sizeof c->pr,DPU_XFER_DEFAULT));
+#endif
+        launch_and_gather(c->dpus,g,c->NRANKS,&c->tm);
+        far_collect(&c->far,g->recs,g->rb,c->NR,K,D,1,c->part,NULL,0);
+        sse=0.0;
+        for(uint32_t j=0;j<c->NR;++j)
+            sse+=(double)*(const dist_t *)(g->recs+(size_t)j*g->rb+rec_sse_off(K,D,1));
+
+        /* empty clusters restart at the farthest points, the others move
+           to their mean */
+        changed=atomic_load(&g->changed);
+        reseeded+=far_reseed(&c->far,g->acc.cnt,c->cent,K,D);
+        for(unsigned k=0;k<K;++k)
+            if(g->acc.cnt[k])
+                for(unsigned f=0;f<D;++f)
+                    c->cent[k*D+f]=quant_mean(g->acc.sum[k*D+f],g->acc.cnt[k]);
+#if PRUNE
+        prune_update(&c->pr,c->prev,c->cent,c->qz.wshift,K,D);
+#endif
+        it++;
+
+        double shift=0.0;
+        for(unsigned i=0;i<K*D;++i){
+            double diff=(double)c->cent[i]-(double)c->prev[i];
+            shift+=diff*diff;
+        }
+        if((double)changed<=o->changed_frac*n||sqrt(shift)<=thr) break;
+    }
+
+    dequantise(&c->qz,c->cent,centroids,K,D);
+    c->fitted=1;
+    if(res) *res=(kmp_result_t){it,changed,reseeded,sse,now_ms()-t0,cached};
+    return 0;
+}
+
+int kmp_predict(kmp_ctx_t *c, const double *x, uint32_t n, uint16_t *labels)
+{
+    if(!c->fitted){ fprintf(stderr,"kmp_predict: no fitted model\n"); return -1; }
+    if(n>c->cap){
+        fprintf(stderr,"kmp_predict: %u points exceed the context's %u\n",n,c->cap);
+        return -1;
+    }
+    if(!c->loaded){ engine_load(&c->eng,&c->qz,c->cent); c->loaded=1; }
+    c->tag_n=0;                      /* the batch lands over the fit's points */
+    quant_encode(&c->qz,row_value,x,n,c->batch);
+    engine_assign(&c->eng,c->batch,n,labels);
+    return 0;
+}
+
+void kmp_destroy(kmp_ctx_t *c)
+{
+    if(!c) return;
+    engine_free(&c->eng);
+    DPU_ASSERT(dpu_free(c->dpus));
+    far_free(&c->far);
+    gather_ctx_t *g=&c->g;
+    free(g->recs); free(g->rank_cnt); free(g->rank_sum); free(g->acc.cnt);
+    free(g->acc.sum); free(g->cb_start); free(g->cb_end); free(g->rank_ents);
+    pthread_mutex_destroy(&g->acc.lock);
+    free(c->rank_first); free(c->part); free(c->arg); free(c->batch);
+    free(c->cent); free(c->prev);
+    free(c);
+}
@@ -0,0 +1,76 @@
+#ifndef KMEANS_PIM_H
+#define KMEANS_PIM_H
+
+/*
+ * libkmeans_pim — k-means on the DPUs, embeddable.
+ *
+ * A context owns one DPU allocation loaded with the kernel for its shape
+ * (D features, K clusters) and every transfer and reduction buffer, all
+ * sized at kmp_create for up to max_points points. kmp_fit quantises a
+ * dataset rank by rank as it scatters it to the DPUs (no quantised host
+ * copy) and runs Lloyd iterations without allocating; kmp_predict assigns new points to the
+ * fitted centroids on the same DPUs. One context serves any number of
+ * calls, so the allocation and kernel load are paid once.
+ *
+ * The fitted points stay in MRAM, tagged with a hash of their values (or
+ * the caller's data_tag) and their quantisation: a fit of the same points
+ * skips the quantisation and the upload, so a sweep over cluster counts or
+ * seeds pays for one scatter. opt->clusters fits fewer clusters than the
+ * context's K on the same DPUs (not with a kernel specialised for K). A
+ * kmp_predict batch overwrites the resident points; the next fit uploads
+ * them again.
+ *
+ * The library is built with the same options as kmeans_host (Makefile):
+ * feature type, DIST, PRUNE, ASYNC, DYNAMIC, TILED.
+ *
+ *   kmp_ctx_t *c = kmp_create(1 << 20, D, K);
+ *   kmp_fit(c, x, n, NULL, centroids, &res);       x: n * D doubles
+ *   kmp_fit(c, x, n, &(kmp_options_t){.clusters = 4}, c4, &res);  cached
+ *   kmp_predict(c, y, m, labels);                  labels: m uint16
+ *   kmp_destroy(c);
+ */
+
+#include <stdint.h>
+
+typedef struct kmp_ctx kmp_ctx_t;
+
+typedef struct {
+    unsigned max_iter;       /* hard upper bound (0 = 300)                   */
+    double   shift_thr;      /* stop when the centroid shift, in quantised
+                                units, is at most this (0 = 0.0001)          */
+    double   changed_frac;   /* stop when at most this fraction changes label */
+    int      quant_mode;     /* QUANT_RANGE (0) or QUANT_STD (1), quant.h    */
+    unsigned seed;           /* picks the K random seed points               */
+    unsigned clusters;       /* K of this fit, at most the context's (0 = it) */
+    uint64_t data_tag;       /* nonzero: names the points instead of hashing
+                                them; change it whenever they change         */
+} kmp_options_t;
+
+typedef struct {
+    unsigned iters;
+    uint64_t changed;        /* labels changed in the last assignment        */
+    unsigned reseeded;       /* empty clusters restarted at farthest points  */
+    double   sse;            /* summed distances of the last assignment, in
+                                the kernel's (quantised, weighted) metric;
+                                PRUNE leaves the pruned points out           */
+    double   ms;             /* wall time of the fit                         */
+    int      cached;         /* the points were already resident in MRAM     */
+} kmp_result_t;
+
+/* NULL after printing the error: shape beyond the build's limits, or more
+   points than the DPUs hold */
+kmp_ctx_t *kmp_create(uint32_t max_points, uint32_t D, uint32_t K);
+
+/* fit n points x[n*D] (n <= max_points); centroids[K*D] (K: opt->clusters
+   when set) gets the result in real units, res (may be NULL) the statistics. opt NULL: the defaults.
+   Returns 0, or -1 after printing the error */
+int kmp_fit(kmp_ctx_t *c, const double *x, uint32_t n, const kmp_options_t *opt,
+            double *centroids, kmp_result_t *res);
+
+/* labels[n] of x[n*D] (n <= max_points) against the last fit's centroids.
+   Returns 0, or -1 after printing the error */
+int kmp_predict(kmp_ctx_t *c, const double *x, uint32_t n, uint16_t *labels);
+
+void kmp_destroy(kmp_ctx_t *c);
+
+#endif /* KMEANS_PIM_H */
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include <getopt.h>
 
@@ -13,6 +14,24 @@ typedef struct {
     unsigned int n_clusters;
     unsigned int n_warmup;
     unsigned int n_reps;
+    unsigned int max_iter;      /* hard upper bound on DPU iterations        */
+    double       changed_frac;  /* stop when <= this fraction changes label  */
+    double       shift_thr;     /* stop when the centroid shift is <= this   */
+    bool         validate;      /* also run the CPU reference and compare    */
+    unsigned int shard_points;  /* points per DPU per streamed shard (0=max) */
+    int          quant_mode;    /* QUANT_RANGE/QUANT_STD; -1 = not given     */
+    unsigned int mb_stride;     /* mini-batch: 1/mb_stride of the points per
+                                   launch (0 = off)                          */
+    unsigned int mb_batches;    /* mini-batch launches (0 = mb_stride)       */
+    unsigned int seed_rounds;   /* k-means|| rounds (0 = K random points)    */
+    const char  *job_file;      /* batch of independent jobs (NULL = off)    */
+    unsigned int n_init;        /* seed sets run side by side (0 = 1)        */
+    unsigned int cpu_threads;   /* host assignment threads (0 = all cores)   */
+    double       host_frac;     /* hybrid: host share of the points (0 = off,
+                                   < 0 = calibrated)                         */
+    const char  *labels_out;    /* file for the final labels (NULL = none)   */
+    const char  *serve_sizes;   /* serving latency batch sizes (NULL = off)  */
+    const char  *stats_out;     /* per-iteration report file (NULL = none)   */
 } Params;
 
 static void usage_kmeans() {
@@ -21,25 +40,73 @@ static void usage_kmeans() {
         "\n"
         "\nGeneral options:"
         "\n    -h            help"
-        "\n    -p <NPOINTS>  number of points (default=8)"
+        "\n    -p <NPOINTS>  number of points (default=1024)"
         "\n    -f <NFEAT>    number of features (default=2)"
-        "\n    -c <NCLUST>   number of clusters (default=2)"
-        "\n    -w <W>        # of warmup iters (default=1)"
-        "\n    -r <R>        # of rep iters (default=2)"
+        "\n    -c <NCLUST>   number of clusters (default=5)"
+        "\n    -w <W>        warm-up runs of the iteration loop, and warm-up batches"
+        "\n                  of -P (default=0)"
+        "\n    -r <R>        timed runs of the iteration loop, each from the same seeds;"
+        "\n                  the report is of the last (default=1)"
+        "\n    -i <IT>       max. k-means iterations (default=300)"
+        "\n    -t <FRAC>     stop when at most FRAC of the points change cluster (default=0)"
+        "\n    -s <SHIFT>    stop when the centroid shift is at most SHIFT (default=0.0001)"
+        "\n    -v            validate against the CPU reference"
+        "\n    -S <PTS>      stream shards of PTS points per DPU when the dataset"
+        "\n                  does not fit (default=MRAM capacity)"
+        "\n    -q <MODE>     per-feature quantisation range: 'range' (min..max,"
+        "\n                  default) or 'std' (mean +- 4 stddev, clipped)"
+        "\n    -m <STRIDE>   start with mini-batch launches that each sample 1/STRIDE"
+        "\n                  of the points, then refine with full-batch iterations"
+        "\n                  (bounded by -i; -i 0 stops after the mini-batches)"
+        "\n    -M <B>        number of mini-batch launches (default=STRIDE)"
+        "\n    -k <R>        seed with R rounds of k-means|| on the DPUs (default=0:"
+        "\n                  K random points)"
+        "\n    -n <R>        run R sets of random seeds in the same pass and keep the"
+        "\n                  one with the least inertia (up to NINIT, see Makefile)"
+        "\n    -T <N>        host threads of the CPU reference and hybrid mode"
+        "\n                  (default=0: every online core)"
+        "\n    -H <FRAC>     hybrid: the host threads assign FRAC of the points next to"
+        "\n                  the DPUs; 'auto' times both sides on the first iteration"
+        "\n                  and re-splits to balance them"
+        "\n    -o <FILE>     write every point's cluster of the last assignment to FILE"
+        "\n                  (uint8 for K <= 256, else uint16; no header)"
+        "\n    -P <B,...>    after training, serve the model from a resident DPU set"
+        "\n                  and report p50/p99 latency for batches of B points"
+        "\n    -O <FILE>     write the run's per-iteration timings to FILE: JSON with the"
+        "\n                  configuration, totals and DPU phase cycles (STATS=1) if"
+        "\n                  FILE ends in .json, else one CSV row per iteration"
+        "\n    -J <FILE>     run the jobs listed in FILE, one '<file.kmb> [K]' per line,"
+        "\n                  side by side on one allocation (slots of whole ranks)"
         "\n\nIf [data_file] is provided, we read from it instead of using the above parameters."
         "\n");
 }
 
 static Params input_params_kmeans(int argc, char** argv, char** data_filename) {
     Params p;
-    p.n_points   = 8;
-    p.n_features = 2;
-    p.n_clusters = 2;
-    p.n_warmup   = 1;
-    p.n_reps     = 2;
+    p.n_points     = 1024;
+    p.n_features   = 2;
+    p.n_clusters   = 5;
+    p.n_warmup     = 0;
+    p.n_reps       = 1;
+    p.max_iter     = 300;
+    p.changed_frac = 0.0;
+    p.shift_thr    = 0.0001;
+    p.validate     = false;
+    p.shard_points = 0;
+    p.quant_mode   = -1;
+    p.mb_stride    = 0;
+    p.mb_batches   = 0;
+    p.seed_rounds  = 0;
+    p.job_file     = NULL;
+    p.n_init       = 0;
+    p.cpu_threads  = 0;
+    p.host_frac    = 0.0;
+    p.labels_out   = NULL;
+    p.serve_sizes  = NULL;
+    p.stats_out    = NULL;
 
     int opt;
-    while ((opt = getopt(argc, argv, "hp:f:c:w:r:")) >= 0) {
+    while ((opt = getopt(argc, argv, "hp:f:c:w:r:i:t:s:vS:q:m:M:k:J:n:T:H:o:P:O:")) >= 0) {
         switch(opt) {
             case 'h':
                 usage_kmeans();
@@ -49,6 +116,29 @@ static Params input_params_kmeans(int argc, char** argv, char** data_filename) {
             case 'c': p.n_clusters = (unsigned int)atoi(optarg); break;
             case 'w': p.n_warmup   = (unsigned int)atoi(optarg); break;
             case 'r': p.n_reps     = (unsigned int)atoi(optarg); break;
+            case 'i': p.max_iter   = (unsigned int)atoi(optarg); break;
+            case 't': p.changed_frac = atof(optarg); break;
+            case 's': p.shift_thr  = atof(optarg); break;
+            case 'v': p.validate   = true; break;
+            case 'S': p.shard_points = (unsigned int)atoi(optarg); break;
+            case 'm': p.mb_stride  = (unsigned int)atoi(optarg); break;
+            case 'M': p.mb_batches = (unsigned int)atoi(optarg); break;
+            case 'k': p.seed_rounds = (unsigned int)atoi(optarg); break;
+            case 'J': p.job_file   = optarg; break;
+            case 'o': p.labels_out = optarg; break;
+            case 'P': p.serve_sizes = optarg; break;
+            case 'O': p.stats_out  = optarg; break;
+            case 'n': p.n_init     = (unsigned int)atoi(optarg); break;
+            case 'T': p.cpu_threads = (unsigned int)atoi(optarg); break;
+            case 'H': p.host_frac  = strcmp(optarg,"auto") ? atof(optarg) : -1.0; break;
+            case 'q':
+                if (!strcmp(optarg,"range")) p.quant_mode = 0;
+                else if (!strcmp(optarg,"std")) p.quant_mode = 1;
+                else {
+                    fprintf(stderr,"\n-q takes 'range' or 'std'\n");
+                    exit(1);
+                }
+                break;
             default:
                 fprintf(stderr,"\nUnrecognized option!\n");
                 usage_kmeans();
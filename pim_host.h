@@ -0,0 +1,759 @@
+#ifndef PIM_HOST_H
+#define PIM_HOST_H
+
+/*
+ * Host-side driving of the kernel, shared by kmeans_host and the
+ * libkmeans_pim library (kmeans_pim.h): kernel selection, scatter of the
+ * points, the per-rank gather and reduction of the records, empty-cluster
+ * re-seeding, the Hamerly side information, label readback and the serving
+ * engine. Nothing here allocates per iteration.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <dpu.h>
+
+#include "common.h"
+#include "quant.h"
+#include "reduce.h"
+
+/* data types */
+typedef uint64_t  count_t;     /* cluster sizes                               */
+typedef feat_t    q_feature_t; /* kernel feature sent to DPU & used by CPU ref*/
+typedef acc_sum_t q_sum_t;     /* global sums: N x 32767 overflows int32      */
+
+/* build options (see Makefile) */
+#ifndef ASYNC
+#define ASYNC 0                /* 1 = overlap per-rank gather with compute */
+#endif
+
+static inline void dequantise(const quant_t *q, const q_feature_t *c, double *out,
+                              unsigned K, unsigned D)
+{
+    for (unsigned k = 0; k < K; ++k)
+        for (unsigned f = 0; f < D; ++f)
+            out[k*D+f] = quant_decode(q, f, c[k*D+f]);
+}
+
+
+static inline double now_ms(void)
+{
+    struct timespec t; clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec*1e3+t.tv_nsec/1e6;
+}
+
+/* DPU binary for this shape: the kernel specialised for D and K
+   (make FIXED="D:K ..."), else the one for D, else the generic kernel.
+   Specialised kernels are named with this build's kernel options
+   (FIXED_TAG), so ones from other builds are never picked */
+#ifndef DPU_BINARY
+#define DPU_BINARY "./bin/kmeans_dpu"
+#endif
+#ifndef FIXED_TAG
+#define FIXED_TAG ""
+#endif
+static inline const char *pick_kernel(unsigned D, unsigned K, char *path, size_t len)
+{
+    snprintf(path,len,DPU_BINARY FIXED_TAG "_d%u_k%u",D,K);
+    if(access(path,R_OK)==0) return path;
+    snprintf(path,len,DPU_BINARY FIXED_TAG "_d%u",D);
+    if(access(path,R_OK)==0) return path;
+    return DPU_BINARY;
+}
+
+
+/* the records of a rank's DPUs into recs (rb-byte slots, the rank's first
+   DPU first); returns the bytes fetched per DPU. Sparse records: one
+   transfer of the prefix and as many entries as *ents, the largest list
+   of the last fetch, then the rest of the longest list if it grew */
+static inline size_t pull_records(struct dpu_set_t rank, uint8_t *recs, size_t rb,
+                                  uint32_t D, uint32_t *ents)
+{
+    struct dpu_set_t d; uint32_t i;
+#if SPARSE
+    const size_t eb=rec_ent_bytes(D), pre=rec_ent_off(), cap=(rb-pre)/eb;
+    size_t got=pre+(*ents<cap?*ents:cap)*eb;
+#else
+    (void)D; (void)ents;
+    const size_t got=rb;
+#endif
+    DPU_FOREACH(rank,d,i){ DPU_ASSERT(dpu_prepare_xfer(d,recs+(size_t)i*rb)); }
+    DPU_ASSERT(dpu_push_xfer(rank,DPU_XFER_FROM_DPU,"centers_mram",0,got,
+               DPU_XFER_DEFAULT));
+#if SPARSE
+    uint32_t m=0;
+    DPU_FOREACH(rank,d,i){
+        uint32_t e=((const rec_hdr_t *)(recs+(size_t)i*rb))->entries;
+        if(e>m) m=e;
+    }
+    if(m>cap) m=cap;                  /* a stale header: reported by the caller */
+    if(pre+m*eb>got){
+        DPU_FOREACH(rank,d,i){ DPU_ASSERT(dpu_prepare_xfer(d,recs+(size_t)i*rb+got)); }
+        DPU_ASSERT(dpu_push_xfer(rank,DPU_XFER_FROM_DPU,"centers_mram",got,
+                   pre+m*eb-got,DPU_XFER_DEFAULT));
+        got=pre+m*eb;
+    }
+    *ents=m;
+#endif
+    return got;
+}
+
+/* per-rank gather + reduction, run by dpu_callback in each rank's thread */
+typedef struct {
+    uint8_t        *recs;        /* NR record slots                       */
+    size_t          rb;          /* bytes per record                       */
+    const uint32_t *rank_first;  /* first DPU index of each rank           */
+    count_t        *rank_cnt;    /* per-rank partials: [ranks][K]          */
+    q_sum_t        *rank_sum;    /*                    [ranks][K*D]        */
+    double         *cb_start;    /* per-rank callback start/end (ms)      */
+    double         *cb_end;
+    uint32_t       *rank_ents;   /* SPARSE: per rank, entries fetched with
+                                    the prefix (pull_records)              */
+    atomic_uint_fast64_t fetched;/* record bytes fetched ...               */
+    atomic_uint_fast64_t fetched_recs;  /* ... in this many records        */
+    atomic_uint_fast64_t pruned; /* point scans skipped by the bounds      */
+    atomic_uint_fast64_t changed;/* labels changed in this iteration       */
+    uint32_t        steps;       /* Lloyd steps every record must report
+                                    (0: not checked)                       */
+    global_acc_t    acc;
+} gather_ctx_t;
+
+static inline dpu_error_t
+gather_rank(struct dpu_set_t rank, uint32_t rank_id, void *arg)
+{
+    gather_ctx_t *g = arg;
+    g->cb_start[rank_id] = now_ms();
+    const uint32_t K = g->acc.K, D = g->acc.D;
+    const uint32_t first = g->rank_first[rank_id];
+    uint32_t n; DPU_ASSERT(dpu_get_nr_dpus(rank,&n));
+
+    atomic_fetch_add(&g->fetched,n*pull_records(rank,g->recs+(size_t)first*g->rb,
+                                                g->rb,D,&g->rank_ents[rank_id]));
+    atomic_fetch_add(&g->fetched_recs,n);
+
+    uint64_t pruned=0, changed=0;
+    for(uint32_t j=first;j<first+n;++j){
+        const rec_hdr_t *h=(const rec_hdr_t *)(g->recs+(size_t)j*g->rb);
+        if(!h->done){
+            fprintf(stderr,"DPU %u: stale record (not done)\n",j);
+            exit(1);
+        }
+        if(g->steps&&h->steps!=g->steps){
+            fprintf(stderr,"DPU %u: ran %u Lloyd steps, %u asked (rebuild the kernel "
+                           "with the host's LOCAL_STEPS)\n",j,h->steps,g->steps);
+            exit(1);
+        }
+        pruned+=h->pruned;
+        changed+=h->changed;
+    }
+    atomic_fetch_add(&g->pruned,pruned);
+    atomic_fetch_add(&g->changed,changed);
+
+    count_t *pc = &g->rank_cnt[(size_t)rank_id*K];
+    q_sum_t *ps = &g->rank_sum[(size_t)rank_id*K*D];
+    rec_fold(pc,ps,g->recs,g->rb,first,n,K,D);
+    acc_merge(&g->acc,pc,ps);
+    g->cb_end[rank_id] = now_ms();
+    return DPU_OK;
+}
+
+#if PRUNE
+/* Hamerly side information for the kernel: per-centroid drift since the
+   last launch and half the distance to the nearest other centroid */
+static inline void prune_update(prune_info_t *pr,
+                                const q_feature_t *prev, const q_feature_t *c,
+                                const uint8_t *wshift, unsigned K, unsigned D)
+{
+    pr->max_drift=pr->max_drift2=pr->max_drift_k=0;
+    for(unsigned k=0;k<K;++k){
+        uint64_t d2=(uint64_t)quant_dist2(&c[k*D],&prev[k*D],wshift,D);
+        uint64_t near=UINT64_MAX;
+        for(unsigned j=0;j<K;++j){
+            if(j==k) continue;
+            uint64_t e2=(uint64_t)quant_dist2(&c[k*D],&c[j*D],wshift,D);
+            if(e2<near) near=e2;
+        }
+        pr->drift[k]=isqrt64_ceil(d2);
+        pr->half[k]=near==UINT64_MAX?UINT32_MAX:isqrt64(near,NULL)/2;
+        if(pr->drift[k]>pr->max_drift){
+            pr->max_drift2=pr->max_drift;
+            pr->max_drift=pr->drift[k]; pr->max_drift_k=k;
+        }else if(pr->drift[k]>pr->max_drift2){
+            pr->max_drift2=pr->drift[k];
+        }
+    }
+    pr->valid=1;
+}
+#endif
+
+/* per-phase wall time of the iteration loop */
+typedef struct {
+    double comp_ms, read_ms;
+    double merge_ms, hidden_ms;   /* host merge work, part overlapped */
+    double scatter_ms, wait_ms;   /* streaming: shard upload, read stall */
+} phase_times_t;
+
+
+/* one launch over the whole set, followed by the per-rank gather+merge */
+static inline void
+launch_and_gather(struct dpu_set_t dpus, gather_ctx_t *g, uint32_t nranks,
+                  phase_times_t *t)
+{
+#if ASYNC
+    /* launch all ranks and queue the per-rank gather behind each rank's
+       launch: a rank is fetched and merged as soon as it finishes,
+       while slower ranks are still computing */
+    double l0=now_ms();
+    DPU_ASSERT(dpu_launch(dpus,DPU_ASYNCHRONOUS));
+    DPU_ASSERT(dpu_callback(dpus,gather_rank,g,DPU_CALLBACK_ASYNC));
+    DPU_ASSERT(dpu_sync(dpus));
+    double l1=now_ms();
+
+    /* the last callback to start marks the end of DPU compute */
+    double last=l0;
+    for(uint32_t r=0;r<nranks;++r) if(g->cb_start[r]>last) last=g->cb_start[r];
+    for(uint32_t r=0;r<nranks;++r){
+        double end=g->cb_end[r]<last?g->cb_end[r]:last;
+        t->merge_ms+=g->cb_end[r]-g->cb_start[r];
+        if(end>g->cb_start[r]) t->hidden_ms+=end-g->cb_start[r];
+    }
+    t->comp_ms+=last-l0;
+    t->read_ms+=l1-last;
+#else
+    /* launch */
+    struct timespec l0,l1; clock_gettime(CLOCK_MONOTONIC,&l0);
+    DPU_ASSERT(dpu_launch(dpus,DPU_SYNCHRONOUS));
+    clock_gettime(CLOCK_MONOTONIC,&l1);
+    t->comp_ms+=(l1.tv_sec-l0.tv_sec)*1e3+(l1.tv_nsec-l0.tv_nsec)/1e6;
+
+    /* gather + reduce: ranks fetch and fold their records in parallel */
+    struct timespec r0,r1; clock_gettime(CLOCK_MONOTONIC,&r0);
+    DPU_ASSERT(dpu_callback(dpus,gather_rank,g,DPU_CALLBACK_ASYNC));
+    DPU_ASSERT(dpu_sync(dpus));
+    clock_gettime(CLOCK_MONOTONIC,&r1);
+    t->read_ms+=(r1.tv_sec-r0.tv_sec)*1e3+(r1.tv_nsec-r0.tv_nsec)/1e6;
+    for(uint32_t r=0;r<nranks;++r) t->merge_ms+=g->cb_end[r]-g->cb_start[r];
+#endif
+}
+
+typedef struct{uint32_t n,off;} part_t;
+
+static inline void push_args(struct dpu_set_t dpus, dpu_arguments_t *arg)
+{
+    struct dpu_set_t d; uint32_t idx;
+    DPU_FOREACH(dpus,d,idx){DPU_ASSERT(dpu_prepare_xfer(d,&arg[idx]));}
+    DPU_ASSERT(dpu_push_xfer(dpus,DPU_XFER_TO_DPU,
+               "DPU_INPUT_ARGUMENTS",0,sizeof(dpu_arguments_t),
+               DPU_XFER_DEFAULT));
+}
+
+/* staging kept across scatters: the padded shares of the DPUs whose share
+   would run past the points, and a run of LABEL_NONE. Streamed shards
+   pass the same one every shard, so it grows on the first shards and is
+   reused; NULL where a scatter takes one of its own */
+typedef struct {
+    uint8_t  *pts;  size_t pts_cap;
+    uint16_t *none; size_t none_cap;
+} scatter_stage_t;
+
+static inline void stage_free(scatter_stage_t *st)
+{
+    free(st->pts); free(st->none);
+    *st=(scatter_stage_t){0};
+}
+
+/* every DPU's first n labels to LABEL_NONE: every label counts as changed
+   at the next launch */
+static inline void clear_labels_staged(struct dpu_set_t dpus, uint32_t n,
+                                       scatter_stage_t *st)
+{
+    size_t lbytes=align8((size_t)n*sizeof(uint16_t));
+    if(lbytes>st->none_cap){
+        free(st->none);
+        st->none=malloc(lbytes);
+        if(!st->none){perror("malloc");exit(1);}
+        for(size_t i=0;i<lbytes/sizeof *st->none;++i) st->none[i]=LABEL_NONE;
+        st->none_cap=lbytes;
+    }
+    DPU_ASSERT(dpu_broadcast_to(dpus,"t_labels",0,st->none,lbytes,DPU_XFER_DEFAULT));
+}
+
+static inline void clear_labels(struct dpu_set_t dpus, uint32_t n)
+{
+    scatter_stage_t st={0};
+    clear_labels_staged(dpus,n,&st);
+    stage_free(&st);
+}
+
+/* split n points over the NR DPUs (the first n%NR take one more); returns
+   the largest share. Exits when a share exceeds the DPU's arrays */
+static inline uint32_t split_points(uint32_t NR, uint32_t n, part_t *part)
+{
+    uint32_t base=n/NR,rem=n%NR,off=0;
+    for(uint32_t i=0;i<NR;++i){
+        uint32_t c=base+(i<rem);
+        part[i]=(part_t){c,off}; off+=c;
+    }
+    if(base+(rem>0)>MAX_POINTS_DPU){
+        fprintf(stderr,"%u points per DPU exceed MAX_POINTS_DPU=%d\n",
+                base+(rem>0),MAX_POINTS_DPU);
+        exit(1);
+    }
+    return base+(rem>0);
+}
+
+/* split n points over the NR DPUs, upload them with their arguments (R
+   centroid sets of K) and reset every label to LABEL_NONE.
+   One transfer for all DPUs: every DPU gets the largest share, padded to 8
+   bytes, straight from pts; only the last DPUs, whose padded share would
+   run past the end of pts, are staged (in st, or a buffer of its own when
+   st is NULL) */
+static inline void
+scatter_points(struct dpu_set_t dpus, uint32_t NR,
+               const q_feature_t *pts, uint32_t n, unsigned D, unsigned K,
+               unsigned R, part_t *part, dpu_arguments_t *arg,
+               scatter_stage_t *st)
+{
+    scatter_stage_t own={0};
+    if(!st) st=&own;
+    const uint32_t maxc=split_points(NR,n,part);
+    const size_t row=(size_t)D*sizeof(q_feature_t), slot=align8(maxc*row);
+    uint32_t tail=NR;                    /* first DPU that is staged */
+    while(tail>0&&part[tail-1].off*row+slot>n*row) tail--;
+    uint8_t *stage=NULL;
+    if(slot&&tail<NR){
+        const size_t sbytes=(size_t)(NR-tail)*slot;
+        if(sbytes>st->pts_cap){
+            free(st->pts);
+            st->pts=malloc(sbytes);
+            if(!st->pts){perror("malloc");exit(1);}
+            st->pts_cap=sbytes;
+        }
+        stage=st->pts;
+        for(uint32_t i=tail;i<NR;++i){
+            memcpy(stage+(i-tail)*slot,&pts[(size_t)part[i].off*D],part[i].n*row);
+            memset(stage+(i-tail)*slot+part[i].n*row,0,slot-part[i].n*row);
+        }
+    }
+    struct dpu_set_t d; uint32_t idx;
+    DPU_FOREACH(dpus,d,idx){
+        arg[idx]=(dpu_arguments_t){part[idx].n,D,K,0,1,R,0};
+        DPU_ASSERT(dpu_prepare_xfer(d,idx<tail?(void *)&pts[(size_t)part[idx].off*D]
+                                              :stage+(idx-tail)*slot));
+    }
+    if(slot)
+        DPU_ASSERT(dpu_push_xfer(dpus,DPU_XFER_TO_DPU,"t_features",0,slot,
+                   DPU_XFER_DEFAULT));
+    /* no point has a label yet */
+    clear_labels_staged(dpus,maxc,st);
+    push_args(dpus,arg);
+    stage_free(&own);
+}
+
+/* rows quantised on the fly from their real values (quant.h) */
+typedef struct {
+    const quant_t  *qz;
+    quant_value_fn  val;
+    const void     *src;
+} row_source_t;
+
+#define SCATTER_CHUNK 1024       /* points per DPU per staged transfer */
+
+/* per-rank quantisation and upload, run by dpu_callback in each rank's
+   thread: SCATTER_CHUNK points of every DPU of the rank at a time go
+   through the rank's staging buffer, one transfer per chunk */
+typedef struct {
+    const row_source_t *rs;
+    const part_t       *part;
+    const uint32_t     *rank_first;
+    uint8_t           **stage;       /* per rank, [DPUs][SCATTER_CHUNK][D] */
+    uint32_t            maxc, D;
+} encode_ctx_t;
+
+static inline dpu_error_t
+encode_rank(struct dpu_set_t rank, uint32_t rank_id, void *arg)
+{
+    const encode_ctx_t *e=arg;
+    const size_t row=(size_t)e->D*sizeof(q_feature_t);
+    const size_t cb=SCATTER_CHUNK*row;
+    const uint32_t first=e->rank_first[rank_id];
+    uint8_t *st=e->stage[rank_id];
+    for(uint32_t c0=0;c0<e->maxc;c0+=SCATTER_CHUNK){
+        const uint32_t cn=e->maxc-c0<SCATTER_CHUNK?e->maxc-c0:SCATTER_CHUNK;
+        struct dpu_set_t d; uint32_t i;
+        DPU_FOREACH(rank,d,i){
+            const part_t *p=&e->part[first+i];
+            const uint32_t m=p->n<=c0?0:p->n-c0<cn?p->n-c0:cn;
+            quant_encode_rows(e->rs->qz,e->rs->val,e->rs->src,(size_t)p->off+c0,m,
+                              (q_feature_t *)(st+i*cb));
+            memset(st+i*cb+m*row,0,align8(cn*row)-m*row);
+            DPU_ASSERT(dpu_prepare_xfer(d,st+i*cb));
+        }
+        DPU_ASSERT(dpu_push_xfer(rank,DPU_XFER_TO_DPU,"t_features",c0*row,
+                   align8(cn*row),DPU_XFER_DEFAULT));
+    }
+    return DPU_OK;
+}
+
+/* scatter_points for points that are not quantised yet: the ranks quantise
+   their DPUs' shares from rs in parallel, chunk by chunk, so the quantised
+   dataset never exists on the host */
+static inline void
+scatter_encode(struct dpu_set_t dpus, uint32_t NR, const row_source_t *rs,
+               uint32_t n, unsigned D, unsigned K, unsigned R,
+               part_t *part, dpu_arguments_t *arg)
+{
+    uint32_t nranks; DPU_ASSERT(dpu_get_nr_ranks(dpus,&nranks));
+    uint32_t *rank_first=malloc(nranks*sizeof *rank_first);
+    uint8_t **stage=calloc(nranks,sizeof *stage);
+    if(!rank_first||!stage){perror("malloc");exit(1);}
+    encode_ctx_t e={rs,part,rank_first,stage,split_points(NR,n,part),D};
+    {
+        struct dpu_set_t r; uint32_t ri=0,first=0;
+        DPU_RANK_FOREACH(dpus,r,ri){
+            uint32_t nd; DPU_ASSERT(dpu_get_nr_dpus(r,&nd));
+            rank_first[ri]=first; first+=nd;
+            stage[ri]=malloc((size_t)nd*SCATTER_CHUNK*D*sizeof(q_feature_t));
+            if(!stage[ri]){perror("malloc");exit(1);}
+        }
+    }
+    DPU_ASSERT(dpu_callback(dpus,encode_rank,&e,DPU_CALLBACK_ASYNC));
+    DPU_ASSERT(dpu_sync(dpus));
+    for(uint32_t r=0;r<nranks;++r) free(stage[r]);
+    free(stage); free(rank_first);
+
+    for(uint32_t idx=0;idx<NR;++idx) arg[idx]=(dpu_arguments_t){part[idx].n,D,K,0,1,R,0};
+    clear_labels(dpus,e.maxc);
+    push_args(dpus,arg);
+}
+
+/* the labels the last launch left in t_labels, into out[n] indexed like
+   the scattered points: uint16 (w=2) or narrowed to uint8 (w=1, K <= 256).
+   One transfer from every DPU at once: a DPU holding a whole 8-byte block
+   of the largest part lands straight in out, the others in stage
+   (NR x that block; NULL allocates it when needed) */
+static inline void read_labels(struct dpu_set_t dpus, uint32_t NR, const part_t *part,
+                               void *out, size_t w, uint16_t *stage)
+{
+    uint32_t mx=0;
+    for(uint32_t i=0;i<NR;++i) if(part[i].n>mx) mx=part[i].n;
+    const size_t lb=align8((size_t)mx*sizeof(uint16_t));
+    if(!lb) return;
+    uint32_t staged=0;
+    for(uint32_t i=0;i<NR;++i)
+        staged+=w!=sizeof(uint16_t)||(size_t)part[i].n*sizeof(uint16_t)!=lb;
+    uint16_t *own=NULL;
+    if(staged&&!stage){
+        stage=own=malloc((size_t)NR*lb);
+        if(!own){perror("malloc");exit(1);}
+    }
+
+    struct dpu_set_t d; uint32_t i;
+    DPU_FOREACH(dpus,d,i){
+        const int direct=w==sizeof(uint16_t)&&(size_t)part[i].n*sizeof(uint16_t)==lb;
+        DPU_ASSERT(dpu_prepare_xfer(d,direct?(void *)((uint16_t *)out+part[i].off)
+                                            :(void *)((uint8_t *)stage+(size_t)i*lb)));
+    }
+    DPU_ASSERT(dpu_push_xfer(dpus,DPU_XFER_FROM_DPU,"t_labels",0,lb,DPU_XFER_DEFAULT));
+    for(uint32_t j=0;j<NR&&staged;++j){
+        if(w==sizeof(uint16_t)&&(size_t)part[j].n*sizeof(uint16_t)==lb) continue;
+        const uint16_t *src=(const uint16_t *)((uint8_t *)stage+(size_t)j*lb);
+        if(w==sizeof(uint16_t))
+            memcpy((uint16_t *)out+part[j].off,src,part[j].n*sizeof *src);
+        else
+            for(uint32_t p=0;p<part[j].n;++p) ((uint8_t *)out)[part[j].off+p]=(uint8_t)src[p];
+    }
+    free(own);
+}
+
+
+/* ---------------- empty clusters ---------------- */
+/* every source's farthest points of the current iteration, FAR_SLOTS each
+   per centroid set, set by set; the sources are the DPUs, then the host
+   threads of hybrid mode */
+typedef struct { dist_t d; uint64_t gi; uint32_t slot; } far_rank_t;
+
+typedef struct {
+    uint32_t     n;            /* R * sources * FAR_SLOTS     */
+    dist_t      *d;            /* < 0: slot unused            */
+    uint64_t    *gi;           /* index in the whole dataset  */
+    q_feature_t *pt;           /* coordinates, [n][D]         */
+    far_rank_t  *rk;           /* far_reseed's ranking, [n]   */
+    const row_source_t *rs;    /* set: no pt, the points are
+                                  re-quantised from here      */
+} far_set_t;
+
+static inline void far_alloc(far_set_t *fs, uint32_t n, unsigned D)
+{
+    *fs=(far_set_t){.n=n};
+    fs->d =malloc(n*sizeof *fs->d);
+    fs->gi=malloc(n*sizeof *fs->gi);
+    fs->pt=malloc((size_t)n*D*sizeof *fs->pt);
+    fs->rk=malloc(n*sizeof *fs->rk);
+    if(!fs->d||!fs->gi||!fs->pt||!fs->rk){perror("malloc");exit(1);}
+}
+
+static inline void far_free(far_set_t *fs)
+{
+    free(fs->d); free(fs->gi); free(fs->pt); free(fs->rk);
+}
+
+static inline void far_reset(far_set_t *fs)
+{
+    for(uint32_t i=0;i<fs->n;++i) fs->d[i]=-1;
+}
+
+/* point gi at distance d into the FAR_SLOTS slots from base, kept in
+   far_cmp order: the source's farthest points so far */
+static inline void far_insert(far_set_t *fs, uint32_t base, dist_t d, uint64_t gi,
+                              const q_feature_t *pt, unsigned D)
+{
+    uint32_t s=base+FAR_SLOTS-1;
+    if(d<fs->d[s]||(d==fs->d[s]&&gi>=fs->gi[s])) return;
+    for(;s>base&&(d>fs->d[s-1]||(d==fs->d[s-1]&&gi<fs->gi[s-1]));--s){
+        fs->d[s]=fs->d[s-1]; fs->gi[s]=fs->gi[s-1];
+        if(pt) memcpy(&fs->pt[(size_t)s*D],&fs->pt[(size_t)(s-1)*D],D*sizeof *pt);
+    }
+    fs->d[s]=d; fs->gi[s]=gi;
+    if(pt) memcpy(&fs->pt[(size_t)s*D],pt,D*sizeof *pt);
+}
+
+/* take the farthest points of the records just gathered (K clusters in
+   R sets); pts is what this launch scattered, point 0 of it sitting at
+   dataset index first (NULL with fs->rs: only the indices are kept).
+   Streamed shards merge into each DPU's FAR_SLOTS farthest of all shards */
+static inline void far_collect(far_set_t *fs, const uint8_t *recs, size_t rb,
+                               uint32_t NR, unsigned K, unsigned D, unsigned R,
+                               const part_t *part, const q_feature_t *pts, uint64_t first)
+{
+    const uint32_t NS=fs->n/(R*FAR_SLOTS);
+    for(uint32_t e=0;e<R*NR;++e){
+        const uint32_t r=e/NR, j=e%NR;
+        const far_point_t *fp=(const far_point_t *)(recs+(size_t)j*rb+rec_far_off(K,D))
+                              +r*FAR_SLOTS;
+        for(uint32_t s=0;s<FAR_SLOTS;++s){
+            if(fp[s].idx==FAR_NONE) continue;
+            const uint64_t li=(uint64_t)part[j].off+fp[s].idx;
+            far_insert(fs,(r*NS+j)*FAR_SLOTS,fp[s].d,first+li,pts?&pts[li*D]:NULL,D);
+        }
+    }
+}
+
+
+/* centroid set r's farthest points, of R */
+static inline far_set_t far_view(const far_set_t *fs, unsigned r, unsigned R, unsigned D)
+{
+    const uint32_t n=fs->n/R;
+    return (far_set_t){.n=n,.d=fs->d+(size_t)r*n,.gi=fs->gi+(size_t)r*n,
+                       .pt=fs->pt+(size_t)r*n*D,.rk=fs->rk,.rs=fs->rs};
+}
+
+/* farthest first, then lower dataset index (the CPU reference's order) */
+static inline int far_cmp(const void *a, const void *b)
+{
+    const far_rank_t *x=a, *y=b;
+    if(x->d!=y->d) return x->d>y->d?-1:1;
+    return x->gi<y->gi?-1:x->gi>y->gi;
+}
+
+/* restart each empty cluster at the next farthest point; returns how many.
+   fs is one set's part of the farthest points (far_view) */
+static inline unsigned far_reseed(const far_set_t *fs, const count_t *cnt,
+                                  q_feature_t *c, unsigned K, unsigned D)
+{
+    unsigned empty=0;
+    for(unsigned k=0;k<K;++k) empty+=!cnt[k];
+    if(!empty) return 0;
+
+    far_rank_t *r=fs->rk;
+    uint32_t n=0;
+    for(uint32_t i=0;i<fs->n;++i)
+        if(fs->d[i]>0) r[n++]=(far_rank_t){fs->d[i],fs->gi[i],i};
+    qsort(r,n,sizeof *r,far_cmp);
+    unsigned used=0;
+    for(unsigned k=0;k<K&&used<n;++k)
+        if(!cnt[k]){
+            if(fs->rs)
+                quant_encode_rows(fs->rs->qz,fs->rs->val,fs->rs->src,r[used].gi,1,&c[k*D]);
+            else
+                memcpy(&c[k*D],&fs->pt[(size_t)r[used].slot*D],D*sizeof *c);
+            used++;
+        }
+    return used;
+}
+
+
+/* the kernel's arrays are sized at build time: reject shapes beyond them
+   up front, naming the build option that lifts each limit */
+static inline int check_limits(unsigned N, unsigned D, unsigned K)
+{
+    int ok=1;
+    if(!N||!D||!K){
+        fprintf(stderr,"Need points, features and clusters > 0\n");
+        return 0;
+    }
+    if(D>MAX_FEATURES){
+        fprintf(stderr,"%u features exceed MAX_FEATURES=%d%s\n",D,MAX_FEATURES,
+                TILED?"":" (TILED=1 lifts it)");
+        ok=0;
+    }
+    if(K>MAX_CLUSTERS){
+        fprintf(stderr,"%u clusters exceed MAX_CLUSTERS=%d%s\n",K,MAX_CLUSTERS,
+                TILED?"":" (TILED=1 lifts it)");
+        ok=0;
+    }
+    return ok;
+}
+
+
+/* ---------------- serving: resident model, batch assignment ----------------
+ * engine_init sizes the buffers over a loaded DPU set, engine_load installs
+ * a trained model (its quantisation and K centroids), and every engine_assign
+ * pushes a batch of quantised points, runs one launch of the kernel's
+ * assignment and reads the labels back, reusing the engine's buffers. Batch
+ * points go SERVE_CHUNK-aligned to as few DPUs as needed, a DPU taking up to
+ * SERVE_CHUNK points per tasklet before the next one is used: whole chunks
+ * are sent straight from the caller's array, only the tail one is staged,
+ * and only the ranks holding those DPUs are pushed, launched and read.
+ */
+#define SERVE_CHUNK 8               /* points: whole 8-byte blocks per DPU */
+#define SERVE_FILL  (SERVE_CHUNK*NR_TASKLETS)   /* points a DPU takes alone */
+
+typedef struct {
+    struct dpu_set_t dpus;
+    uint32_t         NR, D, K, cap;  /* cap: largest batch                  */
+    uint32_t         NRANKS;
+    struct dpu_set_t *rank;         /* the ranks, and their first DPUs     */
+    uint32_t        *rank_first;    /*   ([NRANKS+1])                      */
+    part_t          *part;
+    dpu_arguments_t *arg;
+    q_feature_t     *tail;          /* the partly filled chunk, padded     */
+    uint16_t        *stage;         /* labels of the partly filled chunks  */
+} engine_t;
+
+/* points per DPU for a batch of n on NR DPUs, and the DPUs it takes */
+static inline uint32_t engine_chunk(uint32_t n, uint32_t NR, uint32_t *used)
+{
+    uint32_t u=(n+SERVE_FILL-1)/SERVE_FILL;
+    u=u<1?1:u>NR?NR:u;
+    const uint32_t per=(n+u-1)/u;
+    *used=u;
+    return (per+SERVE_CHUNK-1)/SERVE_CHUNK*SERVE_CHUNK;
+}
+
+/* batches of up to cap points of D features, K clusters, on dpus (loaded
+   with pick_kernel(D, K)); returns 0 on success, -1 after printing the error */
+static inline int engine_init(engine_t *e, struct dpu_set_t dpus,
+                              uint32_t D, uint32_t K, uint32_t cap)
+{
+    memset(e,0,sizeof *e);
+    e->dpus=dpus;
+    DPU_ASSERT(dpu_get_nr_dpus(e->dpus,&e->NR));
+    DPU_ASSERT(dpu_get_nr_ranks(e->dpus,&e->NRANKS));
+    uint32_t used;
+    const uint32_t chunk=engine_chunk(cap,e->NR,&used);
+    if(chunk>MAX_POINTS_DPU){
+        fprintf(stderr,"Batches of %u points exceed %u DPUs x MAX_POINTS_DPU=%d\n",
+                cap,e->NR,MAX_POINTS_DPU);
+        return -1;
+    }
+    /* a smaller batch can load its DPUs fuller, up to SERVE_FILL each */
+    const uint32_t fill=((cap<SERVE_FILL?cap:SERVE_FILL)+SERVE_CHUNK-1)/SERVE_CHUNK*SERVE_CHUNK;
+    const uint32_t mx=chunk>fill?chunk:fill;
+    e->D=D; e->K=K; e->cap=cap;
+    e->rank =malloc(e->NRANKS*sizeof *e->rank);
+    e->rank_first=malloc((e->NRANKS+1)*sizeof *e->rank_first);
+    e->part =malloc(e->NR*sizeof *e->part);
+    e->arg  =malloc(e->NR*sizeof *e->arg);
+    e->tail =calloc((size_t)mx*D,sizeof *e->tail);
+    e->stage=malloc((size_t)e->NR*align8(mx*sizeof(uint16_t)));
+    if(!e->rank||!e->rank_first||!e->part||!e->arg||!e->tail||!e->stage){
+        perror("malloc");exit(1);
+    }
+    struct dpu_set_t r; uint32_t ri=0,first=0;
+    DPU_RANK_FOREACH(e->dpus,r,ri){
+        uint32_t nd; DPU_ASSERT(dpu_get_nr_dpus(r,&nd));
+        e->rank[ri]=r; e->rank_first[ri]=first; first+=nd;
+    }
+    e->rank_first[e->NRANKS]=first;
+    return 0;
+}
+
+/* install a model: its quantisation and c[K*D] in the kernel's type */
+static inline void engine_load(engine_t *e, const quant_t *qz, const q_feature_t *c)
+{
+    const unsigned D=e->D,K=e->K;
+    DPU_ASSERT(dpu_broadcast_to(e->dpus,"c_wshift",0,qz->wshift,
+               sizeof qz->wshift,DPU_XFER_DEFAULT));
+    const size_t cbytes=align8((size_t)K*D*sizeof *c);
+    q_feature_t *cp=calloc(1,cbytes);     /* the push is a multiple of 8 */
+    if(!cp){perror("calloc");exit(1);}
+    memcpy(cp,c,(size_t)K*D*sizeof *c);
+    DPU_ASSERT(dpu_broadcast_to(e->dpus,"c_clusters",0,cp,cbytes,DPU_XFER_DEFAULT));
+    free(cp);
+#if DIST_MODE == DIST_EXPAND
+    dist_t cnorm[MAX_CLUSTERS];
+    static const q_feature_t zero[MAX_FEATURES];
+    for(unsigned k=0;k<K;++k) cnorm[k]=quant_dist2(&c[k*D],zero,qz->wshift,D);
+    DPU_ASSERT(dpu_broadcast_to(e->dpus,"c_norms",0,cnorm,
+               K*sizeof *cnorm,DPU_XFER_DEFAULT));
+#endif
+#if PRUNE
+    /* every batch is new points: no bounds to trust */
+    static const prune_info_t pr;
+    DPU_ASSERT(dpu_broadcast_to(e->dpus,"c_prune",0,&pr,sizeof pr,DPU_XFER_DEFAULT));
+#endif
+}
+
+/* labels[n] of pts[n*D] (quantised with the model's quant_t), n <= cap */
+static inline void engine_assign(engine_t *e, const q_feature_t *pts, uint32_t n,
+                                 uint16_t *labels)
+{
+    const unsigned D=e->D;
+    uint32_t used;
+    const uint32_t chunk=engine_chunk(n,e->NR,&used);
+    const size_t cb=(size_t)chunk*D*sizeof *pts;
+    for(uint32_t i=0,off=0;i<e->NR;++i){
+        const uint32_t c=n-off<chunk?n-off:chunk;
+        e->part[i]=(part_t){c,off}; off+=c;
+        e->arg[i]=(dpu_arguments_t){c,D,e->K,0,1,1,0};
+    }
+    /* the ranks holding the used DPUs: [0, nr) */
+    uint32_t nr=0;
+    while(nr<e->NRANKS&&e->rank_first[nr]<used) nr++;
+    for(uint32_t r=0;r<nr;++r){
+        const uint32_t first=e->rank_first[r];
+        struct dpu_set_t d; uint32_t i;
+        DPU_FOREACH(e->rank[r],d,i){
+            const part_t *pt=&e->part[first+i];
+            if(pt->n&&pt->n<chunk)
+                memcpy(e->tail,&pts[(size_t)pt->off*D],(size_t)pt->n*D*sizeof *pts);
+            DPU_ASSERT(dpu_prepare_xfer(d,pt->n==chunk?(void *)&pts[(size_t)pt->off*D]
+                                                      :(void *)e->tail));
+        }
+        if(cb) DPU_ASSERT(dpu_push_xfer(e->rank[r],DPU_XFER_TO_DPU,"t_features",0,cb,
+                          DPU_XFER_DEFAULT));
+        push_args(e->rank[r],&e->arg[first]);
+        DPU_ASSERT(dpu_launch(e->rank[r],DPU_ASYNCHRONOUS));
+    }
+    for(uint32_t r=0;r<nr;++r){
+        const uint32_t first=e->rank_first[r];
+        DPU_ASSERT(dpu_sync(e->rank[r]));
+        read_labels(e->rank[r],e->rank_first[r+1]-first,&e->part[first],labels,
+                    sizeof *labels,e->stage);
+    }
+}
+
+/* the buffers; the DPU set stays the caller's */
+static inline void engine_free(engine_t *e)
+{
+    free(e->rank); free(e->rank_first);
+    free(e->part); free(e->arg); free(e->tail); free(e->stage);
+}
+
+#endif /* PIM_HOST_H */
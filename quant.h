@@ -0,0 +1,193 @@
+#ifndef QUANT_H
+#define QUANT_H
+
+/*
+ * Host-side quantisation of real features into the DPU's integer format.
+ *
+ * Feature f is stored as q = round((x - offset[f]) / scale[f]) in the kernel's
+ * feature type feat_t, saturated to ±FEAT_QMAX (common.h). offset[f] centres the feature
+ * (its mid-range, or its mean with QUANT_STD) and scale[f] maps its
+ * half-range onto qmax.
+ *
+ * Arbitrary per-feature scales would change the Euclidean metric the kernel
+ * minimises, so scale[f] is the widest feature's scale divided by a power of
+ * two, scale0 / 2^e[f]. The real squared distance is then, up to the constant
+ * factor scale0^2 / 4^E (E = max e[f]), the sum of the squared differences of
+ * feature f shifted left by wshift[f] = 2 (E - e[f]): shifts only, as the DPU
+ * has no 32-bit multiplier. Each feature keeps at least half of the integer
+ * range unless it is more than 2^QUANT_MAX_EXP times narrower than the widest.
+ *
+ * The double kernel (FEATURE_FLOAT) takes the real values unchanged.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "common.h"
+
+enum { QUANT_RANGE = 0, QUANT_STD = 1 };
+
+#define QUANT_MAX_EXP  8       /* bounds wshift to 16: int64 distances hold */
+#define QUANT_STD_SPAN 4.0     /* QUANT_STD maps mean ± 4 stddev onto ±qmax */
+
+/* real value of the i-th feature (row-major index) of some source */
+typedef double (*quant_value_fn)(const void *src, size_t i);
+
+typedef struct {
+    uint32_t D;
+    double   offset[MAX_FEATURES];
+    double   scale[MAX_FEATURES];
+    uint8_t  wshift[WSHIFT_BYTES];   /* broadcast to the DPU as "c_wshift" */
+} quant_t;
+
+/* stored values already are the integers: x = offset + q * scale */
+static inline void quant_identity(quant_t *q, uint32_t D,
+                                  double scale, double offset)
+{
+    memset(q, 0, sizeof *q);
+    q->D = D;
+    for (uint32_t f = 0; f < D; ++f) { q->scale[f] = scale; q->offset[f] = offset; }
+}
+
+/* per-feature range and moments of some points: partial statistics of
+   disjoint parts (e.g. the shards of several nodes) merge feature by
+   feature, min, max and sums */
+typedef struct {
+    double lo[MAX_FEATURES], hi[MAX_FEATURES];
+    double s1[MAX_FEATURES], s2[MAX_FEATURES];
+    double n;
+} quant_stats_t;
+
+static inline void quant_stats(quant_stats_t *st, quant_value_fn val, const void *src,
+                               size_t N, uint32_t D)
+{
+    for (uint32_t f = 0; f < D; ++f) {
+        st->lo[f] = INFINITY; st->hi[f] = -INFINITY; st->s1[f] = st->s2[f] = 0.0;
+    }
+    st->n = (double)N;
+    for (size_t i = 0; i < N; ++i)
+        for (uint32_t f = 0; f < D; ++f) {
+            double x = val(src, i * D + f);
+            if (x < st->lo[f]) st->lo[f] = x;
+            if (x > st->hi[f]) st->hi[f] = x;
+            st->s1[f] += x; st->s2[f] += x * x;
+        }
+}
+
+/* choose offset/scale/wshift from the statistics of the points */
+static inline void quant_fit_stats(quant_t *q, const quant_stats_t *st, uint32_t D, int mode)
+{
+#if FEATURE_FLOAT
+    (void)st; (void)mode;
+    quant_identity(q, D, 1.0, 0.0);
+#else
+    const double *lo = st->lo, *hi = st->hi, N = st->n;
+    double half[MAX_FEATURES], hmax = 0.0;
+    memset(q, 0, sizeof *q);
+    q->D = D;
+
+    for (uint32_t f = 0; f < D; ++f) {
+        if (mode == QUANT_STD) {
+            double mean = st->s1[f] / N, var = st->s2[f] / N - mean * mean;
+            double span = QUANT_STD_SPAN * sqrt(var > 0.0 ? var : 0.0);
+            double reach = fmax(hi[f] - mean, mean - lo[f]);
+            q->offset[f] = mean;
+            half[f] = fmin(span, reach);
+        } else {
+            q->offset[f] = 0.5 * (lo[f] + hi[f]);
+            half[f] = 0.5 * (hi[f] - lo[f]);
+        }
+        if (half[f] > hmax) hmax = half[f];
+    }
+
+    const double scale0 = hmax > 0.0 ? hmax / FEAT_QMAX : 1.0;
+    int e[MAX_FEATURES], E = 0;
+    for (uint32_t f = 0; f < D; ++f) {
+        e[f] = 0;
+        while (e[f] < QUANT_MAX_EXP && half[f] * (2 << e[f]) <= hmax) e[f]++;
+        if (e[f] > E) E = e[f];
+        q->scale[f] = ldexp(scale0, -e[f]);
+    }
+    for (uint32_t f = 0; f < D; ++f) q->wshift[f] = (uint8_t)(2 * (E - e[f]));
+#endif
+}
+
+/* choose offset/scale/wshift for N points of D features */
+static inline void quant_fit(quant_t *q, quant_value_fn val, const void *src,
+                             size_t N, uint32_t D, int mode)
+{
+#if FEATURE_FLOAT
+    (void)val; (void)src; (void)N; (void)mode;
+    quant_identity(q, D, 1.0, 0.0);
+#else
+    quant_stats_t st;
+    quant_stats(&st, val, src, N, D);
+    quant_fit_stats(q, &st, D, mode);
+#endif
+}
+
+/* quantise the N points first.. of val/src into dst[N*D] */
+static inline void quant_encode_rows(const quant_t *q, quant_value_fn val,
+                                     const void *src, size_t first, size_t N,
+                                     feat_t *dst)
+{
+    const uint32_t D = q->D;
+    for (size_t i = 0; i < N; ++i)
+        for (uint32_t f = 0; f < D; ++f) {
+            const double x = val(src, (first + i) * D + f);
+#if FEATURE_FLOAT
+            dst[i * D + f] = x;
+#else
+            long v = lrint((x - q->offset[f]) / q->scale[f]);
+            if (v >  FEAT_QMAX) v =  FEAT_QMAX;
+            if (v < -FEAT_QMAX) v = -FEAT_QMAX;
+            dst[i * D + f] = (feat_t)v;
+#endif
+        }
+}
+
+/* quantise N points from val/src into dst[N*D] */
+static inline void quant_encode(const quant_t *q, quant_value_fn val,
+                                const void *src, size_t N, feat_t *dst)
+{
+    quant_encode_rows(q, val, src, 0, N, dst);
+}
+
+static inline double quant_decode(const quant_t *q, uint32_t f, double v)
+{
+    return q->offset[f] + v * q->scale[f];
+}
+
+/* the kernel's weighted squared distance (see above) */
+static inline dist_t quant_dist2(const feat_t *a, const feat_t *b,
+                                 const uint8_t *wshift, uint32_t D)
+{
+    dist_t dsq = 0;
+    for (uint32_t f = 0; f < D; ++f) {
+#if FEATURE_FLOAT
+        double d = a[f] - b[f];
+        dsq += d * d;
+        (void)wshift;
+#else
+        int64_t d = (int64_t)a[f] - b[f];
+        dsq += (d * d) << wshift[f];
+#endif
+    }
+    return dsq;
+}
+
+/* sum / cnt, integers rounded to nearest: the centroid update of host and
+   CPU reference */
+static inline feat_t quant_mean(acc_sum_t sum, uint64_t cnt)
+{
+#if FEATURE_FLOAT
+    return sum / (double)cnt;
+#else
+    const int64_t c = (int64_t)cnt;
+    return (feat_t)(sum >= 0 ? (sum + c / 2) / c : -((-sum + c / 2) / c));
+#endif
+}
+
+#endif /* QUANT_H */
@@ -0,0 +1,78 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+/* host-side folding of per-DPU partial records (layout in common.h) */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+
+/* sum the records of DPUs [first, first+n) into cnt[K] / sum[K*D] */
+static inline void rec_fold(uint64_t *cnt, acc_sum_t *sum,
+                            const uint8_t *recs, size_t rb,
+                            uint32_t first, uint32_t n,
+                            uint32_t K, uint32_t D)
+{
+    memset(cnt, 0, K * sizeof *cnt);
+    memset(sum, 0, (size_t)K * D * sizeof *sum);
+#if SPARSE
+    const size_t eb = rec_ent_bytes(D);
+    for (uint32_t i = first; i < first + n; ++i) {
+        const uint8_t *rec = recs + (size_t)i * rb;
+        const uint32_t m = ((const rec_hdr_t *)rec)->entries;
+        const uint8_t *e = rec + rec_ent_off();
+        for (uint32_t q = 0; q < m; ++q, e += eb) {
+            const rec_entry_t *en = (const rec_entry_t *)e;
+            const rec_sum_t *ls = (const rec_sum_t *)(en + 1);
+            cnt[en->k] += en->count;
+            for (uint32_t f = 0; f < D; ++f)
+                sum[(size_t)en->k * D + f] += ls[f];
+        }
+    }
+#else
+    for (uint32_t i = first; i < first + n; ++i) {
+        const uint8_t *rec = recs + (size_t)i * rb;
+        const uint64_t *lc = (const uint64_t *)(rec + rec_cnt_off());
+        const rec_sum_t *ls = (const rec_sum_t *)(rec + rec_sum_off(K));
+        for (uint32_t k = 0; k < K; ++k) {
+            cnt[k] += lc[k];
+            for (uint32_t f = 0; f < D; ++f)
+                sum[k * D + f] += ls[k * D + f];
+        }
+    }
+#endif
+}
+
+/*
+ * Running global accumulator. Each rank folds its own DPUs without locking
+ * and then merges its K*D partial under the lock, so the serialised part of
+ * the reduction is O(ranks*K*D) instead of O(NR*K*D).
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t *cnt;
+    acc_sum_t *sum;           /* global sums need more than a record's */
+    uint32_t  K, D;
+} global_acc_t;
+
+static inline void acc_reset(global_acc_t *g)
+{
+    memset(g->cnt, 0, g->K * sizeof *g->cnt);
+    memset(g->sum, 0, (size_t)g->K * g->D * sizeof *g->sum);
+}
+
+static inline void acc_merge(global_acc_t *g,
+                             const uint64_t *cnt, const acc_sum_t *sum)
+{
+    pthread_mutex_lock(&g->lock);
+    for (uint32_t k = 0; k < g->K; ++k) {
+        g->cnt[k] += cnt[k];
+        for (uint32_t f = 0; f < g->D; ++f)
+            g->sum[k * g->D + f] += sum[k * g->D + f];
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+#endif /* REDUCE_H */
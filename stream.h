@@ -0,0 +1,96 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+/*
+ * Shard rotation for datasets larger than the DPUs' aggregate MRAM.
+ *
+ * The dataset is cut into shards of at most shard_points points. Shard i is
+ * read into one of two staging buffers by a helper thread while the DPUs are
+ * still busy with shard i-1, so reading the source (disk, mapping, …)
+ * overlaps with scatter, compute and gather of the previous shard.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/* copy points [first, first+n) of the source into dst (row-major) */
+typedef void (*shard_read_fn)(void *src, uint64_t first, uint32_t n, void *dst);
+
+typedef struct {
+    shard_read_fn read;
+    void         *src;
+    uint64_t      n_points;
+    size_t        pt_bytes;      /* bytes per point                        */
+    uint64_t      shard_points;  /* points per shard (last may be shorter) */
+    uint32_t      nshards;
+
+    void         *buf[2];        /* staging buffers                        */
+    uint32_t      slot;          /* buffer the pending shard goes to       */
+    uint32_t      pending;       /* shard being read                       */
+    int           busy;
+    pthread_t     th;
+} shard_stream_t;
+
+static inline uint64_t shard_first(const shard_stream_t *s, uint32_t i)
+{
+    return (uint64_t)i * s->shard_points;
+}
+
+static inline uint32_t shard_len(const shard_stream_t *s, uint32_t i)
+{
+    uint64_t left = s->n_points - shard_first(s, i);
+    return (uint32_t)(left < s->shard_points ? left : s->shard_points);
+}
+
+static void *shard_worker(void *arg)
+{
+    shard_stream_t *s = arg;
+    s->read(s->src, shard_first(s, s->pending), shard_len(s, s->pending),
+            s->buf[s->slot]);
+    return NULL;
+}
+
+/* returns 0 on success, -1 if the staging buffers cannot be allocated */
+static inline int stream_init(shard_stream_t *s, shard_read_fn read, void *src,
+                              uint64_t n_points, size_t pt_bytes,
+                              uint64_t shard_points)
+{
+    s->read = read; s->src = src;
+    s->n_points = n_points; s->pt_bytes = pt_bytes;
+    s->shard_points = shard_points;
+    s->nshards = (uint32_t)((n_points + shard_points - 1) / shard_points);
+    s->slot = 0; s->pending = 0; s->busy = 0;
+    /* padded to 8 bytes so a shard can be scattered without a copy */
+    size_t bytes = (shard_points * pt_bytes + 7UL) & ~7UL;
+    s->buf[0] = malloc(bytes);
+    s->buf[1] = malloc(bytes);
+    return (s->buf[0] && s->buf[1]) ? 0 : -1;
+}
+
+/* start reading shard i into the next staging buffer */
+static inline void stream_prefetch(shard_stream_t *s, uint32_t i)
+{
+    s->slot ^= 1;
+    s->pending = i;
+    s->busy = 1;
+    if (pthread_create(&s->th, NULL, shard_worker, s) != 0) {
+        shard_worker(s);                 /* no thread: read inline */
+        s->busy = 0;
+    }
+}
+
+/* wait for the pending shard and return its buffer */
+static inline void *stream_wait(shard_stream_t *s)
+{
+    if (s->busy) { pthread_join(s->th, NULL); s->busy = 0; }
+    return s->buf[s->slot];
+}
+
+static inline void stream_free(shard_stream_t *s)
+{
+    stream_wait(s);
+    free(s->buf[0]); free(s->buf[1]);
+}
+
+#endif /* STREAM_H */